@@ -139,6 +139,14 @@ ffi_status ffi_prep_cif_core(ffi_cif *cif,
 			     ffi_type *rtype,
 			     ffi_type **atypes);
 
+#ifdef FFI_NATIVE_BIND_CLOSURES
+/* Set up CLOSURE to forward to its target without the generic closure
+   machinery, or fail if CIF does not allow it.  */
+ffi_status ffi_prep_closure_bind_machdep (ffi_bind_closure *closure,
+					  ffi_cif *cif,
+					  void *codeloc) FFI_HIDDEN;
+#endif
+
 /* Translate a data pointer to a code pointer.  Needed for closures on
    some targets.  */
 void *ffi_data_to_code_pointer (void *data) FFI_HIDDEN;
@@ -151,6 +159,22 @@ int ffi_tramp_is_present (void *closure) FFI_HIDDEN;
    writable and executable filesystem. */
 int open_temp_exec_file(void) FFI_HIDDEN;
 
+#ifdef FFI_BOUND_CALLS
+/* Allocate SIZE bytes for generated code.  Return the address to write
+   the code at, and store the address it will run at in *CODE.  */
+void *ffi_code_alloc (size_t size, void **code) FFI_HIDDEN;
+
+/* Make CODE, as stored by ffi_code_alloc, executable, register
+   EH_FRAME (its run address, which may be NULL) with the unwinder and
+   record the SIZE bytes of code under NAME for profilers.  Return zero
+   on success.  */
+int ffi_code_seal (void *code, size_t size, void *eh_frame,
+		   const char *name) FFI_HIDDEN;
+
+/* Free CODE, which must have been sealed, or have failed to seal.  */
+void ffi_code_free (void *code) FFI_HIDDEN;
+#endif
+
 /* Extended cif, used in callback from assembly routine */
 typedef struct
 {
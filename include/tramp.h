@@ -37,6 +37,8 @@ void *ffi_tramp_alloc (int flags);
 void ffi_tramp_set_parms (void *tramp, void *data, void *code);
 void *ffi_tramp_get_addr (void *tramp);
 void ffi_tramp_free (void *tramp);
+size_t ffi_tramp_trim (size_t keep);
+void ffi_tramp_get_stats (size_t *tables, size_t *nfree, size_t *nused);
 
 #ifdef __cplusplus
 }
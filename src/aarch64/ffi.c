@@ -250,9 +250,9 @@ is_vfp_type (const ffi_type *ty)
    The terse state variable names match the names used in the AARCH64
    PCS.
 
-   The struct area is allocated downwards from the top of the argument
-   area.  It is used to hold copies of structures passed by value that are
-   bigger than 16 bytes.  */
+   The struct area holds copies of structures passed by value that are
+   bigger than 16 bytes.  It is allocated upwards from zero, and placed
+   above the stack arguments once their size is known.  */
 
 struct arg_state
 {
@@ -268,21 +268,20 @@ struct arg_state
 
 /* Initialize a procedure call argument marshalling state.  */
 static void
-arg_init (struct arg_state *state, size_t size)
+arg_init (struct arg_state *state)
 {
   state->ngrn = 0;
   state->nsrn = 0;
   state->nsaa = 0;
-  state->next_struct_area = size;
+  state->next_struct_area = 0;
 #if defined (__APPLE__)
   state->allocating_variadic = 0;
 #endif
 }
 
-/* Allocate an aligned slot on the stack and return a pointer to it.  */
-static void *
-allocate_to_stack (struct arg_state *state, void *stack,
-		   size_t alignment, size_t size)
+/* Allocate an aligned slot on the stack and return its offset.  */
+static size_t
+allocate_to_stack (struct arg_state *state, size_t alignment, size_t size)
 {
   size_t nsaa = state->nsaa;
 
@@ -299,22 +298,18 @@ allocate_to_stack (struct arg_state *state, void *stack,
   nsaa = FFI_ALIGN (nsaa, alignment);
   state->nsaa = nsaa + size;
 
-  return (char *)stack + nsaa;
+  return nsaa;
 }
 
-/* Allocate and copy a structure that is passed by value on the stack and
-   return a pointer to it.  */
-static void *
-allocate_and_copy_struct_to_stack (struct arg_state *state, void *stack,
-				   size_t alignment, size_t size, void *value)
+/* Allocate space for a copy of a structure that is passed by value
+   on the stack and return its offset within the struct area.  */
+static size_t
+allocate_struct_area (struct arg_state *state, size_t alignment, size_t size)
 {
-  size_t dest = state->next_struct_area - size;
+  size_t dest = FFI_ALIGN (state->next_struct_area, alignment);
 
-  /* Round down to the natural alignment of the value.  */
-  dest = FFI_ALIGN_DOWN (dest, alignment);
-  state->next_struct_area = dest;
-
-  return memcpy ((char *) stack + dest, value, size);
+  state->next_struct_area = dest + size;
+  return dest;
 }
 
 static ffi_arg
@@ -521,20 +516,185 @@ compress_hfa_type (void *dest, void *reg, int h)
 }
 #endif
 
-/* Either allocate an appropriate register for the argument type, or if
-   none are available, allocate a stack slot and return a pointer
-   to the allocated space.  */
+/* Assign every argument of CIF to a register or a stack slot, filling
+   PLAN if it is not null, and return the size of the outgoing argument
+   area: the stack arguments followed by the copies of large composites.
+   CIF->FLAGS must already be final.  */
 
-static void *
-allocate_int_to_reg_or_stack (struct call_context *context,
-			      struct arg_state *state,
-			      void *stack, size_t size)
+static size_t
+aarch64_plan_args (ffi_cif *cif, ffi_aarch64_arg *plan)
+{
+  struct arg_state state;
+  ffi_aarch64_arg scratch;
+  size_t base;
+  int i, nargs, isvariadic;
+
+  isvariadic = (cif->flags & AARCH64_FLAG_VARARG) != 0;
+  arg_init (&state);
+
+  for (i = 0, nargs = cif->nargs; i < nargs; i++)
+    {
+      ffi_aarch64_arg *e = plan ? &plan[i] : &scratch;
+      ffi_type *ty = cif->arg_types[i];
+      size_t s = ty->size;
+      int h, t = ty->type;
+
+      e->offset = 0;
+      e->copy = 0;
+      e->size = (unsigned) s;
+      e->kind = AARCH64_ARG_STACK;
+      e->reg = 0;
+      e->type = (unsigned char) t;
+      e->h = 0;
+
+      switch (t)
+	{
+	case FFI_TYPE_VOID:
+	  FFI_ASSERT (0);
+	  break;
+
+	/* If the argument is a basic type the argument is allocated to an
+	   appropriate register, or if none are available, to the stack.  */
+	case FFI_TYPE_INT:
+	case FFI_TYPE_UINT8:
+	case FFI_TYPE_SINT8:
+	case FFI_TYPE_UINT16:
+	case FFI_TYPE_SINT16:
+	case FFI_TYPE_UINT32:
+	case FFI_TYPE_SINT32:
+	case FFI_TYPE_UINT64:
+	case FFI_TYPE_SINT64:
+	case FFI_TYPE_POINTER:
+	  if (state.ngrn < N_X_ARG_REG)
+	    {
+	      e->kind = AARCH64_ARG_X;
+	      e->reg = state.ngrn++;
+	    }
+	  else
+	    {
+	      state.ngrn = N_X_ARG_REG;
+	      e->kind = AARCH64_ARG_X_STACK;
+	      e->offset = allocate_to_stack (&state, ty->alignment, s);
+	    }
+	  break;
+
+	case FFI_TYPE_FLOAT:
+	case FFI_TYPE_DOUBLE:
+	case FFI_TYPE_LONGDOUBLE:
+	case FFI_TYPE_STRUCT:
+	case FFI_TYPE_COMPLEX:
+	  /* Win64 passes the floating-point and HFA arguments of a
+	     variadic function like any other composite, in X registers
+	     or by reference.  */
+	  h = (cif->abi == FFI_WIN64 && isvariadic) ? 0 : is_vfp_type (ty);
+	  if (h)
+	    {
+	      unsigned elems = 4 - (h & 3);
+
+	      e->h = (unsigned char) h;
+	      if (state.nsrn + elems <= N_V_ARG_REG)
+		{
+		  e->kind = AARCH64_ARG_V;
+		  e->reg = state.nsrn;
+		  state.nsrn += elems;
+		  break;
+		}
+	      state.nsrn = N_V_ARG_REG;
+	      e->kind = AARCH64_ARG_STACK;
+	      e->offset = allocate_to_stack (&state, ty->alignment, s);
+	    }
+	  else if (s > 16)
+	    {
+	      /* If the argument is a composite type that is larger than 16
+		 bytes, then the argument is copied to memory, and
+		 the argument is replaced by a pointer to the copy.  */
+	      e->copy = allocate_struct_area (&state, ty->alignment, s);
+	      e->type = FFI_TYPE_POINTER;
+	      if (state.ngrn < N_X_ARG_REG)
+		{
+		  e->kind = AARCH64_ARG_REF_X;
+		  e->reg = state.ngrn++;
+		}
+	      else
+		{
+		  state.ngrn = N_X_ARG_REG;
+		  e->kind = AARCH64_ARG_REF_STACK;
+		  e->offset = allocate_to_stack (&state, sizeof (void *),
+						 sizeof (void *));
+		}
+	    }
+	  else
+	    {
+	      unsigned n = (unsigned) (s + 7) / 8;
+	      if (state.ngrn + n <= N_X_ARG_REG)
+		{
+		  /* If the argument is a composite type and the size in
+		     double-words is not more than the number of available
+		     X registers, then the argument is copied into
+		     consecutive X registers.  */
+		  e->kind = AARCH64_ARG_COPY_X;
+		  e->reg = state.ngrn;
+		  state.ngrn += n;
+		}
+	      else
+		{
+		  /* Otherwise, there are insufficient X registers. Further
+		     X register allocations are prevented, the NSAA is
+		     adjusted and the argument is copied to memory at the
+		     adjusted NSAA.  */
+		  state.ngrn = N_X_ARG_REG;
+		  e->kind = AARCH64_ARG_STACK;
+		  e->offset = allocate_to_stack (&state, ty->alignment, s);
+		}
+	    }
+	  break;
+
+	default:
+	  abort();
+	}
+
+#if defined (__APPLE__)
+      if (i + 1 == cif->aarch64_nfixedargs)
+	{
+	  state.ngrn = N_X_ARG_REG;
+	  state.nsrn = N_V_ARG_REG;
+	  state.allocating_variadic = 1;
+	}
+#endif
+    }
+
+  base = FFI_ALIGN (state.nsaa, 16);
+  for (i = 0; plan && i < nargs; i++)
+    if (plan[i].kind == AARCH64_ARG_REF_X
+	|| plan[i].kind == AARCH64_ARG_REF_STACK)
+      plan[i].copy += (unsigned) base;
+  return FFI_ALIGN (base + state.next_struct_area, 16);
+}
+
+/* Build the plan kept in CIF, if it has room for one, and make sure
+   CIF->BYTES covers the outgoing argument area.  */
+
+static void
+aarch64_prep_plan (ffi_cif *cif)
 {
-  if (state->ngrn < N_X_ARG_REG)
-    return &context->x[state->ngrn++];
+  size_t bytes;
 
-  state->ngrn = N_X_ARG_REG;
-  return allocate_to_stack (state, stack, size, size);
+  bytes = aarch64_plan_args (cif, (cif->nargs <= FFI_AARCH64_PLAN_ARGS
+				   ? cif->aarch64_plan : NULL));
+  if (bytes > cif->bytes)
+    cif->bytes = (unsigned) bytes;
+}
+
+/* Return the placement plan for CIF, building it in SCRATCH when the
+   cif has too many arguments to keep one.  */
+
+static inline const ffi_aarch64_arg *
+aarch64_get_plan (ffi_cif *cif, ffi_aarch64_arg *scratch)
+{
+  if (cif->nargs <= FFI_AARCH64_PLAN_ARGS)
+    return cif->aarch64_plan;
+  aarch64_plan_args (cif, scratch);
+  return scratch;
 }
 
 ffi_status FFI_HIDDEN
@@ -617,6 +777,8 @@ ffi_prep_cif_machdep (ffi_cif *cif)
   cif->aarch64_nfixedargs = 0;
 #endif
 
+  aarch64_prep_plan (cif);
+
   return FFI_OK;
 }
 
@@ -628,6 +790,9 @@ ffi_prep_cif_machdep_var(ffi_cif *cif, unsigned int nfixedargs,
 {
   ffi_status status = ffi_prep_cif_machdep (cif);
   cif->aarch64_nfixedargs = nfixedargs;
+  /* Arguments after the fixed ones are placed differently.  */
+  if (status == FFI_OK)
+    aarch64_prep_plan (cif);
   return status;
 }
 #else
@@ -636,6 +801,9 @@ ffi_prep_cif_machdep_var(ffi_cif *cif, unsigned int nfixedargs, unsigned int nto
 {
   ffi_status status = ffi_prep_cif_machdep (cif);
   cif->flags |= AARCH64_FLAG_VARARG;
+  /* Win64 passes variadic floating-point arguments in X registers.  */
+  if (status == FFI_OK)
+    aarch64_prep_plan (cif);
   return status;
 }
 #endif /* __APPLE__ */
@@ -644,6 +812,75 @@ extern void ffi_call_SYSV (struct call_context *context, void *frame,
 			   void (*fn)(void), void *rvalue, int flags,
 			   void *closure) FFI_HIDDEN;
 
+/* Copy the arguments AVALUE into CONTEXT and the argument area STACK,
+   as described by PLAN.  */
+static inline void
+aarch64_marshal (const ffi_aarch64_arg *plan, int nargs, void **avalue,
+		 struct call_context *context, void *stack)
+{
+  int i;
+
+  for (i = 0; i < nargs; i++)
+    {
+      const ffi_aarch64_arg *e = &plan[i];
+      void *a = avalue[i];
+      void *dest;
+
+      switch (e->kind)
+	{
+	case AARCH64_ARG_REF_X:
+	case AARCH64_ARG_REF_STACK:
+	  dest = memcpy ((char *) stack + e->copy, a, e->size);
+	  a = &dest;
+	  if (e->kind == AARCH64_ARG_REF_X)
+	    context->x[e->reg] = extend_integer_type (a, FFI_TYPE_POINTER);
+	  else
+	    {
+	      void *d = (char *) stack + e->offset;
+#ifdef __APPLE__
+	      memcpy (d, a, sizeof (void *));
+#else
+	      *(ffi_arg *)d = extend_integer_type (a, FFI_TYPE_POINTER);
+#endif
+	    }
+	  break;
+
+	case AARCH64_ARG_X:
+	  context->x[e->reg] = extend_integer_type (a, e->type);
+	  break;
+
+	case AARCH64_ARG_X_STACK:
+	  {
+	    void *d = (char *) stack + e->offset;
+	    /* Note that the default abi extends each argument
+	       to a full 64-bit slot, while the iOS abi allocates
+	       only enough space. */
+#ifdef __APPLE__
+	    memcpy (d, a, e->size);
+#else
+	    *(ffi_arg *)d = extend_integer_type (a, e->type);
+#endif
+	  }
+	  break;
+
+	case AARCH64_ARG_V:
+	  extend_hfa_type (&context->v[e->reg], a, e->h);
+	  break;
+
+	case AARCH64_ARG_COPY_X:
+	  memcpy (&context->x[e->reg], a, e->size);
+	  break;
+
+	case AARCH64_ARG_STACK:
+	  memcpy ((char *) stack + e->offset, a, e->size);
+	  break;
+
+	default:
+	  abort();
+	}
+    }
+}
+
 /* Call a function with the provided arguments and capture the return
    value.
    n.b. ffi_call_SYSV will steal the alloca'd `stack` variable here for use
@@ -655,21 +892,18 @@ ffi_call_int (ffi_cif *cif, void (*fn)(void), void *orig_rvalue,
 {
   struct call_context *context;
   void *stack, *frame, *rvalue;
-  struct arg_state state;
+  const ffi_aarch64_arg *plan;
   size_t stack_bytes, rtype_size, rsize;
-  int i, nargs, flags, isvariadic = 0;
+  int nargs, flags;
   ffi_type *rtype;
 
   flags = cif->flags;
   rtype = cif->rtype;
   rtype_size = rtype->size;
   stack_bytes = cif->bytes;
+  nargs = cif->nargs;
 
-  if (flags & AARCH64_FLAG_VARARG)
-  {
-    isvariadic = 1;
-    flags &= ~AARCH64_FLAG_VARARG;
-  }
+  flags &= ~AARCH64_FLAG_VARARG;
 
   /* If the target function returns a structure via hidden pointer,
      then we cannot allow a null rvalue.  Otherwise, mash a null
@@ -685,6 +919,9 @@ ffi_call_int (ffi_cif *cif, void (*fn)(void), void *orig_rvalue,
   else if (flags & AARCH64_RET_NEED_COPY)
     rsize = 16;
 
+  plan = aarch64_get_plan (cif, (nargs <= FFI_AARCH64_PLAN_ARGS ? NULL
+				 : alloca (nargs * sizeof (ffi_aarch64_arg))));
+
   /* Allocate consecutive stack for everything we'll need.
      The frame uses 40 bytes for: lr, fp, rvalue, flags, sp */
   context = alloca (sizeof(struct call_context) + stack_bytes + 40 + rsize);
@@ -692,153 +929,105 @@ ffi_call_int (ffi_cif *cif, void (*fn)(void), void *orig_rvalue,
   frame = (void*)((uintptr_t)stack + (uintptr_t)stack_bytes);
   rvalue = (rsize ? (void*)((uintptr_t)frame + 40) : orig_rvalue);
 
-  arg_init (&state, stack_bytes);
-  for (i = 0, nargs = cif->nargs; i < nargs; i++)
-    {
-      ffi_type *ty = cif->arg_types[i];
-      size_t s = ty->size;
-      void *a = avalue[i];
-      int h, t;
-      void *dest;
+  aarch64_marshal (plan, nargs, avalue, context, stack);
 
-      t = ty->type;
-      switch (t)
-	{
-	case FFI_TYPE_VOID:
-	  FFI_ASSERT (0);
-	  break;
+  ffi_call_SYSV (context, frame, fn, rvalue, flags, closure);
 
-	/* If the argument is a basic type the argument is allocated to an
-	   appropriate register, or if none are available, to the stack.  */
-	case FFI_TYPE_INT:
-	case FFI_TYPE_UINT8:
-	case FFI_TYPE_SINT8:
-	case FFI_TYPE_UINT16:
-	case FFI_TYPE_SINT16:
-	case FFI_TYPE_UINT32:
-	case FFI_TYPE_SINT32:
-	case FFI_TYPE_UINT64:
-	case FFI_TYPE_SINT64:
-	case FFI_TYPE_POINTER:
-	do_pointer:
-	  {
-	    ffi_arg ext = extend_integer_type (a, t);
-	    if (state.ngrn < N_X_ARG_REG)
-	      context->x[state.ngrn++] = ext;
-	    else
-	      {
-		void *d = allocate_to_stack (&state, stack, ty->alignment, s);
-		state.ngrn = N_X_ARG_REG;
-		/* Note that the default abi extends each argument
-		   to a full 64-bit slot, while the iOS abi allocates
-		   only enough space. */
-#ifdef __APPLE__
-		memcpy(d, a, s);
-#else
-		*(ffi_arg *)d = ext;
-#endif
-	      }
-	  }
-	  break;
+  if (flags & AARCH64_RET_NEED_COPY)
+    memcpy (orig_rvalue, rvalue, rtype_size);
+}
 
-	case FFI_TYPE_FLOAT:
-	case FFI_TYPE_DOUBLE:
-	case FFI_TYPE_LONGDOUBLE:
-	case FFI_TYPE_STRUCT:
-	case FFI_TYPE_COMPLEX:
-	  {
-	    h = is_vfp_type (ty);
-	    if (h)
-	      {
-              int elems = 4 - (h & 3);
-              if (cif->abi == FFI_WIN64 && isvariadic)
-              {
-                if (state.ngrn + elems <= N_X_ARG_REG)
-                {
-                  dest = &context->x[state.ngrn];
-                  state.ngrn += elems;
-                  extend_hfa_type(dest, a, h);
-                  break;
-                }
-                state.nsrn = N_X_ARG_REG;
-                dest = allocate_to_stack(&state, stack, ty->alignment, s);
-              }
-              else
-              {
-                if (state.nsrn + elems <= N_V_ARG_REG)
-                {
-                  dest = &context->v[state.nsrn];
-                  state.nsrn += elems;
-                  extend_hfa_type (dest, a, h);
-                  break;
-                }
-                state.nsrn = N_V_ARG_REG;
-                dest = allocate_to_stack (&state, stack, ty->alignment, s);
-              }
-	      }
-	    else if (s > 16)
-	      {
-		/* If the argument is a composite type that is larger than 16
-		   bytes, then the argument is copied to memory, and
-		   the argument is replaced by a pointer to the copy.  */
-		dest = allocate_and_copy_struct_to_stack (&state, stack,
-							  ty->alignment, s,
-							  avalue[i]);
-		a = &dest;
-		t = FFI_TYPE_POINTER;
-		s = sizeof (void *);
-		goto do_pointer;
-	      }
-	    else
-	      {
-		size_t n = (s + 7) / 8;
-		if (state.ngrn + n <= N_X_ARG_REG)
-		  {
-		    /* If the argument is a composite type and the size in
-		       double-words is not more than the number of available
-		       X registers, then the argument is copied into
-		       consecutive X registers.  */
-		    dest = &context->x[state.ngrn];
-                    state.ngrn += (unsigned int)n;
-		  }
-		else
-		  {
-		    /* Otherwise, there are insufficient X registers. Further
-		       X register allocations are prevented, the NSAA is
-		       adjusted and the argument is copied to memory at the
-		       adjusted NSAA.  */
-		    state.ngrn = N_X_ARG_REG;
-		    dest = allocate_to_stack (&state, stack, ty->alignment, s);
-		  }
-		}
-	      memcpy (dest, a, s);
-	    }
-	  break;
+void
+ffi_call (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue)
+{
+  ffi_call_int (cif, fn, rvalue, avalue, NULL);
+}
 
-	default:
-	  abort();
-	}
+/* As ffi_call_int, for N calls.  The plan, the stack and the return
+   value handling are set up once; each call then only marshals its
+   arguments and enters ffi_call_SYSV.  The callee's frame reuses the
+   context, so the arguments are stored again for each call.  Call K
+   takes its arguments from AVALUES[K] if AVALUES is non-null, and
+   otherwise from the columns BASE[i] + K * STRIDE[i].  Its return value
+   goes to RVALUES[K] if RVALUES is non-null, and otherwise to
+   OUT + K * OUT_STRIDE.  */
+FFI_ASAN_NO_SANITIZE
+static void
+aarch64_call_n (ffi_cif *cif, void (*fn) (void), size_t n, void **rvalues,
+		void ***avalues, const void **base, const size_t *stride,
+		char *out, size_t out_stride)
+{
+  struct call_context *context;
+  void *stack, *frame, *scratch;
+  void **row = NULL;
+  const ffi_aarch64_arg *plan;
+  size_t stack_bytes, rtype_size, rsize, k;
+  int nargs, flags, i;
+
+  flags = cif->flags & ~AARCH64_FLAG_VARARG;
+  rtype_size = cif->rtype->size;
+  stack_bytes = cif->bytes;
+  nargs = cif->nargs;
 
-#if defined (__APPLE__)
-      if (i + 1 == cif->aarch64_nfixedargs)
+  if (avalues == NULL)
+    row = alloca (nargs * sizeof (void *));
+
+  rsize = 0;
+  if (flags & AARCH64_RET_IN_MEM)
+    rsize = rtype_size;
+  else if (flags & AARCH64_RET_NEED_COPY)
+    rsize = 16;
+
+  plan = aarch64_get_plan (cif, (nargs <= FFI_AARCH64_PLAN_ARGS ? NULL
+				 : alloca (nargs * sizeof (ffi_aarch64_arg))));
+
+  context = alloca (sizeof(struct call_context) + stack_bytes + 40 + rsize);
+  stack = context + 1;
+  frame = (void*)((uintptr_t)stack + (uintptr_t)stack_bytes);
+  scratch = (void*)((uintptr_t)frame + 40);
+
+  for (k = 0; k < n; k++)
+    {
+      void **avalue = avalues ? avalues[k] : row;
+      void *orig_rvalue = (rvalues ? rvalues[k]
+			   : out ? out + k * out_stride : NULL);
+      void *rvalue = orig_rvalue;
+      int f = flags;
+
+      if (f & AARCH64_RET_IN_MEM)
 	{
-	  state.ngrn = N_X_ARG_REG;
-	  state.nsrn = N_V_ARG_REG;
-	  state.allocating_variadic = 1;
+	  if (rvalue == NULL)
+	    rvalue = scratch;
 	}
-#endif
-    }
+      else if (rvalue == NULL)
+	f &= AARCH64_FLAG_ARG_V;
+      else if (f & AARCH64_RET_NEED_COPY)
+	rvalue = scratch;
 
-  ffi_call_SYSV (context, frame, fn, rvalue, flags, closure);
+      for (i = 0; row && i < nargs; i++)
+	row[i] = (char *) base[i] + k * stride[i];
 
-  if (flags & AARCH64_RET_NEED_COPY)
-    memcpy (orig_rvalue, rvalue, rtype_size);
+      aarch64_marshal (plan, nargs, avalue, context, stack);
+      ffi_call_SYSV (context, frame, fn, rvalue, f, NULL);
+
+      if (f & AARCH64_RET_NEED_COPY)
+	memcpy (orig_rvalue, rvalue, rtype_size);
+    }
 }
 
 void
-ffi_call (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue)
+ffi_call_batch (ffi_cif *cif, void (*fn) (void), size_t n, void **rvalues,
+		void ***avalues)
 {
-  ffi_call_int (cif, fn, rvalue, avalue, NULL);
+  aarch64_call_n (cif, fn, n, rvalues, avalues, NULL, NULL, NULL, 0);
+}
+
+void
+ffi_call_strided (ffi_cif *cif, void (*fn) (void), size_t n,
+		  const void *base[], const size_t stride[],
+		  void *out, size_t out_stride)
+{
+  aarch64_call_n (cif, fn, n, NULL, NULL, base, stride, out, out_stride);
 }
 
 #if FFI_CLOSURES
@@ -986,138 +1175,65 @@ ffi_closure_SYSV_inner (ffi_cif *cif,
 			void *stack, void *rvalue, void *struct_rvalue)
 {
   void **avalue = (void**) alloca (cif->nargs * sizeof (void*));
-  int i, h, nargs, flags, isvariadic = 0;
-  struct arg_state state;
+  const ffi_aarch64_arg *plan;
+  int i, nargs, flags;
 
-  arg_init (&state, cif->bytes);
+  flags = cif->flags & ~AARCH64_FLAG_VARARG;
+  nargs = cif->nargs;
 
-  flags = cif->flags;
-  if (flags & AARCH64_FLAG_VARARG)
-  {
-    isvariadic = 1;
-    flags &= ~AARCH64_FLAG_VARARG;
-  }
+  plan = aarch64_get_plan (cif, (nargs <= FFI_AARCH64_PLAN_ARGS ? NULL
+				 : alloca (nargs * sizeof (ffi_aarch64_arg))));
 
-  for (i = 0, nargs = cif->nargs; i < nargs; i++)
+  for (i = 0; i < nargs; i++)
     {
-      ffi_type *ty = cif->arg_types[i];
-      int t = ty->type;
-      size_t n, s = ty->size;
+      const ffi_aarch64_arg *e = &plan[i];
+      void *reg;
 
-      switch (t)
+      switch (e->kind)
 	{
-	case FFI_TYPE_VOID:
-	  FFI_ASSERT (0);
+	case AARCH64_ARG_X:
+	case AARCH64_ARG_COPY_X:
+	  avalue[i] = &context->x[e->reg];
 	  break;
 
-	case FFI_TYPE_INT:
-	case FFI_TYPE_UINT8:
-	case FFI_TYPE_SINT8:
-	case FFI_TYPE_UINT16:
-	case FFI_TYPE_SINT16:
-	case FFI_TYPE_UINT32:
-	case FFI_TYPE_SINT32:
-	case FFI_TYPE_UINT64:
-	case FFI_TYPE_SINT64:
-	case FFI_TYPE_POINTER:
-	  avalue[i] = allocate_int_to_reg_or_stack (context, &state, stack, s);
+	case AARCH64_ARG_X_STACK:
+	case AARCH64_ARG_STACK:
+	  avalue[i] = (char *) stack + e->offset;
 	  break;
 
-	case FFI_TYPE_FLOAT:
-	case FFI_TYPE_DOUBLE:
-	case FFI_TYPE_LONGDOUBLE:
-	case FFI_TYPE_STRUCT:
-	case FFI_TYPE_COMPLEX:
-	  h = is_vfp_type (ty);
-	  if (h)
-	    {
-	      n = 4 - (h & 3);
-              if (cif->abi == FFI_WIN64 && isvariadic)
-                {
-                  if (state.ngrn + n <= N_X_ARG_REG)
-                    {
-                      void *reg = &context->x[state.ngrn];
-                      state.ngrn += (unsigned int)n;
-
-                      /* Eeek! We need a pointer to the structure, however the
-                       homogeneous float elements are being passed in individual
-                       registers, therefore for float and double the structure
-                       is not represented as a contiguous sequence of bytes in
-                       our saved register context.  We don't need the original
-                       contents of the register storage, so we reformat the
-                       structure into the same memory.  */
-                      avalue[i] = compress_hfa_type(reg, reg, h);
-                    }
-                  else
-                    {
-                      state.ngrn = N_X_ARG_REG;
-                      state.nsrn = N_V_ARG_REG;
-                      avalue[i] = allocate_to_stack(&state, stack,
-                             ty->alignment, s);
-                    }
-                }
-              else
-                {
-                  if (state.nsrn + n <= N_V_ARG_REG)
-                    {
-                      void *reg = &context->v[state.nsrn];
-                      state.nsrn += (unsigned int)n;
-                      avalue[i] = compress_hfa_type(reg, reg, h);
-                    }
-                  else
-                    {
-                      state.nsrn = N_V_ARG_REG;
-                      avalue[i] = allocate_to_stack(&state, stack,
-                                                   ty->alignment, s);
-                    }
-                }
-            }
-          else if (s > 16)
-            {
-              /* Replace Composite type of size greater than 16 with a
-                  pointer.  */
+	case AARCH64_ARG_V:
+	  reg = &context->v[e->reg];
+	  /* Eeek! We need a pointer to the structure, however the
+	     homogeneous float elements are being passed in individual
+	     registers, therefore for float and double the structure
+	     is not represented as a contiguous sequence of bytes in
+	     our saved register context.  We don't need the original
+	     contents of the register storage, so we reformat the
+	     structure into the same memory.  */
+	  avalue[i] = compress_hfa_type (reg, reg, e->h);
+	  break;
+
+	case AARCH64_ARG_REF_X:
+	case AARCH64_ARG_REF_STACK:
+	  /* Replace Composite type of size greater than 16 with a
+	     pointer.  */
+	  reg = (e->kind == AARCH64_ARG_REF_X
+		 ? (void *) &context->x[e->reg]
+		 : (void *) ((char *) stack + e->offset));
 #ifdef __ILP32__
-             UINT64 avalue_tmp;
-             memcpy (&avalue_tmp,
-                  allocate_int_to_reg_or_stack (context, &state,
-                                               stack, sizeof (void *)),
-                  sizeof (UINT64));
-             avalue[i] = (void *)(UINT32)avalue_tmp;
+	  {
+	    UINT64 avalue_tmp;
+	    memcpy (&avalue_tmp, reg, sizeof (UINT64));
+	    avalue[i] = (void *)(UINT32)avalue_tmp;
+	  }
 #else
-              avalue[i] = *(void **)
-              allocate_int_to_reg_or_stack (context, &state, stack,
-                                         sizeof (void *));
+	  avalue[i] = *(void **) reg;
 #endif
-            }
-          else
-            {
-              n = (s + 7) / 8;
-              if (state.ngrn + n <= N_X_ARG_REG)
-                {
-                  avalue[i] = &context->x[state.ngrn];
-                  state.ngrn += (unsigned int)n;
-                }
-              else
-                {
-                  state.ngrn = N_X_ARG_REG;
-                  avalue[i] = allocate_to_stack(&state, stack,
-                                           ty->alignment, s);
-                }
-            }
-          break;
-
-        default:
-          abort();
-      }
+	  break;
 
-#if defined (__APPLE__)
-      if (i + 1 == cif->aarch64_nfixedargs)
-	{
-	  state.ngrn = N_X_ARG_REG;
-	  state.nsrn = N_V_ARG_REG;
-	  state.allocating_variadic = 1;
+	default:
+	  abort();
 	}
-#endif
     }
 
   if (flags & AARCH64_RET_IN_MEM)
@@ -53,6 +53,23 @@ typedef enum ffi_abi
     FFI_DEFAULT_ABI = FFI_SYSV
 #endif
   } ffi_abi;
+
+/* Placement of one argument, computed once by ffi_prep_cif_machdep.
+   KIND says whether it goes to X register REG, V register REG or the
+   stack at OFFSET; composites larger than 16 bytes are first copied
+   to COPY in the outgoing argument area.  See src/aarch64/ffi.c.  */
+typedef struct {
+  unsigned offset;
+  unsigned copy;
+  unsigned size;
+  unsigned char kind;
+  unsigned char reg;
+  unsigned char type;
+  unsigned char h;
+} ffi_aarch64_arg;
+
+/* Cifs with more arguments than this compute their plan on the fly.  */
+#define FFI_AARCH64_PLAN_ARGS 16
 #endif
 
 /* ---- Definitions for closures ----------------------------------------- */
@@ -75,15 +92,25 @@ typedef enum ffi_abi
 #endif
 
 #ifdef _WIN32
-#define FFI_EXTRA_CIF_FIELDS unsigned is_variadic
+#define FFI_EXTRA_CIF_FIELDS unsigned is_variadic; \
+  ffi_aarch64_arg aarch64_plan[FFI_AARCH64_PLAN_ARGS]
 #endif
 #define FFI_TARGET_SPECIFIC_VARIADIC
 
 /* ---- Internal ---- */
 
+/* ffi.c provides ffi_call_batch and ffi_call_strided.  */
+#define FFI_NATIVE_CALL_BATCH 1
+
 #if defined (__APPLE__)
-#define FFI_EXTRA_CIF_FIELDS unsigned aarch64_nfixedargs
-#elif !defined(_WIN32) && !defined(__ANDROID__)
+#define FFI_EXTRA_CIF_FIELDS unsigned aarch64_nfixedargs; \
+  ffi_aarch64_arg aarch64_plan[FFI_AARCH64_PLAN_ARGS]
+#elif !defined(_WIN32)
+#define FFI_EXTRA_CIF_FIELDS \
+  ffi_aarch64_arg aarch64_plan[FFI_AARCH64_PLAN_ARGS]
+#endif
+
+#if !defined (__APPLE__) && !defined(_WIN32) && !defined(__ANDROID__)
 /* iOS, Windows and Android reserve x18 for the system.  Disable Go closures until
    a new static chain is chosen.  */
 #define FFI_GO_CLOSURES 1
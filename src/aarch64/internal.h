@@ -63,6 +63,15 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.  */
 #define AARCH64_FLAG_ARG_V	(1 << AARCH64_FLAG_ARG_V_BIT)
 #define AARCH64_FLAG_VARARG	(1 << 8)
 
+/* Argument placements recorded in ffi_aarch64_arg.kind.  */
+#define AARCH64_ARG_X		0	/* integer in X register */
+#define AARCH64_ARG_X_STACK	1	/* integer on the stack */
+#define AARCH64_ARG_V		2	/* HFA in V registers */
+#define AARCH64_ARG_COPY_X	3	/* composite copied to X registers */
+#define AARCH64_ARG_STACK	4	/* composite or HFA on the stack */
+#define AARCH64_ARG_REF_X	5	/* pointer to copy in X register */
+#define AARCH64_ARG_REF_STACK	6	/* pointer to copy on the stack */
+
 #define N_X_ARG_REG		8
 #define N_V_ARG_REG		8
 #define CALL_CONTEXT_SIZE	(N_V_ARG_REG * 16 + N_X_ARG_REG * 8)
@@ -0,0 +1,264 @@
+/* -----------------------------------------------------------------------
+   arena.c - Copyright (c) 2026 The libffi authors
+
+   Arenas of cifs, types and closures that are released together.
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   ``Software''), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be included
+   in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED ``AS IS'', WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+   HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+   WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+   DEALINGS IN THE SOFTWARE.
+   ----------------------------------------------------------------------- */
+
+#include <ffi.h>
+#include <ffi_common.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An arena is a list of blocks carved up in order.  The arena itself
+   lives at the start of its first block.  Closures come from
+   ffi_closure_alloc, since they need executable memory, and the arena
+   keeps a list of them to free.  */
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_MIN 4096
+#define ARENA_BLOCK_MAX (256 * 1024)
+
+struct ffi_arena_block
+{
+  struct ffi_arena_block *next;
+  char *cur;
+  char *end;
+};
+
+#if FFI_CLOSURES
+struct ffi_arena_closure
+{
+  struct ffi_arena_closure *next;
+  void *closure;
+};
+#endif
+
+struct ffi_arena
+{
+  struct ffi_arena_block *blocks;
+  size_t block_size;
+#if FFI_CLOSURES
+  struct ffi_arena_closure *closures;
+#endif
+};
+
+static char *
+arena_align (char *p)
+{
+  return (char *) FFI_ALIGN ((uintptr_t) p, ARENA_ALIGN);
+}
+
+static struct ffi_arena_block *
+arena_block_new (size_t size)
+{
+  struct ffi_arena_block *b;
+
+  b = malloc (size);
+  if (b == NULL)
+    return NULL;
+  b->next = NULL;
+  b->cur = arena_align ((char *) (b + 1));
+  b->end = (char *) b + size;
+  return b;
+}
+
+ffi_arena *
+ffi_arena_create (size_t block_size)
+{
+  struct ffi_arena_block *b;
+  ffi_arena *arena;
+
+  if (block_size < ARENA_BLOCK_MIN)
+    block_size = ARENA_BLOCK_MIN;
+
+  b = arena_block_new (block_size);
+  if (b == NULL)
+    return NULL;
+  arena = (ffi_arena *) b->cur;
+  b->cur = arena_align (b->cur + sizeof (*arena));
+  arena->blocks = b;
+  arena->block_size = block_size;
+#if FFI_CLOSURES
+  arena->closures = NULL;
+#endif
+  return arena;
+}
+
+void
+ffi_arena_destroy (ffi_arena *arena)
+{
+  struct ffi_arena_block *b, *next;
+
+  if (arena == NULL)
+    return;
+
+#if FFI_CLOSURES
+  {
+    struct ffi_arena_closure *c;
+
+    for (c = arena->closures; c != NULL; c = c->next)
+      ffi_closure_free (c->closure);
+  }
+#endif
+
+  /* The arena itself is in one of the blocks.  */
+  for (b = arena->blocks; b != NULL; b = next)
+    {
+      next = b->next;
+      free (b);
+    }
+}
+
+void *
+ffi_arena_alloc (ffi_arena *arena, size_t size)
+{
+  struct ffi_arena_block *b = arena->blocks;
+  size_t block_size;
+  char *p;
+
+  if ((size_t) (b->end - b->cur) < size)
+    {
+      /* Blocks grow up to ARENA_BLOCK_MAX.  Larger requests get a
+	 block of their own, kept behind the current one so that the
+	 rest of that can still be used.  */
+      block_size = arena->block_size;
+      if (block_size < ARENA_BLOCK_MAX)
+	block_size *= 2;
+      if (size > block_size - sizeof (*b) - ARENA_ALIGN)
+	{
+	  if (size > SIZE_MAX - sizeof (*b) - ARENA_ALIGN)
+	    return NULL;
+	  b = arena_block_new (size + sizeof (*b) + ARENA_ALIGN);
+	  if (b == NULL)
+	    return NULL;
+	  b->next = arena->blocks->next;
+	  arena->blocks->next = b;
+	  b->cur = b->end;
+	  return arena_align ((char *) (b + 1));
+	}
+
+      b = arena_block_new (block_size);
+      if (b == NULL)
+	return NULL;
+      arena->block_size = block_size;
+      b->next = arena->blocks;
+      arena->blocks = b;
+    }
+
+  p = b->cur;
+  b->cur = arena_align (p + size);
+  if (b->cur > b->end)
+    b->cur = b->end;
+  return p;
+}
+
+ffi_type *
+ffi_arena_struct (ffi_arena *arena, ffi_type **elements, size_t n)
+{
+  ffi_type *t;
+  size_t i;
+
+  if (n == 0 || elements == NULL
+      || n > (SIZE_MAX - sizeof (ffi_type)) / sizeof (ffi_type *) - 1)
+    return NULL;
+  for (i = 0; i < n; i++)
+    if (elements[i] == NULL)
+      return NULL;
+
+  t = ffi_arena_alloc (arena,
+		       sizeof (ffi_type) + (n + 1) * sizeof (ffi_type *));
+  if (t == NULL)
+    return NULL;
+  t->size = 0;
+  t->alignment = 0;
+  t->type = FFI_TYPE_STRUCT;
+  t->elements = (ffi_type **) (t + 1);
+  memcpy (t->elements, elements, n * sizeof (ffi_type *));
+  t->elements[n] = NULL;
+
+  if (ffi_get_struct_offsets (FFI_DEFAULT_ABI, t, NULL) != FFI_OK)
+    return NULL;
+  return t;
+}
+
+ffi_cif *
+ffi_arena_prep_cif (ffi_arena *arena, ffi_abi abi, ffi_type *rtype,
+		    unsigned int nargs, ffi_type **atypes, unsigned int nfixed)
+{
+  struct ffi_arena_block *b = arena->blocks;
+  char *mark = b->cur;
+  ffi_type **types;
+  ffi_status status;
+  ffi_cif *cif;
+
+  if (nfixed > nargs)
+    return NULL;
+
+  /* The argument types follow the cif.  */
+  cif = ffi_arena_alloc (arena,
+			 sizeof (ffi_cif) + nargs * sizeof (ffi_type *));
+  if (cif == NULL)
+    return NULL;
+  types = (ffi_type **) (cif + 1);
+  if (nargs)
+    memcpy (types, atypes, nargs * sizeof (ffi_type *));
+
+  if (nfixed != 0)
+    status = ffi_prep_cif_var (cif, abi, nfixed, nargs, rtype, types);
+  else
+    status = ffi_prep_cif (cif, abi, nargs, rtype, types);
+  if (status != FFI_OK)
+    {
+      /* Give the space back if it came from the same block.  */
+      if (arena->blocks == b)
+	b->cur = mark;
+      return NULL;
+    }
+  return cif;
+}
+
+#if FFI_CLOSURES
+void *
+ffi_arena_closure_alloc (ffi_arena *arena, size_t size, void **code)
+{
+  struct ffi_arena_closure *c;
+  void *closure;
+
+  /* Allocate the closure first, so that a failure leaves nothing
+     behind in the arena.  */
+  closure = ffi_closure_alloc (size, code);
+  if (closure == NULL)
+    return NULL;
+  c = ffi_arena_alloc (arena, sizeof (*c));
+  if (c == NULL)
+    {
+      ffi_closure_free (closure);
+      return NULL;
+    }
+  c->closure = closure;
+  c->next = arena->closures;
+  arena->closures = c;
+  return closure;
+}
+#endif
@@ -31,11 +31,12 @@
 #define _GNU_SOURCE 1
 #endif
 
-#ifndef __wasm__
-
 #include <fficonfig.h>
 #include <ffi.h>
 #include <ffi_common.h>
+
+#ifndef __wasm__
+
 #include <tramp.h>
 
 #ifdef __NetBSD__
@@ -576,6 +577,376 @@ static int dlmunmap(void *, size_t);
 
 #if !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX)
 
+/* A page index of closure memory, so that finding the executable
+   address of a closure, or the writable address of its code, does not
+   walk dlmalloc's segment list.  dlmmap records the pages of every new
+   mapping, and dlmunmap forgets them.  Each entry holds the offset from
+   the writable to the executable pages, whose low bits are clear, and
+   CODE_INDEX_DATA or CODE_INDEX_CODE to tell which side the page is
+   on; pages mapped writable and executable at once have both.
+
+   The index is a three-level radix tree covering 48-bit addresses
+   (all of them on 32-bit hosts).  Updates are made with dlmalloc's
+   lock held and nodes are never freed, so lookups need no lock.
+   Addresses outside the tree, or any miss after a node could not be
+   allocated, fall back to the segment list.  */
+
+#include <stdint.h>
+
+#define FFI_CODE_INDEX 1
+/* With the index, finding the writable address behind a code address
+   is cheap, so ffi_closure_free accepts either.  */
+#ifndef FFI_CLOSURE_FREE_CODE
+# define FFI_CLOSURE_FREE_CODE 1
+#endif
+#define CODE_INDEX_SHIFT 12
+#if UINTPTR_MAX > 0xffffffffu
+# define CODE_INDEX_BITS 12
+#else
+# define CODE_INDEX_BITS 7
+#endif
+#define CODE_INDEX_FANOUT ((uintptr_t) 1 << CODE_INDEX_BITS)
+#define CODE_INDEX_DATA 1
+#define CODE_INDEX_CODE 2
+
+#ifdef __GNUC__
+# define code_index_load(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+# define code_index_store(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#else
+# define code_index_load(p) (*(p))
+# define code_index_store(p, v) (*(p) = (v))
+#endif
+
+static intptr_t **code_index_root[CODE_INDEX_FANOUT];
+static int code_index_incomplete;
+
+/* Return the entry for the page holding ADDR, allocating the nodes on
+   the way if ALLOC, or NULL.  */
+static intptr_t *
+code_index_entry (uintptr_t addr, int alloc)
+{
+  uintptr_t page = addr >> CODE_INDEX_SHIFT;
+  intptr_t **mid, *leaf;
+  uintptr_t i = (page >> (2 * CODE_INDEX_BITS)) & (CODE_INDEX_FANOUT - 1);
+  uintptr_t j = (page >> CODE_INDEX_BITS) & (CODE_INDEX_FANOUT - 1);
+
+  if (page >> (3 * CODE_INDEX_BITS))
+    return NULL;
+
+  mid = code_index_load (&code_index_root[i]);
+  if (mid == NULL)
+    {
+      if (!alloc || (mid = calloc (CODE_INDEX_FANOUT, sizeof (*mid))) == NULL)
+	return NULL;
+      code_index_store (&code_index_root[i], mid);
+    }
+  leaf = code_index_load (&mid[j]);
+  if (leaf == NULL)
+    {
+      if (!alloc || (leaf = calloc (CODE_INDEX_FANOUT, sizeof (*leaf))) == NULL)
+	return NULL;
+      code_index_store (&mid[j], leaf);
+    }
+  return &leaf[page & (CODE_INDEX_FANOUT - 1)];
+}
+
+/* Set the entries for the LENGTH bytes at START to VALUE.  */
+static void
+code_index_set (char *start, size_t length, intptr_t value)
+{
+  size_t i;
+
+  for (i = 0; i < length; i += (size_t) 1 << CODE_INDEX_SHIFT)
+    {
+      intptr_t *e = code_index_entry ((uintptr_t) start + i, value != 0);
+
+      if (e != NULL)
+	code_index_store (e, value);
+      else if (value != 0)
+	code_index_incomplete = 1;
+    }
+}
+
+/* Record the LENGTH bytes mapped writable at START and executable at
+   START + OFFSET, or forget them if ADD is zero.  */
+static void
+code_index_update (char *start, size_t length, ptrdiff_t offset, int add)
+{
+  if (offset == 0)
+    code_index_set (start, length,
+		    add ? CODE_INDEX_DATA | CODE_INDEX_CODE : 0);
+  else
+    {
+      code_index_set (start, length, add ? offset | CODE_INDEX_DATA : 0);
+      code_index_set (start + offset, length,
+		      add ? offset | CODE_INDEX_CODE : 0);
+    }
+}
+
+/* Look up ADDR, an executable address if CODE, else a writable one.
+   Return 1 and set *OFFSET if it is closure memory, 0 if it is not,
+   and -1 if the index cannot tell.  */
+static int
+code_index_lookup (void *addr, int code, ptrdiff_t *offset)
+{
+  intptr_t *e = code_index_entry ((uintptr_t) addr, 0);
+  intptr_t v = e ? code_index_load (e) : 0;
+
+  if (v & (code ? CODE_INDEX_CODE : CODE_INDEX_DATA))
+    {
+      *offset = v & ~(intptr_t) (CODE_INDEX_DATA | CODE_INDEX_CODE);
+      return 1;
+    }
+  if (code_index_incomplete
+      || ((uintptr_t) addr >> CODE_INDEX_SHIFT >> (3 * CODE_INDEX_BITS)))
+    return -1;
+  return 0;
+}
+
+#endif /* !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX) */
+
+/* Return segment holding given code address.  */
+static msegmentptr
+segment_holding_code (mstate m, char* addr)
+{
+  msegmentptr sp = &m->seg;
+  for (;;) {
+    if (addr >= add_segment_exec_offset (sp->base, sp)
+	&& addr < add_segment_exec_offset (sp->base, sp) + sp->size)
+      return sp;
+    if ((sp = sp->next) == 0)
+      return 0;
+  }
+}
+
+/* Set *OFFSET to the distance from the writable to the executable
+   address of the closure memory at ADDR, which is an executable address
+   if CODE is nonzero.  Return zero if ADDR is not closure memory.  */
+static int
+closure_exec_offset (void *addr, int code, ptrdiff_t *offset)
+{
+  msegmentptr seg;
+
+#if FFI_CODE_INDEX
+  int found = code_index_lookup (addr, code, offset);
+
+  if (found >= 0)
+    return found;
+#endif
+  seg = (code ? segment_holding_code (gm, addr)
+	 : segment_holding (gm, addr));
+  if (seg == NULL)
+    return 0;
+  *offset = seg->exec_offset;
+  return 1;
+}
+
+/* Counters for ffi_closure_get_stats.  Closures allocated and freed
+   through a per-thread cache are counted in the cache instead.  */
+#define FFI_CLOSURE_STATS 1
+
+static size_t closure_allocs, closure_frees, closure_dlfrees;
+
+#if defined (_MSC_VER) && !defined (__clang__)
+#define closure_stat_add(p, n) (InterlockedExchangeAddSizeT ((p), (n)) + (n))
+#define closure_stat_load(p) (*(volatile size_t *) (p))
+#else
+#define closure_stat_add(p, n) __atomic_add_fetch ((p), (n), __ATOMIC_RELAXED)
+#define closure_stat_load(p) __atomic_load_n ((p), __ATOMIC_RELAXED)
+#endif
+
+#if !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX)
+#define closure_munmap dlmunmap
+#else
+#define closure_munmap(a, s) CALL_MUNMAP (a, s)
+/* Closure memory is always mapped writable and executable here.  */
+#define closure_exec_anon 1
+#endif
+
+/* Segments that hold no closures are kept for reuse as long as they
+   and the memory still in use fit in the recent peak of memory in use,
+   so that back-to-back bursts of closures do not map and unmap segments
+   each time.  The peak halves once use has stayed below half of it for
+   CLOSURE_PEAK_QUIET checks in a row, and CLOSURE_RETAIN_MIN bytes are
+   always kept.  This is checked once every CLOSURE_TRIM_CHECK frees that
+   reach dlmalloc.  */
+#define CLOSURE_RETAIN_MIN ((size_t) 256 << 10)
+#define CLOSURE_PEAK_QUIET 16
+#define CLOSURE_TRIM_CHECK 1024
+
+/* The recent peak, and the number of checks since use was near it.
+   Both are protected by the lock of gm.  */
+static size_t closure_peak;
+static unsigned closure_peak_quiet;
+
+/* Return the free chunk that covers segment SP, or 0 if SP holds
+   chunks in use or cannot be unmapped.  Such a segment holds one free
+   chunk and the segment record that add_segment put at its end,
+   followed by fenceposts.  Unlike release_unused_segments, do not
+   assume that the record is TOP_FOOT_SIZE from the end, which it need
+   not be.  */
+static mchunkptr
+segment_unused_chunk (msegmentptr sp)
+{
+  char *end = sp->base + sp->size;
+  mchunkptr p, q;
+  size_t *head;
+
+  if (!is_mmapped_segment (sp) || is_extern_segment (sp))
+    return 0;
+  p = align_as_chunk (sp->base);
+  if (cinuse (p) || is_small (chunksize (p)))
+    return 0;
+  q = next_chunk (p);
+  if ((char *) q >= end || !cinuse (q)
+      || chunksize (q) != pad_request (sizeof (struct malloc_segment)))
+    return 0;
+  for (head = &next_chunk (q)->head;
+       (char *) (head + 1) <= end && *head == FENCEPOST_HEAD; head++)
+    ;
+  if ((char *) head + MIN_CHUNK_SIZE <= end)
+    return 0;
+  return p;
+}
+
+/* Return the size of the segments of M that hold no closures.  M must
+   be locked.  */
+static size_t
+closure_unused_segments (mstate m)
+{
+  msegmentptr sp;
+  size_t unused = 0;
+
+  for (sp = m->seg.next; sp != 0; sp = sp->next)
+    if (segment_unused_chunk (sp) != 0)
+      unused += sp->size;
+  return unused;
+}
+
+/* As release_unused_segments, but do nothing unless the unused
+   segments, UNUSED bytes in all, add up to more than HIGH bytes, and
+   keep those that fit in KEEP bytes.  Store the size of the kept
+   segments in *KEPT and return the number of bytes released.  M must
+   be locked.  */
+static size_t
+closure_release_segments (mstate m, size_t unused, size_t high, size_t keep,
+			  size_t *kept)
+{
+  msegmentptr pred = &m->seg, sp, next;
+  size_t released = 0;
+  mchunkptr p;
+
+  *kept = 0;
+  if (unused == 0 || unused <= high)
+    {
+      *kept = unused;
+      return 0;
+    }
+
+  for (sp = pred->next; sp != 0; pred = sp, sp = next)
+    {
+      char *base = sp->base;
+      size_t size = sp->size;
+
+      next = sp->next;
+      if ((p = segment_unused_chunk (sp)) == 0)
+	continue;
+      if (*kept + size <= keep)
+	{
+	  *kept += size;
+	  continue;
+	}
+
+      if (p == m->dv)
+	{
+	  m->dv = 0;
+	  m->dvsize = 0;
+	}
+      else
+	{
+	  tchunkptr tp = (tchunkptr) p;
+
+	  unlink_large_chunk (m, tp);
+	}
+      if (closure_munmap (base, size) == 0)
+	{
+	  released += size;
+	  m->footprint -= size;
+	  sp = pred;
+	  sp->next = next;
+	}
+      else
+	{
+	  tchunkptr tp = (tchunkptr) p;
+
+	  insert_large_chunk (m, tp, chunksize (p));
+	  *kept += size;
+	}
+    }
+  return released;
+}
+
+/* As the first half of sys_trim: shrink the segment holding the top
+   chunk so that at most PAD bytes of the top stay mapped.  Return the
+   number of bytes released.  M must be locked.  */
+static size_t
+closure_trim_top (mstate m, size_t pad)
+{
+  size_t unit = mparams.granularity, extra;
+  msegmentptr sp;
+
+  if (pad >= MAX_REQUEST)
+    return 0;
+  pad += TOP_FOOT_SIZE;
+  if (m->topsize <= pad)
+    return 0;
+
+  extra = ((m->topsize - pad + (unit - SIZE_T_ONE)) / unit - SIZE_T_ONE) * unit;
+  sp = segment_holding (m, (char *) m->top);
+  if (extra == 0 || is_extern_segment (sp) || !is_mmapped_segment (sp)
+      || sp->size < extra || has_segment_link (m, sp)
+      || closure_munmap (sp->base + sp->size - extra, extra) != 0)
+    return 0;
+
+  sp->size -= extra;
+  m->footprint -= extra;
+  init_top (m, m->top, m->topsize - extra);
+  return extra;
+}
+
+/* Free the closure chunk PTR, and now and then release the unused
+   segments that do not fit in the recent peak.  */
+static void
+closure_dlfree (void *ptr)
+{
+  size_t unused, used, keep, kept;
+
+  dlfree (ptr);
+  if (closure_stat_add (&closure_dlfrees, 1) % CLOSURE_TRIM_CHECK == 0
+      && !PREACTION (gm))
+    {
+      unused = closure_unused_segments (gm);
+      used = gm->footprint > unused ? gm->footprint - unused : 0;
+      if (used > closure_peak)
+	closure_peak = used;
+      if (used > closure_peak / 2)
+	closure_peak_quiet = 0;
+      else if (++closure_peak_quiet >= CLOSURE_PEAK_QUIET)
+	{
+	  closure_peak /= 2;
+	  closure_peak_quiet = 0;
+	}
+
+      keep = closure_peak > used ? closure_peak - used : 0;
+      if (keep < CLOSURE_RETAIN_MIN)
+	keep = CLOSURE_RETAIN_MIN;
+      closure_release_segments (gm, unused, keep, keep, &kept);
+      POSTACTION (gm);
+    }
+}
+
+#if !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX)
+
 /* A mutex used to synchronize access to *exec* variables in this file.  */
 static pthread_mutex_t open_temp_exec_file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -742,6 +1113,12 @@ static struct
 /* Current index into open_temp_exec_file_opts.  */
 static int open_temp_exec_file_opts_idx = 0;
 
+/* The kind of the last temporary file opened.  */
+static int open_temp_exec_file_kind = FFI_CLOSURE_FILE_NONE;
+
+/* Whether closure memory was mapped writable and executable at once.  */
+static int closure_exec_anon;
+
 /* Reset a current multi-call func, then advances to the next entry.
    If we're at the last, go back to the first and return nonzero,
    otherwise return zero.  */
@@ -775,6 +1152,23 @@ open_temp_exec_file (void)
       fd = open_temp_exec_file_opts[open_temp_exec_file_opts_idx].func
 	(open_temp_exec_file_opts[open_temp_exec_file_opts_idx].arg);
 
+      if (fd != -1)
+	{
+	  int (*func)(const char *)
+	    = open_temp_exec_file_opts[open_temp_exec_file_opts_idx].func;
+	  int kind = FFI_CLOSURE_FILE_TMPDIR;
+
+#ifdef HAVE_MEMFD_CREATE
+	  if (func == open_temp_exec_file_memfd)
+	    kind = FFI_CLOSURE_FILE_MEMFD;
+#endif
+#ifdef HAVE_MNTENT
+	  if (func == open_temp_exec_file_mnt)
+	    kind = FFI_CLOSURE_FILE_MNTENT;
+#endif
+	  __atomic_store_n (&open_temp_exec_file_kind, kind, __ATOMIC_RELAXED);
+	}
+
       if (!open_temp_exec_file_opts[open_temp_exec_file_opts_idx].repeat
 	  || fd == -1)
 	{
@@ -890,8 +1284,8 @@ dlmmap_locked (void *start, size_t length, int prot, int flags, off_t offset)
 /* Map in a writable and executable chunk of memory if possible.
    Failing that, fall back to dlmmap_locked.  */
 static void *
-dlmmap (void *start, size_t length, int prot,
-	int flags, int fd, off_t offset)
+dlmmap_exec (void *start, size_t length, int prot,
+	     int flags, int fd, off_t offset)
 {
   void *ptr;
 
@@ -926,6 +1320,8 @@ dlmmap (void *start, size_t length, int prot,
     {
       ptr = mmap (start, length, prot | PROT_EXEC, flags, fd, offset);
 
+      if (ptr != MFAIL)
+	closure_exec_anon = 1;
       if (ptr != MFAIL || (errno != EPERM && errno != EACCES))
 	/* Cool, no need to mess with separate segments.  */
 	return ptr;
@@ -942,6 +1338,21 @@ dlmmap (void *start, size_t length, int prot,
   return ptr;
 }
 
+/* As dlmmap_exec, and record the new pages in the code index.  The
+   last word of a mapping holds the offset to its executable pages,
+   which is zero unless dlmmap_locked stored one.  */
+static void *
+dlmmap (void *start, size_t length, int prot,
+	int flags, int fd, off_t offset)
+{
+  void *ptr = dlmmap_exec (start, length, prot, flags, fd, offset);
+
+  if (ptr != MFAIL)
+    code_index_update (ptr, length, mmap_exec_offset ((char *) ptr, length),
+		       1);
+  return ptr;
+}
+
 /* Release memory at the given address, as well as the corresponding
    executable page if it's separate.  */
 static int
@@ -952,143 +1363,422 @@ dlmunmap (void *start, size_t length)
      We don't expect frequent deallocation anyway.  If we did, we
      could locate pages in the file by writing to the pages being
      deallocated and checking that the file contents change.
-     Yuck.  */
-  msegmentptr seg = segment_holding (gm, start);
-  void *code;
+     Yuck.  Where we can, we free the file pages through the writable
+     mapping, so that trimming closure memory does release it.  */
+  ptrdiff_t offset;
+  int ret;
 
-  if (seg && (code = add_segment_exec_offset (start, seg)) != start)
+  if (!closure_exec_offset (start, 0, &offset))
+    offset = 0;
+  if (offset != 0)
     {
-      int ret = munmap (code, length);
+#ifdef MADV_REMOVE
+      (void) madvise (start, length, MADV_REMOVE);
+#endif
+      ret = munmap ((char *) start + offset, length);
       if (ret)
 	return ret;
     }
 
-  return munmap (start, length);
+  ret = munmap (start, length);
+  if (ret == 0)
+    code_index_update (start, length, offset, 0);
+  return ret;
 }
 
-#if FFI_CLOSURE_FREE_CODE
-/* Return segment holding given code address.  */
-static msegmentptr
-segment_holding_code (mstate m, char* addr)
-{
-  msegmentptr sp = &m->seg;
-  for (;;) {
-    if (addr >= add_segment_exec_offset (sp->base, sp)
-	&& addr < add_segment_exec_offset (sp->base, sp) + sp->size)
-      return sp;
-    if ((sp = sp->next) == 0)
-      return 0;
-  }
-}
-#endif
+/* Each thread keeps a cache of free closure chunks in front of the
+   shared dlmalloc instance, with one stack per size class of
+   CLOSURE_CACHE_GRAIN bytes.  An empty stack is refilled with half its
+   depth from a single dlindependent_calloc call, and a full one hands
+   half its chunks back.  Cached chunks keep their static trampoline.
+   The cache of a thread is flushed when the thread exits.  */
 
-#endif /* !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX) */
+#define FFI_CLOSURE_CACHE 1
+#define CLOSURE_CACHE_GRAIN 16
+#define CLOSURE_CACHE_CLASSES 8
+#define CLOSURE_CACHE_DEPTH 32
 
-/* Allocate a chunk of memory with the given size.  Returns a pointer
-   to the writable address, and sets *CODE to the executable
-   corresponding virtual address.  */
-void *
-ffi_closure_alloc (size_t size, void **code)
+struct closure_cache
 {
-  void *ptr, *ftramp;
-
-  if (!code)
-    return NULL;
-
-  ptr = dlmalloc (size);
+  struct closure_cache *prev, *next;
+  size_t allocs, frees;
+  unsigned count[CLOSURE_CACHE_CLASSES];
+  void *chunk[CLOSURE_CACHE_CLASSES][CLOSURE_CACHE_DEPTH];
+};
 
-  if (ptr)
-    {
-      msegmentptr seg = segment_holding (gm, ptr);
+static pthread_key_t closure_cache_key;
+static pthread_once_t closure_cache_once = PTHREAD_ONCE_INIT;
+static int closure_cache_usable;
 
-      *code = FFI_FN (add_segment_exec_offset (ptr, seg));
-      if (!ffi_tramp_is_supported ())
-        return ptr;
+/* All live caches, so that their counters can be read.  The counters
+   of a cache are only written by its thread.  */
+static pthread_mutex_t closure_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct closure_cache *closure_caches;
 
-      ftramp = ffi_tramp_alloc (0);
-      if (ftramp == NULL)
-      {
-        dlfree (ptr);
-        return NULL;
-      }
-      *code = FFI_FN (ffi_tramp_get_addr (ftramp));
-      ((ffi_closure *) ptr)->ftramp = ftramp;
-    }
+#define closure_cache_count(p) \
+  __atomic_store_n ((p), *(p) + 1, __ATOMIC_RELAXED)
 
-  return ptr;
+/* Return a chunk, and its trampoline if it has one, to dlmalloc.  */
+static void
+closure_chunk_free (void *ptr)
+{
+  if (ffi_tramp_is_supported ())
+    ffi_tramp_free (((ffi_closure *) ptr)->ftramp);
+  closure_dlfree (ptr);
 }
 
-void *
-ffi_data_to_code_pointer (void *data)
+/* Return all the chunks of CACHE to dlmalloc.  */
+static void
+closure_cache_drain (struct closure_cache *cache)
 {
-  msegmentptr seg = segment_holding (gm, data);
-  /* We expect closures to be allocated with ffi_closure_alloc(), in
-     which case seg will be non-NULL.  However, some users take on the
-     burden of managing this memory themselves, in which case this
-     we'll just return data. */
-  if (seg)
+  unsigned c, i;
+
+  for (c = 0; c < CLOSURE_CACHE_CLASSES; c++)
     {
-      if (!ffi_tramp_is_supported ())
-        return add_segment_exec_offset (data, seg);
-      return ffi_tramp_get_addr (((ffi_closure *) data)->ftramp);
+      for (i = 0; i < cache->count[c]; i++)
+	closure_chunk_free (cache->chunk[c][i]);
+      cache->count[c] = 0;
     }
-  else
-    return data;
 }
 
-/* Release a chunk of memory allocated with ffi_closure_alloc.  If
-   FFI_CLOSURE_FREE_CODE is nonzero, the given address can be the
-   writable or the executable address given.  Otherwise, only the
-   writable address can be provided here.  */
-void
-ffi_closure_free (void *ptr)
+static void
+closure_cache_flush (void *arg)
 {
-#if FFI_CLOSURE_FREE_CODE
-  msegmentptr seg = segment_holding_code (gm, ptr);
-
-  if (seg)
-    ptr = sub_segment_exec_offset (ptr, seg);
-#endif
-  if (ffi_tramp_is_supported ())
-    ffi_tramp_free (((ffi_closure *) ptr)->ftramp);
+  struct closure_cache *cache = arg;
 
-  dlfree (ptr);
+  pthread_mutex_lock (&closure_cache_mutex);
+  if (cache->prev != NULL)
+    cache->prev->next = cache->next;
+  else
+    closure_caches = cache->next;
+  if (cache->next != NULL)
+    cache->next->prev = cache->prev;
+  closure_stat_add (&closure_allocs, cache->allocs);
+  closure_stat_add (&closure_frees, cache->frees);
+  pthread_mutex_unlock (&closure_cache_mutex);
+
+  closure_cache_drain (cache);
+  free (cache);
 }
 
-int
-ffi_tramp_is_present (void *ptr)
+static void
+closure_cache_init (void)
 {
-  msegmentptr seg = segment_holding (gm, ptr);
-  return seg != NULL && ffi_tramp_is_supported();
+  closure_cache_usable
+    = pthread_key_create (&closure_cache_key, closure_cache_flush) == 0;
 }
 
-# else /* ! FFI_MMAP_EXEC_WRIT */
-
-/* On many systems, memory returned by malloc is writable and
-   executable, so just use it.  */
-
-#include <stdlib.h>
-
-void *
-ffi_closure_alloc (size_t size, void **code)
+/* Return the calling thread's cache, creating it if necessary, or
+   NULL if it cannot have one.  */
+static struct closure_cache *
+closure_cache_get (void)
 {
-  void *c;
+  struct closure_cache *cache;
 
-  if (!code)
+  pthread_once (&closure_cache_once, closure_cache_init);
+  if (!closure_cache_usable)
     return NULL;
 
-  c = malloc (size);
-  *code = FFI_FN (c);
-  return c;
+  cache = pthread_getspecific (closure_cache_key);
+  if (cache == NULL)
+    {
+      cache = calloc (1, sizeof (*cache));
+      if (cache != NULL
+	  && pthread_setspecific (closure_cache_key, cache) != 0)
+	{
+	  free (cache);
+	  cache = NULL;
+	}
+      if (cache != NULL)
+	{
+	  pthread_mutex_lock (&closure_cache_mutex);
+	  cache->next = closure_caches;
+	  if (closure_caches != NULL)
+	    closure_caches->prev = cache;
+	  closure_caches = cache;
+	  pthread_mutex_unlock (&closure_cache_mutex);
+	}
+    }
+  return cache;
 }
 
-void
-ffi_closure_free (void *ptr)
+/* Add the counters of all caches to *ALLOCS and *FREES.  */
+static void
+closure_cache_stats (size_t *allocs, size_t *frees)
 {
-  free (ptr);
-}
+  struct closure_cache *cache;
 
-void *
+  pthread_mutex_lock (&closure_cache_mutex);
+  for (cache = closure_caches; cache != NULL; cache = cache->next)
+    {
+      *allocs += __atomic_load_n (&cache->allocs, __ATOMIC_RELAXED);
+      *frees += __atomic_load_n (&cache->frees, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&closure_cache_mutex);
+}
+
+/* Fill the empty stack for chunks of C grains.  */
+static int
+closure_cache_refill (struct closure_cache *cache, size_t c)
+{
+  void *chunks[CLOSURE_CACHE_DEPTH / 2];
+  unsigned i, n = CLOSURE_CACHE_DEPTH / 2;
+
+  if (dlindependent_calloc (n, c * CLOSURE_CACHE_GRAIN, chunks) == NULL)
+    return 0;
+
+  if (ffi_tramp_is_supported ())
+    for (i = 0; i < n; i++)
+      {
+	void *ftramp = ffi_tramp_alloc (0);
+
+	if (ftramp == NULL)
+	  {
+	    /* Keep the chunks that did get a trampoline.  */
+	    for (n = i; i < CLOSURE_CACHE_DEPTH / 2; i++)
+	      dlfree (chunks[i]);
+	    break;
+	  }
+	((ffi_closure *) chunks[i])->ftramp = ftramp;
+      }
+
+  memcpy (cache->chunk[c - 1], chunks, n * sizeof (void *));
+  cache->count[c - 1] = n;
+  return n > 0;
+}
+
+/* Put the free chunk PTR in the calling thread's cache, if it has a
+   cache and PTR is of a cached size.  */
+static int
+closure_cache_put (void *ptr)
+{
+  size_t c = dlmalloc_usable_size (ptr) / CLOSURE_CACHE_GRAIN;
+  struct closure_cache *cache;
+  unsigned *count, i;
+
+  if (c - 1 >= CLOSURE_CACHE_CLASSES || (cache = closure_cache_get ()) == NULL)
+    return 0;
+
+  count = &cache->count[c - 1];
+  if (*count == CLOSURE_CACHE_DEPTH)
+    {
+      for (i = CLOSURE_CACHE_DEPTH / 2; i < CLOSURE_CACHE_DEPTH; i++)
+	closure_chunk_free (cache->chunk[c - 1][i]);
+      *count = CLOSURE_CACHE_DEPTH / 2;
+    }
+  cache->chunk[c - 1][(*count)++] = ptr;
+  closure_cache_count (&cache->frees);
+  return 1;
+}
+
+#endif /* !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX) */
+
+/* Allocate a chunk of memory with the given size.  Returns a pointer
+   to the writable address, and sets *CODE to the executable
+   corresponding virtual address.  */
+void *
+ffi_closure_alloc (size_t size, void **code)
+{
+  void *ptr, *ftramp;
+
+  if (!code)
+    return NULL;
+
+#if FFI_CLOSURE_CACHE
+  {
+    size_t c = (size + CLOSURE_CACHE_GRAIN - 1) / CLOSURE_CACHE_GRAIN;
+    struct closure_cache *cache;
+
+    if (c - 1 < CLOSURE_CACHE_CLASSES
+	&& (cache = closure_cache_get ()) != NULL
+	&& (cache->count[c - 1] > 0 || closure_cache_refill (cache, c)))
+      {
+	ptr = cache->chunk[c - 1][--cache->count[c - 1]];
+	*code = FFI_FN (ffi_data_to_code_pointer (ptr));
+	closure_cache_count (&cache->allocs);
+	return ptr;
+      }
+  }
+#endif
+
+  ptr = dlmalloc (size);
+
+  if (ptr)
+    {
+      ptrdiff_t offset = 0;
+
+      closure_exec_offset (ptr, 0, &offset);
+      *code = FFI_FN ((char *) ptr + offset);
+      if (ffi_tramp_is_supported ())
+	{
+	  ftramp = ffi_tramp_alloc (0);
+	  if (ftramp == NULL)
+	    {
+	      dlfree (ptr);
+	      return NULL;
+	    }
+	  *code = FFI_FN (ffi_tramp_get_addr (ftramp));
+	  ((ffi_closure *) ptr)->ftramp = ftramp;
+	}
+      closure_stat_add (&closure_allocs, 1);
+    }
+
+  return ptr;
+}
+
+void *
+ffi_data_to_code_pointer (void *data)
+{
+  ptrdiff_t offset;
+
+  /* We expect closures to be allocated with ffi_closure_alloc(), in
+     which case they are in closure memory.  However, some users take
+     on the burden of managing this memory themselves, in which case
+     this we'll just return data. */
+  if (closure_exec_offset (data, 0, &offset))
+    {
+      if (!ffi_tramp_is_supported ())
+        return (char *) data + offset;
+      return ffi_tramp_get_addr (((ffi_closure *) data)->ftramp);
+    }
+  else
+    return data;
+}
+
+/* Release a chunk of memory allocated with ffi_closure_alloc.  If
+   FFI_CLOSURE_FREE_CODE is nonzero, the given address can be the
+   writable or the executable address given, unless the latter is a
+   static trampoline.  Otherwise, only the writable address can be
+   provided here.  */
+void
+ffi_closure_free (void *ptr)
+{
+#if FFI_CLOSURE_FREE_CODE
+  ptrdiff_t offset;
+
+  if (closure_exec_offset (ptr, 1, &offset))
+    ptr = (char *) ptr - offset;
+#endif
+#if FFI_CLOSURE_CACHE
+  if (closure_cache_put (ptr))
+    return;
+#endif
+  closure_stat_add (&closure_frees, 1);
+  if (ffi_tramp_is_supported ())
+    ffi_tramp_free (((ffi_closure *) ptr)->ftramp);
+
+  closure_dlfree (ptr);
+}
+
+/* Release segments that hold no closures, and trampoline tables whose
+   trampolines are all free, keeping up to KEEP_BYTES of them.  The
+   calling thread's cached closures are freed first.  Return the number
+   of bytes released.  */
+size_t
+ffi_closure_trim (size_t keep_bytes)
+{
+  size_t released = 0, kept = 0;
+#if FFI_CLOSURE_CACHE
+  struct closure_cache *cache = closure_cache_get ();
+
+  if (cache != NULL)
+    closure_cache_drain (cache);
+#endif
+
+  if (!PREACTION (gm))
+    {
+      if (is_initialized (gm))
+	{
+	  size_t pad;
+
+	  released = closure_release_segments (gm,
+					       closure_unused_segments (gm),
+					       0, keep_bytes, &kept);
+	  closure_peak = 0;
+	  closure_peak_quiet = 0;
+	  pad = kept < keep_bytes ? keep_bytes - kept : 0;
+	  released += closure_trim_top (gm, pad);
+	  kept += gm->topsize < pad ? gm->topsize : pad;
+	}
+      POSTACTION (gm);
+    }
+  if (ffi_tramp_is_supported ())
+    released += ffi_tramp_trim (kept < keep_bytes ? keep_bytes - kept : 0);
+  return released;
+}
+
+void
+ffi_closure_get_stats (ffi_closure_stats *stats)
+{
+  msegmentptr sp;
+
+  memset (stats, 0, sizeof (*stats));
+  stats->allocs = closure_stat_load (&closure_allocs);
+  stats->frees = closure_stat_load (&closure_frees);
+#if FFI_CLOSURE_CACHE
+  closure_cache_stats (&stats->allocs, &stats->frees);
+#endif
+  stats->live = stats->allocs - stats->frees;
+
+  if (!PREACTION (gm))
+    {
+      if (is_initialized (gm))
+	for (sp = &gm->seg; sp != 0; sp = sp->next)
+	  {
+	    stats->segments++;
+	    stats->segment_bytes += sp->size;
+	    if (closure_exec_anon || sp->exec_offset != 0)
+	      stats->exec_mappings++;
+	  }
+      stats->footprint = gm->footprint;
+      stats->max_footprint = gm->max_footprint;
+      POSTACTION (gm);
+    }
+
+  ffi_tramp_get_stats (&stats->tramp_tables, &stats->tramp_free,
+		       &stats->tramp_used);
+  stats->exec_mappings += stats->tramp_tables;
+#if !(defined(_WIN32) || defined(__OS2__)) || defined (__CYGWIN__) || defined(__INTERIX)
+  stats->exec_file
+    = __atomic_load_n (&open_temp_exec_file_kind, __ATOMIC_RELAXED);
+#endif
+}
+
+int
+ffi_tramp_is_present (void *ptr)
+{
+  ptrdiff_t offset;
+
+  return closure_exec_offset (ptr, 0, &offset) && ffi_tramp_is_supported();
+}
+
+# else /* ! FFI_MMAP_EXEC_WRIT */
+
+/* On many systems, memory returned by malloc is writable and
+   executable, so just use it.  */
+
+#include <stdlib.h>
+
+void *
+ffi_closure_alloc (size_t size, void **code)
+{
+  void *c;
+
+  if (!code)
+    return NULL;
+
+  c = malloc (size);
+  *code = FFI_FN (c);
+  return c;
+}
+
+void
+ffi_closure_free (void *ptr)
+{
+  free (ptr);
+}
+
+void *
 ffi_data_to_code_pointer (void *data)
 {
   return data;
@@ -1104,4 +1794,618 @@ ffi_tramp_is_present (__attribute__((unused)) void *ptr)
 #endif /* FFI_CLOSURES */
 
 #endif /* NetBSD with PROT_MPROTECT */
+
+#ifdef FFI_BOUND_CALLS
+
+/* Generated code is kept apart from the closure allocator.  Stubs are
+   packed into chunks of CODE_CHUNK_SIZE bytes of a memfd, mapped twice:
+   once read-only and executable, where the stubs run, and once writable,
+   where they are written.  When a chunk is full and the stubs being
+   written to it are sealed, its writable view is unmapped, so that only
+   the chunk being filled has a writable alias.  A chunk whose stubs have
+   all been freed is unmapped and its part of the memfd reused.
+
+   Where no memfd is available, or a stub does not fit in a chunk, the
+   stub gets a mapping of its own, which is written and then made
+   read-only and executable.
+
+   Each stub starts with a header recording its chunk, or the size of its
+   own mapping, and the unwind information registered for it.  */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define CODE_CHUNK_SIZE (64 * 1024)
+
+/* Provided by the unwinder, when one is linked in.  */
+extern void __register_frame (void *) __attribute__((weak));
+extern void __deregister_frame (void *) __attribute__((weak));
+
+struct code_chunk
+{
+  struct code_chunk *next;
+  char *rx;
+  char *rw;
+  off_t offset;
+  size_t used;
+  /* Stubs allocated and not yet sealed, and stubs not yet freed.  */
+  unsigned pending;
+  unsigned live;
+  /* The value of code_generation when the chunk was mapped.  */
+  unsigned generation;
+};
+
+struct code_header
+{
+  struct code_chunk *chunk;
+  size_t size;
+  void *eh_frame;
+  /* Keep the code that follows 16-byte aligned.  */
+  void *pad;
+};
+
+static pthread_mutex_t code_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t code_once = PTHREAD_ONCE_INIT;
+
+/* The memfd holding the chunks, -1 before it is opened and -2 if it
+   cannot be used.  */
+static int code_fd = -1;
+static off_t code_fd_size;
+static unsigned code_generation;
+
+/* The chunk being filled, and chunks of the memfd free for reuse.  */
+static struct code_chunk *code_current;
+static struct code_chunk *code_free_chunks;
+
+/* The perf map file, -1 if it is not open, and the process it was
+   opened for.  */
+static int code_perf_fd = -1;
+static pid_t code_perf_pid;
+static int code_perf_enabled;
+
+/* A child process shares the memfd and the chunks with its parent, so
+   it must not write to them: it starts a memfd of its own.  Chunks
+   inherited from the parent are unmapped when their stubs are freed,
+   but not reused.  */
+static void
+code_atfork_prepare (void)
+{
+  pthread_mutex_lock (&code_mutex);
+}
+
+static void
+code_atfork_parent (void)
+{
+  pthread_mutex_unlock (&code_mutex);
+}
+
+static void
+code_atfork_child (void)
+{
+  struct code_chunk *c, *next;
+
+  if (code_current && code_current->rw)
+    {
+      munmap (code_current->rw, CODE_CHUNK_SIZE);
+      code_current->rw = NULL;
+    }
+  code_current = NULL;
+  for (c = code_free_chunks; c != NULL; c = next)
+    {
+      next = c->next;
+      free (c);
+    }
+  code_free_chunks = NULL;
+  if (code_fd >= 0)
+    close (code_fd);
+  code_fd = -1;
+  code_fd_size = 0;
+  code_generation++;
+  pthread_mutex_unlock (&code_mutex);
+}
+
+static void
+code_init (void)
+{
+  pthread_atfork (code_atfork_prepare, code_atfork_parent,
+		  code_atfork_child);
+  code_perf_enabled = getenv ("LIBFFI_PERF_MAP") != NULL;
+}
+
+/* Unmap the writable view of chunk C once no more stubs will be written
+   to it.  Must be called with code_mutex held.  */
+static void
+code_chunk_close (struct code_chunk *c)
+{
+  if (c->pending == 0 && c != code_current && c->rw)
+    {
+      munmap (c->rw, CODE_CHUNK_SIZE);
+      c->rw = NULL;
+    }
+}
+
+/* Map a chunk, reusing a free part of the memfd if there is one.  Must
+   be called with code_mutex held.  */
+static struct code_chunk *
+code_chunk_new (void)
+{
+  struct code_chunk *c;
+
+  if (code_fd == -2)
+    return NULL;
+
+  c = code_free_chunks;
+  if (c != NULL)
+    code_free_chunks = c->next;
+  else
+    {
+#ifdef HAVE_MEMFD_CREATE
+      if (code_fd == -1)
+	code_fd = memfd_create ("libffi-code", MFD_CLOEXEC);
+#endif
+      if (code_fd < 0)
+	{
+	  code_fd = -2;
+	  return NULL;
+	}
+      c = malloc (sizeof (*c));
+      if (c == NULL)
+	return NULL;
+      c->offset = code_fd_size;
+      if (ftruncate (code_fd, code_fd_size + CODE_CHUNK_SIZE) != 0)
+	{
+	  free (c);
+	  return NULL;
+	}
+      code_fd_size += CODE_CHUNK_SIZE;
+    }
+
+  c->rx = mmap (NULL, CODE_CHUNK_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED,
+		code_fd, c->offset);
+  if (c->rx == MAP_FAILED)
+    {
+      /* Executable shared mappings may be refused by the system; do
+	 not try again.  */
+      free (c);
+      close (code_fd);
+      code_fd = -2;
+      return NULL;
+    }
+  c->rw = mmap (NULL, CODE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		code_fd, c->offset);
+  if (c->rw == MAP_FAILED)
+    {
+      munmap (c->rx, CODE_CHUNK_SIZE);
+      c->next = code_free_chunks;
+      code_free_chunks = c;
+      return NULL;
+    }
+
+  c->next = NULL;
+  c->used = 0;
+  c->pending = 0;
+  c->live = 0;
+  c->generation = code_generation;
+  return c;
+}
+
+/* Allocate SIZE bytes, including the header, from a chunk and return
+   the offset of the header within it.  Must be called with code_mutex
+   held.  */
+static struct code_chunk *
+code_chunk_alloc (size_t size, size_t *offset)
+{
+  struct code_chunk *c = code_current;
+
+  if (size > CODE_CHUNK_SIZE)
+    return NULL;
+  if (c == NULL || CODE_CHUNK_SIZE - c->used < size)
+    {
+      struct code_chunk *n = code_chunk_new ();
+
+      if (n == NULL)
+	return NULL;
+      code_current = n;
+      if (c)
+	code_chunk_close (c);
+      c = n;
+    }
+
+  *offset = c->used;
+  c->used = FFI_ALIGN (c->used + size, 16);
+  if (c->used > CODE_CHUNK_SIZE)
+    c->used = CODE_CHUNK_SIZE;
+  c->pending++;
+  c->live++;
+  return c;
+}
+
+/* Append a line for the code at CODE to the perf map, which perf reads
+   to name code that has no symbols.  */
+static void
+code_perf_map (void *code, size_t size, const char *name)
+{
+  char line[128];
+  pid_t pid = getpid ();
+  int n;
+
+  if (code_perf_fd == -1 || code_perf_pid != pid)
+    {
+      char path[64];
+
+      if (code_perf_fd >= 0)
+	close (code_perf_fd);
+      snprintf (path, sizeof (path), "/tmp/perf-%ld.map", (long) pid);
+      code_perf_fd = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+			   0644);
+      code_perf_pid = pid;
+      if (code_perf_fd == -1)
+	{
+	  code_perf_enabled = 0;
+	  return;
+	}
+    }
+
+  n = snprintf (line, sizeof (line), "%lx %lx %s\n",
+		(unsigned long) (uintptr_t) code, (unsigned long) size, name);
+  if (n > 0 && (size_t) n < sizeof (line))
+    {
+      if (write (code_perf_fd, line, n) != n)
+	{
+	  /* A partial line cannot be taken back; stop writing.  */
+	  code_perf_enabled = 0;
+	}
+    }
+}
+
+void *
+ffi_code_alloc (size_t size, void **code)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  struct code_header *h;
+  struct code_chunk *c;
+  size_t offset;
+
+  size += sizeof (*h);
+
+  pthread_once (&code_once, code_init);
+  pthread_mutex_lock (&code_mutex);
+  c = code_chunk_alloc (size, &offset);
+  pthread_mutex_unlock (&code_mutex);
+
+  if (c != NULL)
+    {
+      h = (struct code_header *) (c->rw + offset);
+      h->chunk = c;
+      h->size = size;
+      *code = (struct code_header *) (c->rx + offset) + 1;
+    }
+  else
+    {
+      size = FFI_ALIGN (size, page);
+      h = mmap (NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (h == MAP_FAILED)
+	return NULL;
+      h->chunk = NULL;
+      h->size = size;
+      *code = h + 1;
+    }
+
+  h->eh_frame = NULL;
+  return h + 1;
+}
+
+int
+ffi_code_seal (void *code, size_t size, void *eh_frame, const char *name)
+{
+  struct code_header *h = (struct code_header *) code - 1;
+  struct code_chunk *c = h->chunk;
+
+  if (c != NULL)
+    {
+      /* Record the unwind information through the writable view.  */
+      if (__register_frame)
+	((struct code_header *) (c->rw + ((char *) h - c->rx)))->eh_frame
+	  = eh_frame;
+      __builtin___clear_cache ((char *) h, (char *) h + h->size);
+
+      pthread_mutex_lock (&code_mutex);
+      c->pending--;
+      code_chunk_close (c);
+    }
+  else
+    {
+      /* The header becomes read-only along with the code.  */
+      if (__register_frame)
+	h->eh_frame = eh_frame;
+      if (mprotect (h, h->size, PROT_READ | PROT_EXEC) != 0)
+	{
+	  h->eh_frame = NULL;
+	  return -1;
+	}
+      __builtin___clear_cache ((char *) h, (char *) h + h->size);
+      pthread_mutex_lock (&code_mutex);
+    }
+
+  if (code_perf_enabled)
+    code_perf_map (code, size, name);
+  pthread_mutex_unlock (&code_mutex);
+
+  if (h->eh_frame)
+    __register_frame (h->eh_frame);
+  return 0;
+}
+
+void
+ffi_code_free (void *code)
+{
+  struct code_header *h = (struct code_header *) code - 1;
+  struct code_chunk *c = h->chunk;
+
+  if (h->eh_frame && __deregister_frame)
+    __deregister_frame (h->eh_frame);
+
+  if (c == NULL)
+    {
+      munmap (h, h->size);
+      return;
+    }
+
+  pthread_mutex_lock (&code_mutex);
+  if (--c->live == 0 && c != code_current)
+    {
+      if (c->rw)
+	munmap (c->rw, CODE_CHUNK_SIZE);
+      munmap (c->rx, CODE_CHUNK_SIZE);
+      if (c->generation == code_generation)
+	{
+	  c->next = code_free_chunks;
+	  code_free_chunks = c;
+	}
+      else
+	free (c);
+    }
+  pthread_mutex_unlock (&code_mutex);
+}
+
+#endif /* FFI_BOUND_CALLS */
 #endif /* __wasm__ */
+
+#if FFI_CLOSURES && !FFI_CLOSURE_STATS
+
+/* Only the dlmalloc-based allocator keeps statistics.  */
+
+#include <string.h>
+
+size_t
+ffi_closure_trim (size_t keep_bytes)
+{
+  return 0;
+}
+
+void
+ffi_closure_get_stats (ffi_closure_stats *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+}
+
+#endif /* FFI_CLOSURES && !FFI_CLOSURE_STATS */
+
+#if FFI_CLOSURES
+
+/* Closure pools.  All the closures of a pool are allocated when it is
+   created, so that handing them out and taking them back needs no lock.
+   Where the writable and executable addresses of a block are a fixed
+   distance apart, the pool is a single ffi_closure_alloc block cut into
+   slots.  With static trampolines, every slot after the first gets a
+   trampoline of its own.  Where each closure needs a separate code
+   address, as with trampoline tables and on wasm, every slot is a
+   separate ffi_closure_alloc block.
+
+   The last word of each slot holds its index.  The free list links the
+   indices through NEXT.  Its head holds the index of the first free
+   slot plus one in the low half, and a count bumped on every update in
+   the high half, so that a slot taken and returned between another
+   thread's load and compare-and-swap is not mistaken for an unchanged
+   list.  */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if FFI_EXEC_TRAMPOLINE_TABLE || defined (__wasm__)
+# define POOL_SEPARATE_SLOTS 1
+#endif
+
+#define POOL_HALF (sizeof (uintptr_t) * 4)
+#define POOL_INDEX_MASK (((uintptr_t) 1 << POOL_HALF) - 1)
+
+#if defined (_MSC_VER) && !defined (__clang__)
+#include <windows.h>
+# define pool_load(p) (*(volatile uintptr_t *) (p))
+# define pool_store(p, v) (*(volatile uintptr_t *) (p) = (v))
+
+static int
+pool_cas (uintptr_t *p, uintptr_t *expected, uintptr_t desired)
+{
+  uintptr_t prev = (uintptr_t)
+    InterlockedCompareExchangePointer ((PVOID volatile *) p,
+				       (PVOID) desired, (PVOID) *expected);
+  if (prev == *expected)
+    return 1;
+  *expected = prev;
+  return 0;
+}
+#else
+# define pool_load(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+# define pool_store(p, v) __atomic_store_n (p, v, __ATOMIC_RELAXED)
+# define pool_cas(p, e, d) \
+  __atomic_compare_exchange_n (p, e, d, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#endif
+
+struct ffi_closure_pool
+{
+  uintptr_t head;
+  size_t count;
+  size_t stride;
+  void *block;
+  uintptr_t *next;
+  void **data;
+  void **code;
+};
+
+#define POOL_SLOT_INDEX(pool, p) \
+  (*(uintptr_t *) ((char *) (p) + (pool)->stride - sizeof (uintptr_t)))
+
+static void
+pool_release (ffi_closure_pool *pool, size_t n)
+{
+  size_t i;
+
+#ifdef POOL_SEPARATE_SLOTS
+  for (i = 0; i < n; i++)
+    ffi_closure_free (pool->data[i]);
+#else
+  /* The first slot's trampoline belongs to the block.  */
+  if (pool->block && ffi_tramp_is_present (pool->block))
+    for (i = 1; i < n; i++)
+      ffi_tramp_free (((ffi_closure *) pool->data[i])->ftramp);
+  if (pool->block)
+    ffi_closure_free (pool->block);
+#endif
+  free (pool->next);
+  free (pool->data);
+  free (pool->code);
+  free (pool);
+}
+
+ffi_closure_pool *
+ffi_closure_pool_create (size_t count, size_t closure_size)
+{
+  ffi_closure_pool *pool;
+  size_t i;
+
+  if (count == 0 || count >= POOL_INDEX_MASK)
+    return NULL;
+  if (closure_size < sizeof (ffi_closure))
+    closure_size = sizeof (ffi_closure);
+
+  pool = calloc (1, sizeof (*pool));
+  if (pool == NULL)
+    return NULL;
+  pool->count = count;
+  pool->stride = FFI_ALIGN (closure_size + sizeof (uintptr_t), 16);
+  pool->next = malloc (count * sizeof (uintptr_t));
+  pool->data = malloc (count * sizeof (void *));
+  pool->code = malloc (count * sizeof (void *));
+  if (pool->next == NULL || pool->data == NULL || pool->code == NULL
+      || pool->stride > (size_t) -1 / count)
+    {
+      pool_release (pool, 0);
+      return NULL;
+    }
+
+#ifdef POOL_SEPARATE_SLOTS
+  for (i = 0; i < count; i++)
+    {
+      pool->data[i] = ffi_closure_alloc (pool->stride, &pool->code[i]);
+      if (pool->data[i] == NULL)
+	{
+	  pool_release (pool, i);
+	  return NULL;
+	}
+    }
+#else
+  {
+    void *code;
+
+    pool->block = ffi_closure_alloc (count * pool->stride, &code);
+    if (pool->block == NULL)
+      {
+	pool_release (pool, 0);
+	return NULL;
+      }
+    for (i = 0; i < count; i++)
+      {
+	pool->data[i] = (char *) pool->block + i * pool->stride;
+	pool->code[i] = (char *) code + i * pool->stride;
+      }
+
+    if (ffi_tramp_is_present (pool->block))
+      for (i = 1; i < count; i++)
+	{
+	  void *ftramp = ffi_tramp_alloc (0);
+
+	  if (ftramp == NULL)
+	    {
+	      pool_release (pool, i);
+	      return NULL;
+	    }
+	  ((ffi_closure *) pool->data[i])->ftramp = ftramp;
+	  pool->code[i] = ffi_tramp_get_addr (ftramp);
+	}
+  }
+#endif
+
+  for (i = 0; i < count; i++)
+    {
+      POOL_SLOT_INDEX (pool, pool->data[i]) = i;
+      pool->next[i] = i + 1 < count ? i + 2 : 0;
+    }
+  pool->head = 1;
+  return pool;
+}
+
+void *
+ffi_closure_pool_get (ffi_closure_pool *pool, void **code)
+{
+  uintptr_t old, new, i;
+
+  old = pool_load (&pool->head);
+  do
+    {
+      i = old & POOL_INDEX_MASK;
+      if (i == 0)
+	return NULL;
+      new = (((old >> POOL_HALF) + 1) << POOL_HALF)
+	| pool_load (&pool->next[i - 1]);
+    }
+  while (!pool_cas (&pool->head, &old, new));
+
+  *code = pool->code[i - 1];
+  return pool->data[i - 1];
+}
+
+void
+ffi_closure_pool_put (ffi_closure_pool *pool, void *closure)
+{
+  uintptr_t old, new, i;
+
+  i = POOL_SLOT_INDEX (pool, closure);
+  FFI_ASSERT (i < pool->count && pool->data[i] == closure);
+
+  old = pool_load (&pool->head);
+  do
+    {
+      pool_store (&pool->next[i], old & POOL_INDEX_MASK);
+      new = (((old >> POOL_HALF) + 1) << POOL_HALF) | (i + 1);
+    }
+  while (!pool_cas (&pool->head, &old, new));
+}
+
+void
+ffi_closure_pool_destroy (ffi_closure_pool *pool)
+{
+  pool_release (pool, pool->count);
+}
+
+#endif /* FFI_CLOSURES */
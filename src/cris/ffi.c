@@ -174,6 +174,7 @@ ffi_prep_cif_core (ffi_cif * cif,
   cif->rtype = rtype;
 
   cif->flags = 0;
+  cif->nfixed = isvariadic ? nfixedargs : 0;
 
   if ((cif->rtype->size == 0)
       && (initialize_aggregate_packed_struct (cif->rtype) != FFI_OK))
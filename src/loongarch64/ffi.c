@@ -47,7 +47,6 @@
 
 #define NARGREG 8
 #define STKALIGN 16
-#define MAXCOPYARG (2 * sizeof (double))
 
 /* call_context registers
    - 8 floating point parameter/result registers.
@@ -65,15 +64,21 @@ typedef struct call_context
   size_t a[10];
 } call_context;
 
-typedef struct call_builder
+/* ffi_loongarch_arg kinds.  */
+#define PLAN_ATOMS 0	/* Atoms read straight from the argument.  */
+#define PLAN_WORDS 1	/* Argument realigned into GRLEN words first.  */
+#define PLAN_BYREF 2	/* Passed as a pointer to a copy.  */
+#define PLAN_PROMOTE 3	/* Variadic float passed as a double.  */
+
+/* Register allocation state while building a plan.  */
+typedef struct plan_builder
 {
-  call_context *aregs;
   int used_integer;
   int used_float;
-  size_t *used_stack;
-  size_t *stack;
+  unsigned used_stack;
   size_t next_struct_area;
-} call_builder;
+  size_t scratch_bytes;
+} plan_builder;
 
 /* Integer (not pointer) less than ABI GRLEN.  */
 /* FFI_TYPE_INT does not appear to be used.  */
@@ -117,7 +122,7 @@ flatten_struct (ffi_type *in, ffi_type **out, ffi_type **out_end)
    floating point type, are passed in multiple registers if sufficient
    registers are available.  */
 static float_struct_info
-struct_passed_as_elements (call_builder *cb, ffi_type *top)
+struct_passed_as_elements (plan_builder *cb, ffi_type *top)
 {
   float_struct_info ret = {0, 0, 0, 0};
   ffi_type *fields[3];
@@ -153,10 +158,161 @@ struct_passed_as_elements (call_builder *cb, ffi_type *top)
 }
 #endif
 
-/* Allocates a single register, float register, or GRLEN-sized stack slot to a
-   datum.  */
+/* Assigns a single register, float register, or GRLEN-sized stack slot to
+   an atom of type TYPE at OFFSET within the argument.  */
+static void
+plan_atom (plan_builder *pb, ffi_loongarch_arg *e, int type, size_t offset)
+{
+  ffi_loongarch_atom *atom = &e->atoms[e->natoms++];
+
+  atom->type = type;
+  atom->offset = offset;
+#if ABI_FRLEN
+  if (IS_FLOAT (type))
+    {
+      atom->slot = pb->used_float++;
+      return;
+    }
+#endif
+  if (pb->used_integer == NARGREG)
+    atom->slot = NARGREG + pb->used_stack++;
+  else
+    atom->slot = pb->used_integer++;
+}
+
+/* Decides how an argument, or a not by reference return value, is
+   passed.  */
+static void
+plan_arg (plan_builder *pb, ffi_type *type, int var, ffi_loongarch_arg *e)
+{
+  e->natoms = 0;
+  e->copy = 0;
+  e->kind = PLAN_ATOMS;
+
+#if ABI_FRLEN
+  if (!var && type->type == FFI_TYPE_STRUCT)
+    {
+      float_struct_info fsi = struct_passed_as_elements (pb, type);
+      if (fsi.as_elements)
+	{
+	  plan_atom (pb, e, fsi.type1, 0);
+	  if (fsi.offset2)
+	    plan_atom (pb, e, fsi.type2, fsi.offset2);
+	  goto scratch;
+	}
+    }
+
+  if (!var && pb->used_float < NARGREG
+      && IS_FLOAT (type->type))
+    {
+      plan_atom (pb, e, type->type, 0);
+      goto scratch;
+    }
+
+  if (var && type->type == FFI_TYPE_FLOAT)
+    {
+      /* C standard requires promoting float -> double for variable arg.  */
+      e->kind = PLAN_PROMOTE;
+      plan_atom (pb, e, FFI_TYPE_POINTER, 0);
+      goto scratch;
+    }
+#endif
+
+  if (type->size > 2 * __SIZEOF_POINTER__)
+    /* Pass by reference.  */
+    {
+      pb->next_struct_area
+	= FFI_ALIGN_DOWN (pb->next_struct_area - type->size, type->alignment);
+      e->kind = PLAN_BYREF;
+      e->copy = pb->next_struct_area;
+      plan_atom (pb, e, FFI_TYPE_POINTER, 0);
+      return;
+    }
+  else if (IS_INT (type->type) || type->type == FFI_TYPE_POINTER)
+    plan_atom (pb, e, type->type, 0);
+  else
+    {
+      /* Overlong integers, soft-float floats, and structs without special
+	 float handling are treated identically from this point on.  */
+      e->kind = PLAN_WORDS;
+
+      /* Variadics are aligned even in registers.  */
+      if (type->alignment > __SIZEOF_POINTER__)
+	{
+	  if (var)
+	    pb->used_integer = FFI_ALIGN (pb->used_integer, 2);
+	  pb->used_stack = FFI_ALIGN (pb->used_stack, 2);
+	}
+
+      if (type->size > 0)
+	plan_atom (pb, e, FFI_TYPE_POINTER, 0);
+      if (type->size > __SIZEOF_POINTER__)
+	plan_atom (pb, e, FFI_TYPE_POINTER, __SIZEOF_POINTER__);
+    }
+
+#if ABI_FRLEN
+ scratch:
+#endif
+  /* Arguments not passed by reference are unpacked by closures into their
+     own aligned, GRLEN-padded copy.  */
+  pb->scratch_bytes
+    = FFI_ALIGN (pb->scratch_bytes, (type->alignment > __SIZEOF_POINTER__
+				     ? type->alignment : __SIZEOF_POINTER__));
+  e->copy = pb->scratch_bytes;
+  pb->scratch_bytes += FFI_ALIGN (type->size, __SIZEOF_POINTER__);
+}
+
+/* Builds the placement of the return value in RPLAN and of every argument
+   in PLAN (if not NULL), and returns the closure scratch size.  */
+static unsigned
+plan_args (ffi_cif *cif, ffi_loongarch_arg *rplan, ffi_loongarch_arg *plan)
+{
+  plan_builder pb;
+  ffi_loongarch_arg e;
+  unsigned i;
+
+  pb.used_integer = pb.used_float = 0;
+  pb.used_stack = 0;
+  pb.next_struct_area = cif->bytes;
+  pb.scratch_bytes = 0;
+  plan_arg (&pb, cif->rtype, 0, rplan);
+
+  pb.used_integer = pb.used_float = 0;
+  pb.used_stack = 0;
+  pb.next_struct_area = cif->bytes;
+  pb.scratch_bytes = 0;
+  /* A return value passed by reference takes the first argument
+     register.  */
+  if (rplan->kind == PLAN_BYREF)
+    pb.used_integer = 1;
+
+  for (i = 0; i < cif->nargs; i++)
+    plan_arg (&pb, cif->arg_types[i], i >= cif->loongarch_nfixedargs,
+	      plan ? &plan[i] : &e);
+
+  /* unmarshal_atom() stores integers as a whole ffi_arg, which may run past
+     the end of the last copy.  */
+  return pb.scratch_bytes + sizeof (ffi_arg);
+}
+
+/* Returns the argument plan of CIF, building it in SCRATCH if the cif has
+   too many arguments to keep one.  The cif itself is left untouched, since
+   it may be shared between threads.  */
+static const ffi_loongarch_arg *
+get_plan (ffi_cif *cif, ffi_loongarch_arg *scratch)
+{
+  ffi_loongarch_arg rplan;
+
+  if (cif->nargs <= FFI_LOONGARCH_PLAN_ARGS)
+    return cif->loongarch_plan;
+  plan_args (cif, &rplan, scratch);
+  return scratch;
+}
+
+/* Stores a single atom to its register or stack slot.  */
 static void
-marshal_atom (call_builder *cb, int type, void *data)
+marshal_atom (call_context *aregs, size_t *stack, int type, unsigned slot,
+	      void *data)
 {
   size_t value = 0;
   switch (type)
@@ -194,12 +350,12 @@ marshal_atom (call_builder *cb, int type, void *data)
 
 #if ABI_FRLEN >= 32
     case FFI_TYPE_FLOAT:
-      *(float *)(cb->aregs->fa + cb->used_float++) = *(float *) data;
+      *(float *)(aregs->fa + slot) = *(float *) data;
       return;
 #endif
 #if ABI_FRLEN >= 64
     case FFI_TYPE_DOUBLE:
-      (cb->aregs->fa[cb->used_float++]) = *(double *) data;
+      aregs->fa[slot] = *(double *) data;
       return;
 #endif
     default:
@@ -207,34 +363,35 @@ marshal_atom (call_builder *cb, int type, void *data)
       break;
     }
 
-  if (cb->used_integer == NARGREG)
-    *cb->used_stack++ = value;
+  if (slot >= NARGREG)
+    stack[slot - NARGREG] = value;
   else
-    cb->aregs->a[cb->used_integer++] = value;
+    aregs->a[slot] = value;
 }
 
 static void
-unmarshal_atom (call_builder *cb, int type, void *data)
+unmarshal_atom (call_context *aregs, size_t *stack, int type, unsigned slot,
+		void *data)
 {
   size_t value;
   switch (type)
     {
 #if ABI_FRLEN >= 32
     case FFI_TYPE_FLOAT:
-      *(float *) data = *(float *)(cb->aregs->fa + cb->used_float++);
+      *(float *) data = *(float *)(aregs->fa + slot);
       return;
 #endif
 #if ABI_FRLEN >= 64
     case FFI_TYPE_DOUBLE:
-      *(double *) data = cb->aregs->fa[cb->used_float++];
+      *(double *) data = aregs->fa[slot];
       return;
 #endif
     }
 
-  if (cb->used_integer == NARGREG)
-    value = *cb->used_stack++;
+  if (slot >= NARGREG)
+    value = stack[slot - NARGREG];
   else
-    value = cb->aregs->a[cb->used_integer++];
+    value = aregs->a[slot];
 
   switch (type)
     {
@@ -257,171 +414,74 @@ unmarshal_atom (call_builder *cb, int type, void *data)
     }
 }
 
-/* Allocate and copy a structure that is passed by value on the stack and
-   return a pointer to it.  */
-static void *
-allocate_and_copy_struct_to_stack (call_builder *cb, void *data,
-				   ffi_type *type)
-{
-  size_t dest = cb->next_struct_area - type->size;
-
-  dest = FFI_ALIGN_DOWN (dest, type->alignment);
-  cb->next_struct_area = dest;
-
-  return memcpy ((char *)cb->stack + dest, data, type->size);
-}
-
 /* Adds an argument to a call, or a not by reference return value.  */
 static void
-marshal (call_builder *cb, ffi_type *type, int var, void *data)
+marshal (call_context *aregs, size_t *stack, const ffi_loongarch_arg *e,
+	 ffi_type *type, void *data)
 {
   size_t realign[2];
+  int i;
 
-#if ABI_FRLEN
-  if (!var && type->type == FFI_TYPE_STRUCT)
-    {
-      float_struct_info fsi = struct_passed_as_elements (cb, type);
-      if (fsi.as_elements)
-	{
-	  marshal_atom (cb, fsi.type1, data);
-	  if (fsi.offset2)
-	    marshal_atom (cb, fsi.type2, ((char *) data) + fsi.offset2);
-	  return;
-	}
-    }
-
-  if (!var && cb->used_float < NARGREG
-      && IS_FLOAT (type->type))
+  switch (e->kind)
     {
-      marshal_atom (cb, type->type, data);
+    case PLAN_BYREF:
+      /* Pass by reference.  */
+      data = memcpy ((char *) stack + e->copy, data, type->size);
+      marshal_atom (aregs, stack, FFI_TYPE_POINTER, e->atoms[0].slot, &data);
       return;
-    }
-
-  double promoted;
-  if (var && type->type == FFI_TYPE_FLOAT)
-    {
-      /* C standard requires promoting float -> double for variable arg.  */
-      promoted = *(float *) data;
-      type = &ffi_type_double;
-      data = &promoted;
-    }
+#if ABI_FRLEN
+    case PLAN_PROMOTE:
+      *(double *) realign = *(float *) data;
+      data = realign;
+      break;
 #endif
-
-  if (type->size > 2 * __SIZEOF_POINTER__)
-    /* Pass by reference.  */
-    {
-      allocate_and_copy_struct_to_stack (cb, data, type);
-      data = (char *)cb->stack + cb->next_struct_area;
-      marshal_atom (cb, FFI_TYPE_POINTER, &data);
-    }
-  else if (IS_INT (type->type) || type->type == FFI_TYPE_POINTER)
-    marshal_atom (cb, type->type, data);
-  else
-    {
-      /* Overlong integers, soft-float floats, and structs without special
-	 float handling are treated identically from this point on.  */
-
-      /* Variadics are aligned even in registers.  */
-      if (type->alignment > __SIZEOF_POINTER__)
-	{
-	  if (var)
-	    cb->used_integer = FFI_ALIGN (cb->used_integer, 2);
-	  cb->used_stack
-	    = (size_t *) FFI_ALIGN (cb->used_stack, 2 * __SIZEOF_POINTER__);
-	}
-
+    case PLAN_WORDS:
       memcpy (realign, data, type->size);
-      if (type->size > 0)
-	marshal_atom (cb, FFI_TYPE_POINTER, realign);
-      if (type->size > __SIZEOF_POINTER__)
-	marshal_atom (cb, FFI_TYPE_POINTER, realign + 1);
+      data = realign;
+      break;
     }
+
+  for (i = 0; i < e->natoms; i++)
+    marshal_atom (aregs, stack, e->atoms[i].type, e->atoms[i].slot,
+		  (char *) data + e->atoms[i].offset);
 }
 
 /* For arguments passed by reference returns the pointer, otherwise the arg
-   is copied (up to MAXCOPYARG bytes).  */
+   is copied to DATA.  */
 static void *
-unmarshal (call_builder *cb, ffi_type *type, int var, void *data)
+unmarshal (call_context *aregs, size_t *stack, const ffi_loongarch_arg *e,
+	   ffi_type *type, void *data)
 {
   size_t realign[2];
   void *pointer;
+  int i;
 
-#if ABI_FRLEN
-  if (!var && type->type == FFI_TYPE_STRUCT)
-    {
-      float_struct_info fsi = struct_passed_as_elements (cb, type);
-      if (fsi.as_elements)
-	{
-	  unmarshal_atom (cb, fsi.type1, data);
-	  if (fsi.offset2)
-	    unmarshal_atom (cb, fsi.type2, ((char *) data) + fsi.offset2);
-	  return data;
-	}
-    }
-
-  if (!var && cb->used_float < NARGREG
-      && IS_FLOAT (type->type))
-    {
-      unmarshal_atom (cb, type->type, data);
-      return data;
-    }
-
-  if (var && type->type == FFI_TYPE_FLOAT)
-    {
-      int m = cb->used_integer;
-      void *promoted
-	= m < NARGREG ? cb->aregs->a + m : cb->used_stack + m - NARGREG + 1;
-      *(float *) promoted = *(double *) promoted;
-    }
-#endif
-
-  if (type->size > 2 * __SIZEOF_POINTER__)
+  switch (e->kind)
     {
+    case PLAN_BYREF:
       /* Pass by reference.  */
-      unmarshal_atom (cb, FFI_TYPE_POINTER, (char *) &pointer);
+      unmarshal_atom (aregs, stack, FFI_TYPE_POINTER, e->atoms[0].slot,
+		      (char *) &pointer);
       return pointer;
-    }
-  else if (IS_INT (type->type) || type->type == FFI_TYPE_POINTER)
-    {
-      unmarshal_atom (cb, type->type, data);
+#if ABI_FRLEN
+    case PLAN_PROMOTE:
+      unmarshal_atom (aregs, stack, FFI_TYPE_POINTER, e->atoms[0].slot,
+		      realign);
+      *(float *) data = *(double *) realign;
       return data;
-    }
-  else
-    {
-      /* Overlong integers, soft-float floats, and structs without special
-	 float handling are treated identically from this point on.  */
-
-      /* Variadics are aligned even in registers.  */
-      if (type->alignment > __SIZEOF_POINTER__)
-	{
-	  if (var)
-	    cb->used_integer = FFI_ALIGN (cb->used_integer, 2);
-	  cb->used_stack
-	    = (size_t *) FFI_ALIGN (cb->used_stack, 2 * __SIZEOF_POINTER__);
-	}
-
-      if (type->size > 0)
-	unmarshal_atom (cb, FFI_TYPE_POINTER, realign);
-      if (type->size > __SIZEOF_POINTER__)
-	unmarshal_atom (cb, FFI_TYPE_POINTER, realign + 1);
+#endif
+    case PLAN_WORDS:
+      for (i = 0; i < e->natoms; i++)
+	unmarshal_atom (aregs, stack, FFI_TYPE_POINTER, e->atoms[i].slot,
+			realign + i);
       memcpy (data, realign, type->size);
       return data;
     }
-}
 
-static int
-passed_by_ref (call_builder *cb, ffi_type *type, int var)
-{
-#if ABI_FRLEN
-  if (!var && type->type == FFI_TYPE_STRUCT)
-    {
-      float_struct_info fsi = struct_passed_as_elements (cb, type);
-      if (fsi.as_elements)
-	return 0;
-    }
-#endif
-
-  return type->size > 2 * __SIZEOF_POINTER__;
+  for (i = 0; i < e->natoms; i++)
+    unmarshal_atom (aregs, stack, e->atoms[i].type, e->atoms[i].slot,
+		    (char *) data + e->atoms[i].offset);
+  return data;
 }
 
 /* Perform machine dependent cif processing.  */
@@ -429,6 +489,10 @@ ffi_status
 ffi_prep_cif_machdep (ffi_cif *cif)
 {
   cif->loongarch_nfixedargs = cif->nargs;
+  cif->loongarch_scratch
+    = plan_args (cif, &cif->loongarch_rplan,
+		 (cif->nargs <= FFI_LOONGARCH_PLAN_ARGS
+		  ? cif->loongarch_plan : NULL));
   return FFI_OK;
 }
 
@@ -439,6 +503,10 @@ ffi_prep_cif_machdep_var (ffi_cif *cif, unsigned int nfixedargs,
 			  unsigned int ntotalargs)
 {
   cif->loongarch_nfixedargs = nfixedargs;
+  cif->loongarch_scratch
+    = plan_args (cif, &cif->loongarch_rplan,
+		 (cif->nargs <= FFI_LOONGARCH_PLAN_ARGS
+		  ? cif->loongarch_plan : NULL));
   return FFI_OK;
 }
 
@@ -473,27 +541,24 @@ ffi_call_int (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue,
   if (rval_bytes)
     rvalue = (void *) (alloc_base + arg_bytes);
 
-  call_builder cb;
-  cb.used_float = cb.used_integer = 0;
-  cb.aregs = (call_context *) (alloc_base + arg_bytes + rval_bytes);
-  cb.used_stack = (void *) alloc_base;
-  cb.stack = (void *) alloc_base;
-  cb.next_struct_area = arg_bytes;
+  const ffi_loongarch_arg *plan
+    = get_plan (cif, (cif->nargs <= FFI_LOONGARCH_PLAN_ARGS ? NULL
+		      : alloca (cif->nargs * sizeof (ffi_loongarch_arg))));
+  call_context *aregs = (call_context *) (alloc_base + arg_bytes + rval_bytes);
+  size_t *stack = (void *) alloc_base;
 
-  int return_by_ref = passed_by_ref (&cb, cif->rtype, 0);
+  int return_by_ref = cif->loongarch_rplan.kind == PLAN_BYREF;
   if (return_by_ref)
-    cb.aregs->a[cb.used_integer++] = (size_t)rvalue;
+    aregs->a[0] = (size_t)rvalue;
 
   int i;
   for (i = 0; i < cif->nargs; i++)
-    marshal (&cb, cif->arg_types[i], i >= cif->loongarch_nfixedargs,
-	     avalue[i]);
+    marshal (aregs, stack, &plan[i], cif->arg_types[i], avalue[i]);
 
-  ffi_call_asm ((void *) alloc_base, cb.aregs, fn, closure);
+  ffi_call_asm ((void *) alloc_base, aregs, fn, closure);
 
-  cb.used_float = cb.used_integer = 0;
   if (!return_by_ref && rvalue)
-    unmarshal (&cb, cif->rtype, 0, rvalue);
+    unmarshal (aregs, stack, &cif->loongarch_rplan, cif->rtype, rvalue);
 }
 
 void
@@ -574,39 +639,31 @@ ffi_closure_inner (ffi_cif *cif,
 		   void (*fun) (ffi_cif *, void *, void **, void *),
 		   void *user_data, size_t *stack, call_context *aregs)
 {
+  const ffi_loongarch_arg *plan
+    = get_plan (cif, (cif->nargs <= FFI_LOONGARCH_PLAN_ARGS ? NULL
+		      : alloca (cif->nargs * sizeof (ffi_loongarch_arg))));
   void **avalue = alloca (cif->nargs * sizeof (void *));
-  /* Storage for arguments which will be copied by unmarshal().  We could
-     theoretically avoid the copies in many cases and use at most 128 bytes
-     of memory, but allocating disjoint storage for each argument is
-     simpler.  */
-  char *astorage = alloca (cif->nargs * MAXCOPYARG);
+  /* Storage for arguments which will be copied by unmarshal(), laid out by
+     the plan.  */
+  char *astorage = alloca (cif->loongarch_scratch);
   void *rvalue;
-  call_builder cb;
   int return_by_ref;
   int i;
 
-  cb.aregs = aregs;
-  cb.used_integer = cb.used_float = 0;
-  cb.used_stack = stack;
-
-  return_by_ref = passed_by_ref (&cb, cif->rtype, 0);
+  return_by_ref = cif->loongarch_rplan.kind == PLAN_BYREF;
   if (return_by_ref)
-    unmarshal (&cb, &ffi_type_pointer, 0, &rvalue);
+    unmarshal_atom (aregs, stack, FFI_TYPE_POINTER, 0, &rvalue);
   else
     rvalue = alloca (cif->rtype->size);
 
   for (i = 0; i < cif->nargs; i++)
-    avalue[i]
-      = unmarshal (&cb, cif->arg_types[i], i >= cif->loongarch_nfixedargs,
-		   astorage + i * MAXCOPYARG);
+    avalue[i] = unmarshal (aregs, stack, &plan[i], cif->arg_types[i],
+			   astorage + plan[i].copy);
 
   fun (cif, rvalue, avalue, user_data);
 
   if (!return_by_ref && cif->rtype->type != FFI_TYPE_VOID)
-    {
-      cb.used_integer = cb.used_float = 0;
-      marshal (&cb, cif->rtype, 0, rvalue);
-    }
+    marshal (aregs, stack, &cif->loongarch_rplan, cif->rtype, rvalue);
 }
 
 #if defined(FFI_EXEC_STATIC_TRAMP)
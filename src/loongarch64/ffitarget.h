@@ -67,6 +67,29 @@ typedef enum ffi_abi
 #endif
 } ffi_abi;
 
+/* One register- or stack-sized piece of an argument: TYPE is the
+   FFI_TYPE_* it is moved as, OFFSET its position within the argument
+   and SLOT the FP register, integer register or stack word holding it.  */
+typedef struct
+{
+  unsigned char type;
+  unsigned char offset;
+  unsigned short slot;
+} ffi_loongarch_atom;
+
+/* Placement of one argument or return value, computed once by
+   ffi_prep_cif_machdep; see src/loongarch64/ffi.c.  */
+typedef struct
+{
+  ffi_loongarch_atom atoms[2];
+  unsigned char kind;
+  unsigned char natoms;
+  unsigned copy;
+} ffi_loongarch_arg;
+
+/* Cifs with more arguments than this compute their plan on the fly.  */
+#define FFI_LOONGARCH_PLAN_ARGS 16
+
 #endif /* LIBFFI_ASM */
 
 /* ---- Definitions for closures ----------------------------------------- */
@@ -77,6 +100,9 @@ typedef enum ffi_abi
 #define FFI_NATIVE_RAW_API 0
 #define FFI_EXTRA_CIF_FIELDS \
   unsigned loongarch_nfixedargs; \
-  unsigned loongarch_unused;
+  unsigned loongarch_unused; \
+  unsigned loongarch_scratch; \
+  ffi_loongarch_arg loongarch_rplan; \
+  ffi_loongarch_arg loongarch_plan[FFI_LOONGARCH_PLAN_ARGS];
 #define FFI_TARGET_SPECIFIC_VARIADIC
 #endif
@@ -26,16 +26,19 @@
 
 #include <ffi.h>
 #include <ffi_common.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Round up to FFI_SIZEOF_ARG. */
 
 #define STACK_ARG_SIZE(x) FFI_ALIGN(x, FFI_SIZEOF_ARG)
 
 /* Perform machine independent initialization of aggregate type
-   specifications. */
+   specifications.  Every element must already be laid out.  */
 
-static ffi_status initialize_aggregate(ffi_type *arg, size_t *offsets)
+static ffi_status layout_aggregate(ffi_type *arg, size_t *offsets)
 {
   ffi_type **ptr;
 
@@ -52,8 +55,7 @@ static ffi_status initialize_aggregate(ffi_type *arg, size_t *offsets)
 
   while ((*ptr) != NULL)
     {
-      if (UNLIKELY(((*ptr)->size == 0)
-		    && (initialize_aggregate((*ptr), NULL) != FFI_OK)))
+      if (UNLIKELY((*ptr)->size == 0))
 	return FFI_BAD_TYPEDEF;
 
       /* Perform a sanity check on the argument type */
@@ -92,6 +94,81 @@ static ffi_status initialize_aggregate(ffi_type *arg, size_t *offsets)
     return FFI_OK;
 }
 
+/* Lay out ARG, after any of its elements, at any depth, that have not
+   been laid out yet.  The nesting is walked with an explicit stack, so
+   deeply nested types cannot overflow the C stack.  */
+
+#define LAYOUT_STACK 16
+
+struct layout_frame
+{
+  ffi_type *type;
+  ffi_type **next;
+};
+
+static ffi_status initialize_aggregate(ffi_type *arg, size_t *offsets)
+{
+  struct layout_frame stack_buf[LAYOUT_STACK], *stack = stack_buf, *grown;
+  size_t depth = 0, cap = LAYOUT_STACK, i;
+  ffi_status status = FFI_OK;
+  ffi_type *t;
+
+  if (UNLIKELY(arg == NULL || arg->elements == NULL))
+    return FFI_BAD_TYPEDEF;
+  stack[depth].type = arg;
+  stack[depth].next = arg->elements;
+  depth++;
+
+  while (depth > 0)
+    {
+      struct layout_frame *f = &stack[depth - 1];
+
+      while (*f->next != NULL && (*f->next)->size != 0)
+	f->next++;
+
+      if (*f->next == NULL)
+	{
+	  status = layout_aggregate(f->type, depth == 1 ? offsets : NULL);
+	  if (status != FFI_OK)
+	    break;
+	  depth--;
+	  continue;
+	}
+
+      /* An element that still needs laying out.  One that is already
+	 on the stack contains itself.  */
+      t = *f->next;
+      status = FFI_BAD_TYPEDEF;
+      if (UNLIKELY(t->elements == NULL))
+	break;
+      for (i = 0; i < depth; i++)
+	if (stack[i].type == t)
+	  break;
+      if (UNLIKELY(i < depth))
+	break;
+
+      if (depth == cap)
+	{
+	  grown = malloc(2 * cap * sizeof(*stack));
+	  if (grown == NULL)
+	    break;
+	  memcpy(grown, stack, depth * sizeof(*stack));
+	  if (stack != stack_buf)
+	    free(stack);
+	  stack = grown;
+	  cap *= 2;
+	}
+      stack[depth].type = t;
+      stack[depth].next = t->elements;
+      depth++;
+      status = FFI_OK;
+    }
+
+  if (stack != stack_buf)
+    free(stack);
+  return status;
+}
+
 #ifndef __CRIS__
 /* The CRIS ABI specifies structure elements to have byte
    alignment only, so it completely overrides this functions,
@@ -130,6 +207,7 @@ ffi_status FFI_HIDDEN ffi_prep_cif_core(ffi_cif *cif, ffi_abi abi,
   cif->rtype = rtype;
 
   cif->flags = 0;
+  cif->nfixed = isvariadic ? nfixedargs : 0;
 #if (defined(_M_ARM64) || defined(__aarch64__)) && defined(_WIN32)
   cif->is_variadic = isvariadic;
 #endif
@@ -251,6 +329,34 @@ ffi_status ffi_prep_cif_var(ffi_cif *cif,
   return FFI_OK;
 }
 
+#ifndef FFI_NATIVE_CALL_BATCH
+void
+ffi_call_batch (ffi_cif *cif, void (*fn)(void), size_t n, void **rvalues,
+		void ***avalues)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    ffi_call (cif, fn, rvalues ? rvalues[i] : NULL, avalues[i]);
+}
+
+void
+ffi_call_strided (ffi_cif *cif, void (*fn)(void), size_t n,
+		  const void *base[], const size_t stride[],
+		  void *out, size_t out_stride)
+{
+  void **row = alloca (cif->nargs * sizeof (void *));
+  size_t i, j;
+
+  for (i = 0; i < n; i++)
+    {
+      for (j = 0; j < cif->nargs; j++)
+	row[j] = (char *) base[j] + i * stride[j];
+      ffi_call (cif, fn, out ? (char *) out + i * out_stride : NULL, row);
+    }
+}
+#endif
+
 #if FFI_CLOSURES
 
 ffi_status
@@ -262,11 +368,207 @@ ffi_prep_closure (ffi_closure* closure,
   return ffi_prep_closure_loc (closure, cif, fun, user_data, closure);
 }
 
+/* The generic path of a bind closure: prepend target_data and call the
+   target through the cif prepared for it by ffi_prep_closure_bind.  */
+static void
+ffi_bind_closure_fun (ffi_cif *cif, void *rvalue, void **avalue,
+		      void *user_data)
+{
+  ffi_bind_closure *closure = user_data;
+  unsigned int n = cif->nargs;
+  void **values = alloca ((n + 1) * sizeof (void *));
+
+  values[0] = &closure->target_data;
+  if (n)
+    memcpy (values + 1, avalue, n * sizeof (void *));
+  ffi_call (closure->target_cif, closure->target, rvalue, values);
+}
+
+ffi_status
+ffi_prep_closure_bind (ffi_bind_closure *closure,
+		       ffi_cif *cif,
+		       void (*target)(void),
+		       void *target_data,
+		       void *codeloc)
+{
+  ffi_type **types;
+
+  closure->target = target;
+  closure->target_data = target_data;
+  closure->target_cif = NULL;
+
+#ifdef FFI_NATIVE_BIND_CLOSURES
+  /* Shift the arguments in registers and jump straight to TARGET,
+     when the signature allows.  */
+  if (cif->nfixed == 0
+      && ffi_prep_closure_bind_machdep (closure, cif, codeloc) == FFI_OK)
+    return FFI_OK;
+#endif
+
+  /* TARGET takes a pointer before the arguments of CIF, and one more
+     fixed argument if CIF is variadic.  */
+  types = alloca ((cif->nargs + 1) * sizeof (ffi_type *));
+  types[0] = &ffi_type_pointer;
+  if (cif->nargs)
+    memcpy (types + 1, cif->arg_types, cif->nargs * sizeof (ffi_type *));
+  closure->target_cif = ffi_cif_lookup (cif->abi, cif->rtype, cif->nargs + 1,
+					types,
+					cif->nfixed ? cif->nfixed + 1 : 0);
+  if (closure->target_cif == NULL)
+    return FFI_BAD_TYPEDEF;
+
+  return ffi_prep_closure_loc (&closure->closure, cif, ffi_bind_closure_fun,
+			       closure, codeloc);
+}
+
+#endif
+
+/* Interned structure types.  Each distinct list of element types is
+   laid out once, and its type and member offsets are kept for the life
+   of the process.  Elements are compared by address, so nested
+   structures should be interned first.  The table is read without a
+   lock; a new type is pushed on the head of its bucket with a
+   compare-and-swap, and a thread that loses the race looks for the
+   winner's copy among the new entries.  */
+
+#define INTERN_BUCKETS 16384
+
+struct ffi_intern_type
+{
+  ffi_type type;
+  struct ffi_intern_type *next;
+  size_t hash;
+  size_t nelements;
+  size_t *offsets;
+};
+
+static struct ffi_intern_type *intern_table[INTERN_BUCKETS];
+
+/* Load a bucket head, and replace it if it is still OLD.  */
+#if defined (_MSC_VER) && !defined (__clang__)
+#include <windows.h>
+#define table_load(p) \
+  InterlockedCompareExchangePointer ((PVOID volatile *) (p), NULL, NULL)
+#define table_cas(p, old, new) \
+  (InterlockedCompareExchangePointer ((PVOID volatile *) (p), (new), (old)) \
+   == (old))
+#else
+#define table_load(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define table_cas(p, old, new) \
+  __atomic_compare_exchange_n ((p), &(old), (new), 0, __ATOMIC_RELEASE, \
+			       __ATOMIC_RELAXED)
 #endif
 
+/* Hash the N type addresses in TYPES, starting from SEED.  */
+static size_t
+types_hash (size_t seed, ffi_type **types, size_t n)
+{
+  size_t h = seed, i;
+
+  for (i = 0; i < n; i++)
+    {
+      h ^= (size_t) (uintptr_t) types[i];
+      h *= (size_t) 0x9e3779b97f4a7c15ULL;
+      h ^= h >> (sizeof (size_t) * 4);
+    }
+  return h;
+}
+
+/* Find the type for ELEMENTS in the bucket list from HEAD up to, but
+   not including, STOP.  */
+static struct ffi_intern_type *
+intern_find (struct ffi_intern_type *head, struct ffi_intern_type *stop,
+	     size_t hash, ffi_type **elements, size_t n)
+{
+  for (; head != stop; head = head->next)
+    if (head->hash == hash && head->nelements == n
+	&& memcmp (head->type.elements, elements, n * sizeof (ffi_type *)) == 0)
+      return head;
+  return NULL;
+}
+
+ffi_type *
+ffi_type_struct_intern (ffi_type **elements, size_t n)
+{
+  struct ffi_intern_type **bucket, *head, *node, *found;
+  size_t hash, i;
+
+  if (n == 0 || elements == NULL)
+    return NULL;
+  for (i = 0; i < n; i++)
+    if (elements[i] == NULL)
+      return NULL;
+
+  hash = types_hash (n, elements, n);
+  bucket = &intern_table[hash % INTERN_BUCKETS];
+  head = table_load (bucket);
+  found = intern_find (head, NULL, hash, elements, n);
+  if (found != NULL)
+    return &found->type;
+
+  node = malloc (sizeof (*node) + (n + 1) * sizeof (ffi_type *)
+		 + n * sizeof (size_t));
+  if (node == NULL)
+    return NULL;
+  node->type.size = 0;
+  node->type.alignment = 0;
+  node->type.type = FFI_TYPE_STRUCT;
+  node->type.elements = (ffi_type **) (node + 1);
+  memcpy (node->type.elements, elements, n * sizeof (ffi_type *));
+  node->type.elements[n] = NULL;
+  node->offsets = (size_t *) (node->type.elements + n + 1);
+  node->hash = hash;
+  node->nelements = n;
+  if (initialize_aggregate (&node->type, node->offsets) != FFI_OK)
+    {
+      free (node);
+      return NULL;
+    }
+
+  for (;;)
+    {
+      struct ffi_intern_type *seen = head;
+
+      node->next = head;
+      if (table_cas (bucket, head, node))
+	return &node->type;
+
+      /* Another thread added to the bucket; it may have added this
+	 type.  */
+      head = table_load (bucket);
+      found = intern_find (head, seen, hash, elements, n);
+      if (found != NULL)
+	{
+	  free (node);
+	  return &found->type;
+	}
+    }
+}
+
+/* Return the interned type whose type is T, or NULL.  */
+static struct ffi_intern_type *
+intern_lookup (ffi_type *t)
+{
+  struct ffi_intern_type *node;
+  size_t n;
+
+  if (t->size == 0 || t->elements == NULL)
+    return NULL;
+  for (n = 0; t->elements[n] != NULL; n++)
+    ;
+  node = table_load (&intern_table[types_hash (n, t->elements, n)
+				    % INTERN_BUCKETS]);
+  for (; node != NULL; node = node->next)
+    if (&node->type == t)
+      return node;
+  return NULL;
+}
+
 ffi_status
 ffi_get_struct_offsets (ffi_abi abi, ffi_type *struct_type, size_t *offsets)
 {
+  struct ffi_intern_type *node;
+
   if (! (abi > FFI_FIRST_ABI && abi < FFI_LAST_ABI))
     return FFI_BAD_ABI;
   if (struct_type->type != FFI_TYPE_STRUCT)
@@ -276,5 +578,329 @@ ffi_get_struct_offsets (ffi_abi abi, ffi_type *struct_type, size_t *offsets)
   ffi_prep_types (abi);
 #endif
 
+  /* Interned types are laid out already and must not be changed.  */
+  node = intern_lookup (struct_type);
+  if (node != NULL)
+    {
+      if (offsets)
+	memcpy (offsets, node->offsets, node->nelements * sizeof (size_t));
+      return FFI_OK;
+    }
+
   return initialize_aggregate(struct_type, offsets);
 }
+
+/* Shared cifs, one per signature, kept for the life of the process in
+   a table that works like the one for interned types above.  Each cif
+   owns a copy of its argument types.  */
+
+#define CIF_BUCKETS 4096
+
+struct ffi_cif_entry
+{
+  ffi_cif cif;
+  struct ffi_cif_entry *next;
+  size_t hash;
+  unsigned int nfixed;
+};
+
+static struct ffi_cif_entry *cif_table[CIF_BUCKETS];
+
+/* Find the entry for the signature in the bucket list from HEAD up to,
+   but not including, STOP.  */
+static struct ffi_cif_entry *
+cif_find (struct ffi_cif_entry *head, struct ffi_cif_entry *stop,
+	  size_t hash, ffi_abi abi, ffi_type *rtype, unsigned int nargs,
+	  ffi_type **atypes, unsigned int nfixed)
+{
+  for (; head != stop; head = head->next)
+    if (head->hash == hash && head->cif.abi == abi
+	&& head->cif.rtype == rtype && head->cif.nargs == nargs
+	&& head->nfixed == nfixed
+	&& (nargs == 0
+	    || memcmp (head->cif.arg_types, atypes,
+		       nargs * sizeof (ffi_type *)) == 0))
+      return head;
+  return NULL;
+}
+
+ffi_cif *
+ffi_cif_lookup (ffi_abi abi, ffi_type *rtype, unsigned int nargs,
+		ffi_type **atypes, unsigned int nfixed)
+{
+  struct ffi_cif_entry **bucket, *head, *entry, *found;
+  ffi_type **types;
+  ffi_status status;
+  size_t hash;
+
+  if (nfixed > nargs)
+    return NULL;
+
+  hash = types_hash ((size_t) abi * 31 + nargs * 7 + nfixed, &rtype, 1);
+  hash = types_hash (hash, atypes, nargs);
+  bucket = &cif_table[hash % CIF_BUCKETS];
+  head = table_load (bucket);
+  found = cif_find (head, NULL, hash, abi, rtype, nargs, atypes, nfixed);
+  if (found != NULL)
+    return &found->cif;
+
+  entry = malloc (sizeof (*entry) + nargs * sizeof (ffi_type *));
+  if (entry == NULL)
+    return NULL;
+  types = (ffi_type **) (entry + 1);
+  if (nargs)
+    memcpy (types, atypes, nargs * sizeof (ffi_type *));
+  if (nfixed != 0)
+    status = ffi_prep_cif_var (&entry->cif, abi, nfixed, nargs, rtype, types);
+  else
+    status = ffi_prep_cif (&entry->cif, abi, nargs, rtype, types);
+  if (status != FFI_OK)
+    {
+      free (entry);
+      return NULL;
+    }
+  entry->hash = hash;
+  entry->nfixed = nfixed;
+
+  for (;;)
+    {
+      struct ffi_cif_entry *seen = head;
+
+      entry->next = head;
+      if (table_cas (bucket, head, entry))
+	return &entry->cif;
+
+      head = table_load (bucket);
+      found = cif_find (head, seen, hash, abi, rtype, nargs, atypes, nfixed);
+      if (found != NULL)
+	{
+	  free (entry);
+	  return &found->cif;
+	}
+    }
+}
+
+/* Signature strings.  A signature is a return type followed by the
+   argument types in parentheses, such as "d(ip{if})".  A ';' in the
+   argument list ends the fixed arguments of a variadic function.
+   Parsed signatures are kept in a table like the one above, so a
+   signature seen before is not parsed again.  */
+
+#define SIG_BUCKETS 4096
+#define SIG_MAX_DEPTH 32
+
+struct ffi_sig_entry
+{
+  struct ffi_sig_entry *next;
+  size_t hash;
+  size_t len;
+  ffi_abi abi;
+  ffi_cif *cif;
+};
+
+static struct ffi_sig_entry *sig_table[SIG_BUCKETS];
+
+static size_t
+sig_hash (ffi_abi abi, const char *sig, size_t len)
+{
+  size_t h = (size_t) abi * 31 + len, i;
+
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) sig[i]) * (size_t) 0x100000001b3ULL;
+  return h ^ (h >> (sizeof (size_t) * 4));
+}
+
+static struct ffi_sig_entry *
+sig_find (struct ffi_sig_entry *head, struct ffi_sig_entry *stop,
+	  size_t hash, ffi_abi abi, const char *sig, size_t len)
+{
+  for (; head != stop; head = head->next)
+    if (head->hash == hash && head->abi == abi && head->len == len
+	&& memcmp (head + 1, sig, len) == 0)
+      return head;
+  return NULL;
+}
+
+static const char *sig_type (const char *s, ffi_type **type, int depth);
+
+/* Parse types up to the character END into a malloc'd array of *N
+   types, and return a pointer to END, or NULL on error.  If NFIXED is
+   not NULL a ';' may follow the fixed types, whose number is stored in
+   *NFIXED; otherwise *NFIXED is zero.  */
+static const char *
+sig_list (const char *s, char end, int depth, ffi_type ***types,
+	  size_t *n, size_t *nfixed)
+{
+  ffi_type **v = NULL, **nv;
+  size_t count = 0, cap = 0;
+
+  if (nfixed != NULL)
+    *nfixed = 0;
+  while (*s != end)
+    {
+      if (*s == ';' && nfixed != NULL && *nfixed == 0 && count > 0)
+	{
+	  *nfixed = count;
+	  s++;
+	  continue;
+	}
+      if (count == cap)
+	{
+	  cap = cap ? cap * 2 : 8;
+	  nv = realloc (v, cap * sizeof (ffi_type *));
+	  if (nv == NULL)
+	    break;
+	  v = nv;
+	}
+      s = sig_type (s, &v[count], depth);
+      if (s == NULL)
+	break;
+      count++;
+    }
+
+  if (s == NULL || *s != end)
+    {
+      free (v);
+      return NULL;
+    }
+  *types = v;
+  *n = count;
+  return s;
+}
+
+/* Parse one argument or member type.  */
+static const char *
+sig_type (const char *s, ffi_type **type, int depth)
+{
+  ffi_type **elements;
+  size_t n;
+
+  switch (*s)
+    {
+    case 'c': *type = &ffi_type_schar; break;
+    case 'C': *type = &ffi_type_uchar; break;
+    case 's': *type = &ffi_type_sshort; break;
+    case 'S': *type = &ffi_type_ushort; break;
+    case 'i': *type = &ffi_type_sint; break;
+    case 'I': *type = &ffi_type_uint; break;
+    case 'l': *type = &ffi_type_slong; break;
+    case 'L': *type = &ffi_type_ulong; break;
+    case 'q': *type = &ffi_type_sint64; break;
+    case 'Q': *type = &ffi_type_uint64; break;
+    case 'f': *type = &ffi_type_float; break;
+    case 'd': *type = &ffi_type_double; break;
+    case 'D': *type = &ffi_type_longdouble; break;
+    case 'p': *type = &ffi_type_pointer; break;
+    case '{':
+      if (depth >= SIG_MAX_DEPTH)
+	return NULL;
+      s = sig_list (s + 1, '}', depth + 1, &elements, &n, NULL);
+      if (s == NULL)
+	return NULL;
+      *type = n ? ffi_type_struct_intern (elements, n) : NULL;
+      free (elements);
+      if (*type == NULL)
+	return NULL;
+      break;
+    default:
+      return NULL;
+    }
+  return s + 1;
+}
+
+/* Prepare CIF with the types of the shared cif SHARED.  A cif is not
+   copied, since a port may keep state for it that a copy would lack;
+   the types are, so the arrays of SHARED serve both.  */
+static ffi_status
+sig_prep (ffi_cif *cif, const ffi_cif *shared)
+{
+  if (shared->nfixed != 0)
+    return ffi_prep_cif_var (cif, shared->abi, shared->nfixed, shared->nargs,
+			     shared->rtype, shared->arg_types);
+  return ffi_prep_cif (cif, shared->abi, shared->nargs, shared->rtype,
+		       shared->arg_types);
+}
+
+ffi_status
+ffi_prep_cif_sig (ffi_cif *cif, ffi_abi abi, const char *sig)
+{
+  struct ffi_sig_entry **bucket, *head, *entry, *found;
+  ffi_type *rtype, **atypes;
+  size_t len, hash, nargs, nfixed;
+  ffi_cif *shared;
+  ffi_status status;
+  const char *s;
+
+  if (cif == NULL || sig == NULL)
+    return FFI_BAD_TYPEDEF;
+
+  len = strlen (sig);
+  hash = sig_hash (abi, sig, len);
+  bucket = &sig_table[hash % SIG_BUCKETS];
+  head = table_load (bucket);
+  found = sig_find (head, NULL, hash, abi, sig, len);
+  if (found != NULL)
+    return sig_prep (cif, found->cif);
+
+  if (*sig == 'v')
+    {
+      rtype = &ffi_type_void;
+      s = sig + 1;
+    }
+  else
+    s = sig_type (sig, &rtype, 0);
+  if (s == NULL || *s != '(')
+    return FFI_BAD_TYPEDEF;
+  s = sig_list (s + 1, ')', 0, &atypes, &nargs, &nfixed);
+  if (s == NULL)
+    return FFI_BAD_TYPEDEF;
+  if (s[1] != '\0' || nargs > UINT_MAX)
+    {
+      free (atypes);
+      return FFI_BAD_TYPEDEF;
+    }
+
+  shared = ffi_cif_lookup (abi, rtype, (unsigned int) nargs, atypes,
+			   (unsigned int) nfixed);
+  if (shared == NULL)
+    {
+      /* Prepare the caller's cif to find out what was wrong.  */
+      if (nfixed != 0)
+	status = ffi_prep_cif_var (cif, abi, (unsigned int) nfixed,
+				   (unsigned int) nargs, rtype, atypes);
+      else
+	status = ffi_prep_cif (cif, abi, (unsigned int) nargs, rtype, atypes);
+      free (atypes);
+      return status == FFI_OK ? FFI_BAD_TYPEDEF : status;
+    }
+  free (atypes);
+  status = sig_prep (cif, shared);
+  if (status != FFI_OK)
+    return status;
+
+  /* Remember the signature.  If that fails the cif is still good.  */
+  entry = malloc (sizeof (*entry) + len);
+  if (entry == NULL)
+    return FFI_OK;
+  memcpy (entry + 1, sig, len);
+  entry->hash = hash;
+  entry->len = len;
+  entry->abi = abi;
+  entry->cif = shared;
+
+  for (;;)
+    {
+      struct ffi_sig_entry *seen = head;
+
+      entry->next = head;
+      if (table_cas (bucket, head, entry))
+	return FFI_OK;
+
+      head = table_load (bucket);
+      if (sig_find (head, seen, hash, abi, sig, len) != NULL)
+	{
+	  free (entry);
+	  return FFI_OK;
+	}
+    }
+}
@@ -43,7 +43,6 @@
 
 #define NARGREG 8
 #define STKALIGN 16
-#define MAXCOPYARG (2 * sizeof(double))
 
 typedef struct call_context
 {
@@ -55,14 +54,20 @@ typedef struct call_context
     char frame[16];
 } call_context;
 
-typedef struct call_builder
+/* ffi_riscv_arg kinds */
+#define PLAN_ATOMS 0 /* atoms read straight from the argument */
+#define PLAN_WORDS 1 /* argument realigned into XLEN words first */
+#define PLAN_BYREF 2 /* passed as a pointer to a copy */
+
+/* register allocation state while building a plan */
+typedef struct plan_builder
 {
-    call_context *aregs;
     int used_integer;
     int used_float;
-    size_t *used_stack;
-    void *struct_stack;
-} call_builder;
+    unsigned used_stack;
+    size_t struct_bytes;
+    size_t scratch_bytes;
+} plan_builder;
 
 /* integer (not pointer) less than ABI XLEN */
 /* FFI_TYPE_INT does not appear to be used */
@@ -98,7 +103,7 @@ static ffi_type **flatten_struct(ffi_type *in, ffi_type **out, ffi_type **out_en
 /* Structs with at most two fields after flattening, one of which is of
    floating point type, are passed in multiple registers if sufficient
    registers are available. */
-static float_struct_info struct_passed_as_elements(call_builder *cb, ffi_type *top) {
+static float_struct_info struct_passed_as_elements(plan_builder *cb, ffi_type *top) {
     float_struct_info ret = {0, 0, 0, 0};
     ffi_type *fields[3];
     int num_floats, num_ints;
@@ -129,8 +134,135 @@ static float_struct_info struct_passed_as_elements(call_builder *cb, ffi_type *t
 }
 #endif
 
-/* allocates a single register, float register, or XLEN-sized stack slot to a datum */
-static void marshal_atom(call_builder *cb, int type, void *data) {
+/* assigns a single register, float register, or XLEN-sized stack slot to
+   an atom of type TYPE at OFFSET within the argument */
+static void plan_atom(plan_builder *pb, ffi_riscv_arg *e, int type, size_t offset) {
+    ffi_riscv_atom *atom = &e->atoms[e->natoms++];
+    atom->type = type;
+    atom->offset = offset;
+#if ABI_FLEN
+    if (IS_FLOAT(type)) {
+        atom->slot = pb->used_float++;
+        return;
+    }
+#endif
+    if (pb->used_integer == NARGREG)
+        atom->slot = NARGREG + pb->used_stack++;
+    else
+        atom->slot = pb->used_integer++;
+}
+
+/* decides how an argument, or a not by reference return value, is passed */
+static void plan_arg(plan_builder *pb, ffi_type *type, int var, ffi_riscv_arg *e) {
+    e->natoms = 0;
+    e->copy = 0;
+
+#if ABI_FLEN
+    if (!var && type->type == FFI_TYPE_STRUCT) {
+        float_struct_info fsi = struct_passed_as_elements(pb, type);
+        if (fsi.as_elements) {
+            e->kind = PLAN_ATOMS;
+            plan_atom(pb, e, fsi.type1, 0);
+            if (fsi.offset2)
+                plan_atom(pb, e, fsi.type2, fsi.offset2);
+            goto scratch;
+        }
+    }
+
+    if (!var && pb->used_float < NARGREG && IS_FLOAT(type->type)) {
+        e->kind = PLAN_ATOMS;
+        plan_atom(pb, e, type->type, 0);
+        goto scratch;
+    }
+#endif
+
+    if (type->size > 2 * __SIZEOF_POINTER__) {
+        /* copy to stack and pass by reference */
+        e->kind = PLAN_BYREF;
+        e->copy = pb->struct_bytes;
+        pb->struct_bytes = FFI_ALIGN(pb->struct_bytes + type->size, __SIZEOF_POINTER__);
+        plan_atom(pb, e, FFI_TYPE_POINTER, 0);
+        return;
+    } else if (IS_INT(type->type) || type->type == FFI_TYPE_POINTER) {
+        e->kind = PLAN_ATOMS;
+        plan_atom(pb, e, type->type, 0);
+    } else {
+        /* overlong integers, soft-float floats, and structs without special
+           float handling are treated identically from this point on */
+        e->kind = PLAN_WORDS;
+
+        /* variadics are aligned even in registers */
+        if (type->alignment > __SIZEOF_POINTER__) {
+            if (var)
+                pb->used_integer = FFI_ALIGN(pb->used_integer, 2);
+            pb->used_stack = FFI_ALIGN(pb->used_stack, 2);
+        }
+
+        if (type->size > 0)
+            plan_atom(pb, e, FFI_TYPE_POINTER, 0);
+        if (type->size > __SIZEOF_POINTER__)
+            plan_atom(pb, e, FFI_TYPE_POINTER, __SIZEOF_POINTER__);
+    }
+
+#if ABI_FLEN
+ scratch:
+#endif
+    /* arguments not passed by reference are unpacked by closures into
+       their own aligned, XLEN-padded copy */
+    pb->scratch_bytes = FFI_ALIGN(pb->scratch_bytes,
+        type->alignment > __SIZEOF_POINTER__ ? type->alignment : __SIZEOF_POINTER__);
+    e->copy = pb->scratch_bytes;
+    pb->scratch_bytes += FFI_ALIGN(type->size, __SIZEOF_POINTER__);
+}
+
+/* builds the placement of the return value in RPLAN and of every argument in
+   PLAN (if not NULL), and returns the builder holding the stack and closure
+   scratch sizes */
+static plan_builder plan_args(ffi_cif *cif, ffi_riscv_arg *rplan, ffi_riscv_arg *plan) {
+    plan_builder pb = { 0, 0, 0, 0, 0 };
+    ffi_riscv_arg e;
+    unsigned i;
+
+    plan_arg(&pb, cif->rtype, 0, rplan);
+
+    pb.used_integer = pb.used_float = 0;
+    pb.used_stack = 0;
+    pb.struct_bytes = pb.scratch_bytes = 0;
+    /* a return value passed by reference takes the first argument register */
+    if (rplan->kind == PLAN_BYREF)
+        pb.used_integer = 1;
+
+    for (i = 0; i < cif->nargs; i++)
+        plan_arg(&pb, cif->arg_types[i], i >= cif->riscv_nfixedargs,
+                 plan ? &plan[i] : &e);
+
+    return pb;
+}
+
+/* builds the plan kept in CIF, and the sizes used by every call, which are
+   the same whether or not the cif has room for the argument plan */
+static void prep_plan(ffi_cif *cif) {
+    plan_builder pb = plan_args(cif, &cif->riscv_rplan,
+                                cif->nargs <= FFI_RISCV_PLAN_ARGS ? cif->riscv_plan : NULL);
+
+    cif->riscv_stack_words = pb.used_stack;
+    cif->riscv_scratch = pb.scratch_bytes;
+}
+
+/* returns the argument plan of CIF, building it in SCRATCH if the cif has
+   too many arguments to keep one; the cif itself is left untouched, since
+   it may be shared between threads */
+static const ffi_riscv_arg *get_plan(ffi_cif *cif, ffi_riscv_arg *scratch) {
+    ffi_riscv_arg rplan;
+
+    if (cif->nargs <= FFI_RISCV_PLAN_ARGS)
+        return cif->riscv_plan;
+    plan_args(cif, &rplan, scratch);
+    return scratch;
+}
+
+/* stores a single atom to its register or stack slot */
+static void marshal_atom(call_context *aregs, size_t *stack, int type, unsigned slot, void *data) {
     size_t value = 0;
     switch (type) {
         case FFI_TYPE_UINT8: value = *(uint8_t *)data; break;
@@ -151,43 +283,43 @@ static void marshal_atom(call_builder *cb, int type, void *data) {
            reinterpret floats as doubles */
 #if ABI_FLEN >= 32
         case FFI_TYPE_FLOAT:
-            asm("" : "=f"(cb->aregs->fa[cb->used_float++]) : "0"(*(float *)data));
+            asm("" : "=f"(aregs->fa[slot]) : "0"(*(float *)data));
             return;
 #endif
 #if ABI_FLEN >= 64
         case FFI_TYPE_DOUBLE:
-            asm("" : "=f"(cb->aregs->fa[cb->used_float++]) : "0"(*(double *)data));
+            asm("" : "=f"(aregs->fa[slot]) : "0"(*(double *)data));
             return;
 #endif
         default: FFI_ASSERT(0); break;
     }
 
-    if (cb->used_integer == NARGREG) {
-        *cb->used_stack++ = value;
+    if (slot >= NARGREG) {
+        stack[slot - NARGREG] = value;
     } else {
-        cb->aregs->a[cb->used_integer++] = value;
+        aregs->a[slot] = value;
     }
 }
 
-static void unmarshal_atom(call_builder *cb, int type, void *data) {
+static void unmarshal_atom(call_context *aregs, size_t *stack, int type, unsigned slot, void *data) {
     size_t value;
     switch (type) {
 #if ABI_FLEN >= 32
         case FFI_TYPE_FLOAT:
-            asm("" : "=f"(*(float *)data) : "0"(cb->aregs->fa[cb->used_float++]));
+            asm("" : "=f"(*(float *)data) : "0"(aregs->fa[slot]));
             return;
 #endif
 #if ABI_FLEN >= 64
         case FFI_TYPE_DOUBLE:
-            asm("" : "=f"(*(double *)data) : "0"(cb->aregs->fa[cb->used_float++]));
+            asm("" : "=f"(*(double *)data) : "0"(aregs->fa[slot]));
             return;
 #endif
     }
 
-    if (cb->used_integer == NARGREG) {
-        value = *cb->used_stack++;
+    if (slot >= NARGREG) {
+        value = stack[slot - NARGREG];
     } else {
-        value = cb->aregs->a[cb->used_integer++];
+        value = aregs->a[slot];
     }
 
     switch (type) {
@@ -207,115 +339,57 @@ static void unmarshal_atom(call_builder *cb, int type, void *data) {
 }
 
 /* adds an argument to a call, or a not by reference return value */
-static void marshal(call_builder *cb, ffi_type *type, int var, void *data) {
+static void marshal(call_context *aregs, size_t *stack, const ffi_riscv_arg *e,
+                    ffi_type *type, char *struct_stack, void *data) {
     size_t realign[2];
+    int i;
 
-#if ABI_FLEN
-    if (!var && type->type == FFI_TYPE_STRUCT) {
-        float_struct_info fsi = struct_passed_as_elements(cb, type);
-        if (fsi.as_elements) {
-            marshal_atom(cb, fsi.type1, data);
-            if (fsi.offset2)
-                marshal_atom(cb, fsi.type2, ((char*)data) + fsi.offset2);
+    switch (e->kind) {
+        case PLAN_BYREF:
+            /* copy to stack and pass by reference */
+            data = memcpy(struct_stack + e->copy, data, type->size);
+            marshal_atom(aregs, stack, FFI_TYPE_POINTER, e->atoms[0].slot, &data);
             return;
-        }
-    }
-
-    if (!var && cb->used_float < NARGREG && IS_FLOAT(type->type)) {
-        marshal_atom(cb, type->type, data);
-        return;
+        case PLAN_WORDS:
+            memcpy(realign, data, type->size);
+            data = realign;
+            break;
     }
-#endif
-
-    if (type->size > 2 * __SIZEOF_POINTER__) {
-        /* copy to stack and pass by reference */
-        data = memcpy (cb->struct_stack, data, type->size);
-        cb->struct_stack = (size_t *) FFI_ALIGN ((char *) cb->struct_stack + type->size, __SIZEOF_POINTER__);
-        marshal_atom(cb, FFI_TYPE_POINTER, &data);
-    } else if (IS_INT(type->type) || type->type == FFI_TYPE_POINTER) {
-        marshal_atom(cb, type->type, data);
-    } else {
-        /* overlong integers, soft-float floats, and structs without special
-           float handling are treated identically from this point on */
 
-        /* variadics are aligned even in registers */
-        if (type->alignment > __SIZEOF_POINTER__) {
-            if (var)
-                cb->used_integer = FFI_ALIGN(cb->used_integer, 2);
-            cb->used_stack = (size_t *)FFI_ALIGN(cb->used_stack, 2*__SIZEOF_POINTER__);
-        }
-
-        memcpy(realign, data, type->size);
-        if (type->size > 0)
-            marshal_atom(cb, FFI_TYPE_POINTER, realign);
-        if (type->size > __SIZEOF_POINTER__)
-            marshal_atom(cb, FFI_TYPE_POINTER, realign + 1);
-    }
+    for (i = 0; i < e->natoms; i++)
+        marshal_atom(aregs, stack, e->atoms[i].type, e->atoms[i].slot,
+                     (char *)data + e->atoms[i].offset);
 }
 
-/* for arguments passed by reference returns the pointer, otherwise the arg is copied (up to MAXCOPYARG bytes) */
-static void *unmarshal(call_builder *cb, ffi_type *type, int var, void *data) {
+/* for arguments passed by reference returns the pointer, otherwise the arg is copied to DATA */
+static void *unmarshal(call_context *aregs, size_t *stack, const ffi_riscv_arg *e,
+                       ffi_type *type, void *data) {
     size_t realign[2];
     void *pointer;
+    int i;
 
-#if ABI_FLEN
-    if (!var && type->type == FFI_TYPE_STRUCT) {
-        float_struct_info fsi = struct_passed_as_elements(cb, type);
-        if (fsi.as_elements) {
-            unmarshal_atom(cb, fsi.type1, data);
-            if (fsi.offset2)
-                unmarshal_atom(cb, fsi.type2, ((char*)data) + fsi.offset2);
+    switch (e->kind) {
+        case PLAN_BYREF:
+            /* pass by reference */
+            unmarshal_atom(aregs, stack, FFI_TYPE_POINTER, e->atoms[0].slot, (char*)&pointer);
+            return pointer;
+        case PLAN_WORDS:
+            for (i = 0; i < e->natoms; i++)
+                unmarshal_atom(aregs, stack, FFI_TYPE_POINTER, e->atoms[i].slot, realign + i);
+            memcpy(data, realign, type->size);
             return data;
-        }
-    }
-
-    if (!var && cb->used_float < NARGREG && IS_FLOAT(type->type)) {
-        unmarshal_atom(cb, type->type, data);
-        return data;
     }
-#endif
-
-    if (type->size > 2 * __SIZEOF_POINTER__) {
-        /* pass by reference */
-        unmarshal_atom(cb, FFI_TYPE_POINTER, (char*)&pointer);
-        return pointer;
-    } else if (IS_INT(type->type) || type->type == FFI_TYPE_POINTER) {
-        unmarshal_atom(cb, type->type, data);
-        return data;
-    } else {
-        /* overlong integers, soft-float floats, and structs without special
-           float handling are treated identically from this point on */
 
-        /* variadics are aligned even in registers */
-        if (type->alignment > __SIZEOF_POINTER__) {
-            if (var)
-                cb->used_integer = FFI_ALIGN(cb->used_integer, 2);
-            cb->used_stack = (size_t *)FFI_ALIGN(cb->used_stack, 2*__SIZEOF_POINTER__);
-        }
-
-        if (type->size > 0)
-            unmarshal_atom(cb, FFI_TYPE_POINTER, realign);
-        if (type->size > __SIZEOF_POINTER__)
-            unmarshal_atom(cb, FFI_TYPE_POINTER, realign + 1);
-        memcpy(data, realign, type->size);
-        return data;
-    }
-}
-
-static int passed_by_ref(call_builder *cb, ffi_type *type, int var) {
-#if ABI_FLEN
-    if (!var && type->type == FFI_TYPE_STRUCT) {
-        float_struct_info fsi = struct_passed_as_elements(cb, type);
-        if (fsi.as_elements) return 0;
-    }
-#endif
-
-    return type->size > 2 * __SIZEOF_POINTER__;
+    for (i = 0; i < e->natoms; i++)
+        unmarshal_atom(aregs, stack, e->atoms[i].type, e->atoms[i].slot,
+                       (char *)data + e->atoms[i].offset);
+    return data;
 }
 
 /* Perform machine dependent cif processing */
 ffi_status ffi_prep_cif_machdep(ffi_cif *cif) {
     cif->riscv_nfixedargs = cif->nargs;
+    prep_plan(cif);
     return FFI_OK;
 }
 
@@ -323,6 +397,7 @@ ffi_status ffi_prep_cif_machdep(ffi_cif *cif) {
 
 ffi_status ffi_prep_cif_machdep_var(ffi_cif *cif, unsigned int nfixedargs, unsigned int ntotalargs) {
     cif->riscv_nfixedargs = nfixedargs;
+    prep_plan(cif);
     return FFI_OK;
 }
 
@@ -334,10 +409,9 @@ static void
 ffi_call_int (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue,
 	      void *closure)
 {
-    /* this is a conservative estimate, assuming a complex return value and
-       that all remaining arguments are long long / __int128 */
-    size_t arg_bytes = cif->nargs <= 3 ? 0 :
-        FFI_ALIGN(2 * sizeof(size_t) * (cif->nargs - 3), STKALIGN);
+    const ffi_riscv_arg *plan = get_plan(cif, cif->nargs <= FFI_RISCV_PLAN_ARGS ? NULL
+                                         : alloca(cif->nargs * sizeof(ffi_riscv_arg)));
+    size_t arg_bytes = FFI_ALIGN(cif->riscv_stack_words * sizeof(size_t), STKALIGN);
     /* Allocate space for copies of big structures.  */
     size_t struct_bytes = FFI_ALIGN (cif->bytes, STKALIGN);
     size_t rval_bytes = 0;
@@ -361,23 +435,20 @@ ffi_call_int (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue,
     if (rval_bytes)
         rvalue = (void*)(alloc_base + arg_bytes);
 
-    call_builder cb;
-    cb.used_float = cb.used_integer = 0;
-    cb.aregs = (call_context*)(alloc_base + arg_bytes + rval_bytes + struct_bytes);
-    cb.used_stack = (void*)alloc_base;
-    cb.struct_stack = (void *) (alloc_base + arg_bytes + rval_bytes);
+    call_context *aregs = (call_context*)(alloc_base + arg_bytes + rval_bytes + struct_bytes);
+    size_t *stack = (size_t *)alloc_base;
+    char *struct_stack = (char *)(alloc_base + arg_bytes + rval_bytes);
 
-    int return_by_ref = passed_by_ref(&cb, cif->rtype, 0);
+    int return_by_ref = cif->riscv_rplan.kind == PLAN_BYREF;
     if (return_by_ref)
-        marshal(&cb, &ffi_type_pointer, 0, &rvalue);
+        aregs->a[0] = (size_t)rvalue;
 
     int i;
     for (i = 0; i < cif->nargs; i++)
-        marshal(&cb, cif->arg_types[i], i >= cif->riscv_nfixedargs, avalue[i]);
+        marshal(aregs, stack, &plan[i], cif->arg_types[i], struct_stack, avalue[i]);
 
-    ffi_call_asm ((void *) alloc_base, cb.aregs, fn, closure);
+    ffi_call_asm ((void *) alloc_base, aregs, fn, closure);
 
-    cb.used_float = cb.used_integer = 0;
     if (!return_by_ref && rvalue)
       {
 	if (IS_INT(cif->rtype->type)
@@ -389,21 +460,21 @@ ffi_call_int (ffi_cif *cif, void (*fn) (void), void *rvalue, void **avalue,
 	      case FFI_TYPE_SINT8:
 	      case FFI_TYPE_SINT16:
 	      case FFI_TYPE_SINT32:
-		unmarshal_atom (&cb, (sizeof (ffi_arg) > 4
-				      ? FFI_TYPE_SINT64 : FFI_TYPE_SINT32),
-				rvalue);
+		unmarshal_atom (aregs, stack, (sizeof (ffi_arg) > 4
+					       ? FFI_TYPE_SINT64 : FFI_TYPE_SINT32),
+				0, rvalue);
 		break;
 	      case FFI_TYPE_UINT8:
 	      case FFI_TYPE_UINT16:
 	      case FFI_TYPE_UINT32:
-		unmarshal_atom (&cb, (sizeof (ffi_arg) > 4
-				      ? FFI_TYPE_UINT64 : FFI_TYPE_UINT32),
-				rvalue);
+		unmarshal_atom (aregs, stack, (sizeof (ffi_arg) > 4
+					       ? FFI_TYPE_UINT64 : FFI_TYPE_UINT32),
+				0, rvalue);
 		break;
 	      }
 	  }
 	else
-	  unmarshal(&cb, cif->rtype, 0, rvalue);
+	  unmarshal(aregs, stack, &cif->riscv_rplan, cif->rtype, rvalue);
       }
 }
 
@@ -480,35 +551,28 @@ ffi_closure_inner (ffi_cif *cif,
 		   void *user_data,
 		   size_t *stack, call_context *aregs)
 {
+    const ffi_riscv_arg *plan = get_plan(cif, cif->nargs <= FFI_RISCV_PLAN_ARGS ? NULL
+                                         : alloca(cif->nargs * sizeof(ffi_riscv_arg)));
     void **avalue = alloca(cif->nargs * sizeof(void*));
-    /* storage for arguments which will be copied by unmarshal().  We could
-       theoretically avoid the copies in many cases and use at most 128 bytes
-       of memory, but allocating disjoint storage for each argument is
-       simpler. */
-    char *astorage = alloca(cif->nargs * MAXCOPYARG);
+    /* storage for arguments which will be copied by unmarshal(), laid out
+       by the plan */
+    char *astorage = alloca(cif->riscv_scratch);
     void *rvalue;
-    call_builder cb;
     int return_by_ref;
     int i;
 
-    cb.aregs = aregs;
-    cb.used_integer = cb.used_float = 0;
-    cb.used_stack = stack;
-
-    return_by_ref = passed_by_ref(&cb, cif->rtype, 0);
+    return_by_ref = cif->riscv_rplan.kind == PLAN_BYREF;
     if (return_by_ref)
-        unmarshal(&cb, &ffi_type_pointer, 0, &rvalue);
+        unmarshal_atom(aregs, stack, FFI_TYPE_POINTER, 0, &rvalue);
     else
         rvalue = alloca(cif->rtype->size);
 
     for (i = 0; i < cif->nargs; i++)
-        avalue[i] = unmarshal(&cb, cif->arg_types[i],
-            i >= cif->riscv_nfixedargs, astorage + i*MAXCOPYARG);
+        avalue[i] = unmarshal(aregs, stack, &plan[i], cif->arg_types[i],
+                              astorage + plan[i].copy);
 
     fun (cif, rvalue, avalue, user_data);
 
-    if (!return_by_ref && cif->rtype->type != FFI_TYPE_VOID) {
-        cb.used_integer = cb.used_float = 0;
-        marshal(&cb, cif->rtype, 0, rvalue);
-    }
+    if (!return_by_ref && cif->rtype->type != FFI_TYPE_VOID)
+        marshal(aregs, stack, &cif->riscv_rplan, cif->rtype, NULL, rvalue);
 }
@@ -54,6 +54,27 @@ typedef enum ffi_abi {
     FFI_DEFAULT_ABI = FFI_SYSV
 } ffi_abi;
 
+/* One register- or stack-sized piece of an argument: TYPE is the
+   FFI_TYPE_* it is moved as, OFFSET its position within the argument
+   and SLOT the FP register, integer register or stack word holding it.  */
+typedef struct {
+    unsigned char type;
+    unsigned char offset;
+    unsigned short slot;
+} ffi_riscv_atom;
+
+/* Placement of one argument or return value, computed once by
+   ffi_prep_cif_machdep; see src/riscv/ffi.c.  */
+typedef struct {
+    ffi_riscv_atom atoms[2];
+    unsigned char kind;
+    unsigned char natoms;
+    unsigned copy;
+} ffi_riscv_arg;
+
+/* Cifs with more arguments than this compute their plan on the fly.  */
+#define FFI_RISCV_PLAN_ARGS 16
+
 #endif /* LIBFFI_ASM */
 
 /* ---- Definitions for closures ----------------------------------------- */
@@ -62,7 +83,9 @@ typedef enum ffi_abi {
 #define FFI_GO_CLOSURES 1
 #define FFI_TRAMPOLINE_SIZE 24
 #define FFI_NATIVE_RAW_API 0
-#define FFI_EXTRA_CIF_FIELDS unsigned riscv_nfixedargs; unsigned riscv_unused;
+#define FFI_EXTRA_CIF_FIELDS unsigned riscv_nfixedargs; unsigned riscv_unused; \
+    unsigned riscv_stack_words; unsigned riscv_scratch; \
+    ffi_riscv_arg riscv_rplan; ffi_riscv_arg riscv_plan[FFI_RISCV_PLAN_ARGS];
 #define FFI_TARGET_SPECIFIC_VARIADIC
 
 #endif
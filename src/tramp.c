@@ -73,6 +73,21 @@
 void __attribute__((weak)) *ffi_tramp_arch (size_t *tramp_size,
   size_t *map_size);
 
+/*
+ * An architecture may also provide a template for large trampoline tables:
+ * a block of trampolines that find their parameters *map_size bytes away,
+ * rather than at the end of the block. Copies of the template fill the
+ * code table of a large table, so one code mapping and one parameter
+ * mapping hold many pages of trampolines. This function returns:
+ *
+ *	- the address of the template in the text segment
+ *	- the size of each trampoline in the template
+ *	- the size of the template
+ *	- the size of the code table mapping of a large table
+ */
+void __attribute__((weak)) *ffi_tramp_arch_large (size_t *tramp_size,
+  size_t *template_size, size_t *map_size);
+
 /* ------------------------- Trampoline Data Structures --------------------*/
 
 struct tramp;
@@ -87,6 +102,9 @@ struct tramp;
  * array	Array of trampolines malloced.
  * free		List of free trampolines.
  * nfree	Number of free trampolines.
+ * ntramp	Number of trampolines in the table.
+ * map_size	Size of the code table mapping.
+ * large	Whether this is a large table.
  */
 struct tramp_table
 {
@@ -97,6 +115,9 @@ struct tramp_table
   struct tramp *array;
   struct tramp *free;
   int nfree;
+  int ntramp;
+  size_t map_size;
+  int large;
 };
 
 /*
@@ -156,8 +177,24 @@ enum tramp_globals_status {
  *	List of trampoline tables that contain free trampolines.
  * nfree_tables
  *	Number of trampoline tables that contain free trampolines.
+ * ntables
+ *	Number of trampoline tables.
+ * ntramp_total, nfree_total
+ *	Number of trampolines in all tables, and number of those that are on
+ *	the free lists of their tables.
+ * table_bytes, empty_bytes
+ *	Size of the mappings of all tables, and of tables whose trampolines
+ *	are all free.
  * status
  *	Initialization status.
+ * large_fd, large_map_size, large_template_size, large_ntramp
+ *	As fd, map_size, the size of one block of trampolines and ntramp,
+ *	for large tables.
+ * large_status
+ *	Whether large tables have been set up.
+ * large_huge
+ *	Whether large tables are aligned to their size and marked for huge
+ *	pages.
  */
 struct tramp_globals
 {
@@ -169,7 +206,18 @@ struct tramp_globals
   int ntramp;
   struct tramp_table *free_tables;
   int nfree_tables;
+  int ntables;
+  size_t ntramp_total;
+  size_t nfree_total;
+  size_t table_bytes;
+  size_t empty_bytes;
   enum tramp_globals_status status;
+  int large_fd;
+  size_t large_map_size;
+  size_t large_template_size;
+  int large_ntramp;
+  enum tramp_globals_status large_status;
+  int large_huge;
 };
 
 static struct tramp_globals tramp_globals;
@@ -336,36 +384,108 @@ ffi_tramp_unlock(void)
 static int
 tramp_table_map (struct tramp_table *table)
 {
+  size_t map_size = table->map_size;
+  size_t align = 0;
   char *addr;
 
+  if (table->large && tramp_globals.large_huge)
+    align = map_size;
+
   /*
    * Create an anonymous mapping twice the map size. The top half will be used
    * for the code table. The bottom half will be used for the parameter table.
+   * If the tables are to be aligned, map extra space and trim it.
    */
-  addr = mmap (NULL, tramp_globals.map_size * 2, PROT_READ | PROT_WRITE,
+  addr = mmap (NULL, map_size * 2 + align, PROT_READ | PROT_WRITE,
     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (addr == MAP_FAILED)
     return 0;
+  if (align)
+    {
+      char *start = (char *) (((uintptr_t) addr + align - 1) & ~(align - 1));
+
+      if (start != addr)
+	(void) munmap (addr, start - addr);
+      if (start != addr + align)
+	(void) munmap (start + map_size * 2, addr + align - start);
+      addr = start;
+    }
 
   /*
    * Replace the top half of the anonymous mapping with the code table mapping.
    */
-  table->code_table = mmap (addr, tramp_globals.map_size, PROT_READ | PROT_EXEC,
-    MAP_PRIVATE | MAP_FIXED, tramp_globals.fd, tramp_globals.offset);
+  if (table->large)
+    table->code_table = mmap (addr, map_size, PROT_READ | PROT_EXEC,
+      MAP_PRIVATE | MAP_FIXED, tramp_globals.large_fd, 0);
+  else
+    table->code_table = mmap (addr, map_size, PROT_READ | PROT_EXEC,
+      MAP_PRIVATE | MAP_FIXED, tramp_globals.fd, tramp_globals.offset);
   if (table->code_table == MAP_FAILED)
     {
-      (void) munmap (addr, tramp_globals.map_size * 2);
+      (void) munmap (addr, map_size * 2);
       return 0;
     }
-  table->parm_table = table->code_table + tramp_globals.map_size;
+  table->parm_table = table->code_table + map_size;
+#ifdef MADV_HUGEPAGE
+  if (align)
+    (void) madvise (addr, map_size * 2, MADV_HUGEPAGE);
+#endif
   return 1;
 }
 
 static void
 tramp_table_unmap (struct tramp_table *table)
 {
-  (void) munmap (table->code_table, tramp_globals.map_size);
-  (void) munmap (table->parm_table, tramp_globals.map_size);
+  (void) munmap (table->code_table, table->map_size);
+  (void) munmap (table->parm_table, table->map_size);
+}
+
+/*
+ * Set up large tables: write copies of the architecture's template to a
+ * temporary file until it is as large as a code table. Large tables are
+ * only used once a process has several small ones, so that processes with
+ * few closures do not pay for the file.
+ */
+static int
+tramp_large_init (void)
+{
+  size_t done, size;
+  void *text;
+
+  if (tramp_globals.large_status != TRAMP_GLOBALS_UNINITIALIZED)
+    return tramp_globals.large_status == TRAMP_GLOBALS_PASSED;
+  tramp_globals.large_status = TRAMP_GLOBALS_FAILED;
+
+  if (ffi_tramp_arch_large == NULL)
+    return 0;
+  text = ffi_tramp_arch_large (&size, &tramp_globals.large_template_size,
+    &tramp_globals.large_map_size);
+  if (size != tramp_globals.size)
+    return 0;
+  tramp_globals.large_ntramp =
+    (tramp_globals.large_map_size / tramp_globals.large_template_size)
+    * (tramp_globals.large_template_size / tramp_globals.size);
+
+  tramp_globals.large_fd = open_temp_exec_file ();
+  if (tramp_globals.large_fd == -1)
+    return 0;
+  for (done = 0; done < tramp_globals.large_map_size;
+       done += tramp_globals.large_template_size)
+    {
+      ssize_t count = write (tramp_globals.large_fd, text,
+        tramp_globals.large_template_size);
+
+      if (count < 0 || (size_t) count != tramp_globals.large_template_size)
+	{
+	  close (tramp_globals.large_fd);
+	  tramp_globals.large_fd = -1;
+	  return 0;
+	}
+    }
+
+  tramp_globals.large_huge = getenv ("LIBFFI_TRAMP_HUGEPAGES") != NULL;
+  tramp_globals.large_status = TRAMP_GLOBALS_PASSED;
+  return 1;
 }
 
 #endif /* defined (__linux__) || defined (__CYGWIN__) */
@@ -373,7 +493,9 @@ tramp_table_unmap (struct tramp_table *table)
 /* ------------------------ Trampoline Initialization ----------------------*/
 
 /*
- * Initialize the static trampoline feature.
+ * Initialize the static trampoline feature. The status only changes once,
+ * from TRAMP_GLOBALS_UNINITIALIZED, so callers that see it set need not
+ * take the lock.
  */
 static int
 ffi_tramp_init (void)
@@ -394,6 +516,7 @@ ffi_tramp_init (void)
 
   tramp_globals.free_tables = NULL;
   tramp_globals.nfree_tables = 0;
+  tramp_globals.ntables = 0;
 
   /*
    * Get trampoline code table information from the architecture.
@@ -404,15 +527,21 @@ ffi_tramp_init (void)
 
   page_size = sysconf (_SC_PAGESIZE);
   if (page_size >= 0 && (size_t)page_size > tramp_globals.map_size)
-    return 0;
+    {
+      __atomic_store_n (&tramp_globals.status, TRAMP_GLOBALS_FAILED,
+			__ATOMIC_RELEASE);
+      return 0;
+    }
 
   if (ffi_tramp_init_os ())
     {
-      tramp_globals.status = TRAMP_GLOBALS_PASSED;
+      __atomic_store_n (&tramp_globals.status, TRAMP_GLOBALS_PASSED,
+			__ATOMIC_RELEASE);
       return 1;
     }
 
-  tramp_globals.status = TRAMP_GLOBALS_FAILED;
+  __atomic_store_n (&tramp_globals.status, TRAMP_GLOBALS_FAILED,
+		    __ATOMIC_RELEASE);
   return 0;
 }
 
@@ -422,6 +551,12 @@ ffi_tramp_init (void)
 
 static void tramp_add (struct tramp *tramp);
 
+/*
+ * Number of small tables after which new tables are large, if the
+ * architecture supports them.
+ */
+#define TRAMP_LARGE_AFTER	4
+
 /*
  * Allocate and initialize a trampoline table.
  */
@@ -430,7 +565,7 @@ tramp_table_alloc (void)
 {
   struct tramp_table *table;
   struct tramp *tramp_array, *tramp;
-  size_t size;
+  size_t size, block, offset;
   char *code, *parm;
   int i;
 
@@ -448,10 +583,27 @@ tramp_table_alloc (void)
   if (table == NULL)
     return 0;
 
+  table->large = (tramp_globals.ntables >= TRAMP_LARGE_AFTER
+		  && tramp_large_init ());
+
+retry:
+  if (table->large)
+    {
+      table->ntramp = tramp_globals.large_ntramp;
+      table->map_size = tramp_globals.large_map_size;
+      block = tramp_globals.large_template_size;
+    }
+  else
+    {
+      table->ntramp = tramp_globals.ntramp;
+      table->map_size = tramp_globals.map_size;
+      block = tramp_globals.map_size;
+    }
+
   /*
    * Allocate new trampoline structures.
    */
-  tramp_array = malloc (sizeof (*tramp) * tramp_globals.ntramp);
+  tramp_array = malloc (sizeof (*tramp) * table->ntramp);
   if (tramp_array == NULL)
     goto free_table;
 
@@ -461,8 +613,15 @@ tramp_table_alloc (void)
   if (!tramp_table_map (table))
     {
       /*
-       * Failed to map the code and parameter tables.
+       * Failed to map the code and parameter tables. Fall back to a small
+       * table if this was a large one.
        */
+      if (table->large)
+	{
+	  free (tramp_array);
+	  table->large = 0;
+	  goto retry;
+	}
       goto free_tramp_array;
     }
 
@@ -472,24 +631,31 @@ tramp_table_alloc (void)
   table->array = tramp_array;
   table->free = NULL;
   table->nfree = 0;
+  tramp_globals.ntables++;
+  tramp_globals.ntramp_total += table->ntramp;
+  tramp_globals.table_bytes += table->map_size * 2;
 
   /*
    * Populate the trampoline table free list. This will also add the trampoline
-   * table to the global list of trampoline tables.
+   * table to the global list of trampoline tables. A large table is made of
+   * blocks that each hold the trampolines of one copy of the template.
    */
   size = tramp_globals.size;
-  code = table->code_table;
-  parm = table->parm_table;
-  for (i = 0; i < tramp_globals.ntramp; i++)
+  offset = 0;
+  for (i = 0; i < table->ntramp; i++)
     {
+      if (offset % block + size > block)
+	offset = FFI_ALIGN (offset, block);
+      code = (char *) table->code_table + offset;
+      parm = (char *) table->parm_table + offset;
+
       tramp = &tramp_array[i];
       tramp->table = table;
       tramp->code = code;
       tramp->parm = (struct tramp_parm *) parm;
       tramp_add (tramp);
 
-      code += size;
-      parm += size;
+      offset += size;
     }
   /* Success */
   return 1;
@@ -508,6 +674,11 @@ free_table:
 static void
 tramp_table_free (struct tramp_table *table)
 {
+  tramp_globals.ntables--;
+  tramp_globals.ntramp_total -= table->ntramp;
+  tramp_globals.nfree_total -= table->nfree;
+  tramp_globals.table_bytes -= table->map_size * 2;
+  tramp_globals.empty_bytes -= table->map_size * 2;
   tramp_table_unmap (table);
   free (table->array);
   free (table);
@@ -542,6 +713,43 @@ tramp_table_del (struct tramp_table *table)
     tramp_globals.free_tables = table->next;
 }
 
+/*
+ * Tables whose trampolines are all free are kept for reuse until their
+ * mappings exceed TRAMP_RETAIN_HIGH bytes, and are then released down to
+ * TRAMP_RETAIN_LOW bytes, so that bursts of closures do not map and unmap
+ * a table each time.
+ */
+#define TRAMP_RETAIN_HIGH	((size_t) 8 << 20)
+#define TRAMP_RETAIN_LOW	((size_t) 64 << 10)
+
+/*
+ * Release tables whose trampolines are all free, keeping tables whose
+ * mappings fit in KEEP bytes. Return the number of bytes released.
+ */
+static size_t
+tramp_table_release (size_t keep)
+{
+  struct tramp_table *table, *next;
+  size_t kept = 0, released = 0, size;
+
+  for (table = tramp_globals.free_tables; table != NULL; table = next)
+    {
+      next = table->next;
+      if (table->nfree != table->ntramp)
+	continue;
+      size = table->map_size * 2;
+      if (kept + size <= keep)
+	{
+	  kept += size;
+	  continue;
+	}
+      tramp_table_del (table);
+      tramp_table_free (table);
+      released += size;
+    }
+  return released;
+}
+
 /* ------------------------- Trampoline functions ------------------------- */
 
 /*
@@ -558,6 +766,7 @@ tramp_add (struct tramp *tramp)
     table->free->prev = tramp;
   table->free = tramp;
   table->nfree++;
+  tramp_globals.nfree_total++;
 
   if (table->nfree == 1)
     tramp_table_add (table);
@@ -565,11 +774,11 @@ tramp_add (struct tramp *tramp)
   /*
    * We don't want to keep too many free trampoline tables lying around.
    */
-  if (table->nfree == tramp_globals.ntramp &&
-    tramp_globals.nfree_tables > 1)
+  if (table->nfree == table->ntramp)
     {
-      tramp_table_del (table);
-      tramp_table_free (table);
+      tramp_globals.empty_bytes += table->map_size * 2;
+      if (tramp_globals.empty_bytes > TRAMP_RETAIN_HIGH)
+	tramp_table_release (TRAMP_RETAIN_LOW);
     }
 }
 
@@ -581,7 +790,10 @@ tramp_del (struct tramp *tramp)
 {
   struct tramp_table *table = tramp->table;
 
+  if (table->nfree == table->ntramp)
+    tramp_globals.empty_bytes -= table->map_size * 2;
   table->nfree--;
+  tramp_globals.nfree_total--;
   if (tramp->prev != NULL)
     tramp->prev->next = tramp->next;
   if (tramp->next != NULL)
@@ -593,13 +805,122 @@ tramp_del (struct tramp *tramp)
     tramp_table_del (table);
 }
 
+/* ------------------------ Per-thread trampoline caches ------------------- */
+
+/*
+ * Each thread keeps a list of free trampolines, linked through their next
+ * fields, so that allocating and freeing a trampoline normally takes no
+ * lock. An empty cache takes TRAMP_CACHE_BATCH trampolines from the tables
+ * at once, and a cache that reaches TRAMP_CACHE_MAX returns half of them.
+ * A thread's cache is returned when the thread exits.
+ */
+#define TRAMP_CACHE_BATCH	16
+#define TRAMP_CACHE_MAX		64
+
+struct tramp_cache
+{
+  struct tramp *free;
+  int nfree;
+};
+
+#if defined (__linux__) || defined (__CYGWIN__)
+
+static pthread_key_t tramp_cache_key;
+static pthread_once_t tramp_cache_once = PTHREAD_ONCE_INIT;
+static int tramp_cache_usable;
+
+/*
+ * Return the first N trampolines of a cache list to their tables, and
+ * return the rest of the list.
+ */
+static struct tramp *
+tramp_cache_release (struct tramp *tramp, int n)
+{
+  struct tramp *next;
+
+  ffi_tramp_lock();
+  for (; n > 0; n--, tramp = next)
+    {
+      next = tramp->next;
+      tramp_add (tramp);
+    }
+  ffi_tramp_unlock();
+  return tramp;
+}
+
+static void
+tramp_cache_destroy (void *arg)
+{
+  struct tramp_cache *cache = arg;
+
+  tramp_cache_release (cache->free, cache->nfree);
+  free (cache);
+}
+
+static void
+tramp_cache_init (void)
+{
+  tramp_cache_usable
+    = pthread_key_create (&tramp_cache_key, tramp_cache_destroy) == 0;
+}
+
+static struct tramp_cache *
+tramp_cache_get (void)
+{
+  struct tramp_cache *cache;
+
+  pthread_once (&tramp_cache_once, tramp_cache_init);
+  if (!tramp_cache_usable)
+    return NULL;
+
+  cache = pthread_getspecific (tramp_cache_key);
+  if (cache == NULL)
+    {
+      cache = calloc (1, sizeof (*cache));
+      if (cache != NULL && pthread_setspecific (tramp_cache_key, cache) != 0)
+	{
+	  free (cache);
+	  cache = NULL;
+	}
+    }
+  return cache;
+}
+
+#endif /* defined (__linux__) || defined (__CYGWIN__) */
+
+/*
+ * Fill an empty cache from the trampoline tables.
+ */
+static int
+tramp_cache_refill (struct tramp_cache *cache)
+{
+  struct tramp *tramp;
+
+  ffi_tramp_lock();
+  while (cache->nfree < TRAMP_CACHE_BATCH && tramp_table_alloc ())
+    {
+      tramp = tramp_globals.free_tables->free;
+      tramp_del (tramp);
+      tramp->next = cache->free;
+      cache->free = tramp;
+      cache->nfree++;
+    }
+  ffi_tramp_unlock();
+  return cache->nfree > 0;
+}
+
 /* ------------------------ Trampoline API functions ------------------------ */
 
 int
 ffi_tramp_is_supported(void)
 {
+  enum tramp_globals_status status;
   int ret;
 
+  status = __atomic_load_n (&tramp_globals.status, __ATOMIC_ACQUIRE);
+  if (status != TRAMP_GLOBALS_UNINITIALIZED)
+    return status == TRAMP_GLOBALS_PASSED;
+
   ffi_tramp_lock();
   ret = ffi_tramp_init ();
   ffi_tramp_unlock();
@@ -612,16 +933,25 @@ ffi_tramp_is_supported(void)
 void *
 ffi_tramp_alloc (int flags)
 {
+  struct tramp_cache *cache;
   struct tramp *tramp;
 
-  ffi_tramp_lock();
+  if (!ffi_tramp_is_supported () || flags != 0)
+    return NULL;
 
-  if (!ffi_tramp_init () || flags != 0)
+  cache = tramp_cache_get ();
+  if (cache != NULL)
     {
-      ffi_tramp_unlock();
-      return NULL;
+      if (cache->nfree == 0 && !tramp_cache_refill (cache))
+	return NULL;
+      tramp = cache->free;
+      cache->free = tramp->next;
+      cache->nfree--;
+      return tramp;
     }
 
+  ffi_tramp_lock();
+
   if (!tramp_table_alloc ())
     {
       ffi_tramp_unlock();
@@ -637,33 +967,27 @@ ffi_tramp_alloc (int flags)
 }
 
 /*
- * Set the parameters for a trampoline.
+ * Set the parameters for a trampoline. The trampoline belongs to the
+ * caller, so no lock is needed.
  */
 void
 ffi_tramp_set_parms (void *arg, void *target, void *data)
 {
   struct tramp *tramp = arg;
 
-  ffi_tramp_lock();
   tramp->parm->target = target;
   tramp->parm->data = data;
-  ffi_tramp_unlock();
 }
 
 /*
- * Get the invocation address of a trampoline.
+ * Get the invocation address of a trampoline. This never changes.
  */
 void *
 ffi_tramp_get_addr (void *arg)
 {
   struct tramp *tramp = arg;
-  void *addr;
 
-  ffi_tramp_lock();
-  addr = tramp->code;
-  ffi_tramp_unlock();
-
-  return addr;
+  return tramp->code;
 }
 
 /*
@@ -672,13 +996,83 @@ ffi_tramp_get_addr (void *arg)
 void
 ffi_tramp_free (void *arg)
 {
+  struct tramp_cache *cache;
   struct tramp *tramp = arg;
 
+  cache = tramp_cache_get ();
+  if (cache != NULL)
+    {
+      tramp->next = cache->free;
+      cache->free = tramp;
+      if (++cache->nfree == TRAMP_CACHE_MAX)
+	{
+	  cache->free = tramp_cache_release (cache->free, TRAMP_CACHE_MAX / 2);
+	  cache->nfree -= TRAMP_CACHE_MAX / 2;
+	}
+      return;
+    }
+
   ffi_tramp_lock();
   tramp_add (tramp);
   ffi_tramp_unlock();
 }
 
+/*
+ * Release trampoline tables whose trampolines are all free, keeping tables
+ * whose mappings fit in KEEP bytes. The calling thread's cached trampolines
+ * are returned to their tables first. Return the number of bytes released.
+ */
+size_t
+ffi_tramp_trim (size_t keep)
+{
+  struct tramp_cache *cache;
+  size_t before, after;
+
+  if (__atomic_load_n (&tramp_globals.status, __ATOMIC_ACQUIRE)
+      != TRAMP_GLOBALS_PASSED)
+    return 0;
+
+  ffi_tramp_lock();
+  before = tramp_globals.table_bytes;
+  ffi_tramp_unlock();
+
+  /*
+   * Returning the cached trampolines may itself release tables.
+   */
+  cache = tramp_cache_get ();
+  if (cache != NULL && cache->nfree > 0)
+    {
+      tramp_cache_release (cache->free, cache->nfree);
+      cache->free = NULL;
+      cache->nfree = 0;
+    }
+
+  ffi_tramp_lock();
+  tramp_table_release (keep);
+  after = tramp_globals.table_bytes;
+  ffi_tramp_unlock();
+  return before > after ? before - after : 0;
+}
+
+/*
+ * Report the number of trampoline tables, and the numbers of free and used
+ * trampolines in them. Trampolines held in per-thread caches count as used.
+ */
+void
+ffi_tramp_get_stats (size_t *tables, size_t *nfree, size_t *nused)
+{
+  *tables = *nfree = *nused = 0;
+  if (__atomic_load_n (&tramp_globals.status, __ATOMIC_ACQUIRE)
+      != TRAMP_GLOBALS_PASSED)
+    return;
+
+  ffi_tramp_lock();
+  *tables = tramp_globals.ntables;
+  *nfree = tramp_globals.nfree_total;
+  *nused = tramp_globals.ntramp_total - tramp_globals.nfree_total;
+  ffi_tramp_unlock();
+}
+
 /* ------------------------------------------------------------------------- */
 
 #else /* !FFI_EXEC_STATIC_TRAMP */
@@ -713,4 +1107,16 @@ ffi_tramp_free (void *arg)
 {
 }
 
+size_t
+ffi_tramp_trim (size_t keep)
+{
+  return 0;
+}
+
+void
+ffi_tramp_get_stats (size_t *tables, size_t *nfree, size_t *nused)
+{
+  *tables = *nfree = *nused = 0;
+}
+
 #endif /* FFI_EXEC_STATIC_TRAMP */
@@ -27,6 +27,7 @@
 #include <ffi.h>
 #include <ffi_common.h>
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -114,7 +115,7 @@ _Static_assert(FFI_OK_MACRO == FFI_OK, "FFI_OK must be 0");
 #define FFI_BAD_TYPEDEF_MACRO 1
 _Static_assert(FFI_BAD_TYPEDEF_MACRO == FFI_BAD_TYPEDEF, "FFI_BAD_TYPEDEF must be 1");
 
-EM_JS_DEPS(libffi, "$getWasmTableEntry,$setWasmTableEntry,$getEmptyTableSlot,$convertJsFunctionToWasm");
+EM_JS_DEPS(libffi, "$getWasmTableEntry,$setWasmTableEntry,$getEmptyTableSlot");
 
 /**
  * A Javascript helper function. This takes an argument typ which is a wasm
@@ -162,24 +163,26 @@ unbox_small_structs, (ffi_type type_ptr), {
   return [type_ptr, type_id];
 })
 
+/**
+ * Builds the Javascript function that performs ffi_call for the given cif.
+ *
+ * All type decoding happens here, once per cif: every argument gets a small
+ * step function that reads it from the heap and pushes it in the form the
+ * Javascript wrapper for the wasm function expects. The returned function
+ * takes (fn, rvalue, avalue) and just runs the steps.
+ */
 EM_JS_MACROS(
 void,
-ffi_call_js, (ffi_cif *cif, ffi_fp fn, void *rvalue, void **avalue),
+ffi_call_marshaller_js, (ffi_cif *cif),
 {
-  var abi = CIF__ABI(cif);
   var nargs = CIF__NARGS(cif);
   var nfixedargs = CIF__NFIXEDARGS(cif);
   var arg_types_ptr = CIF__ARGTYPES(cif);
   var rtype_unboxed = unbox_small_structs(CIF__RTYPE(cif));
-  var rtype_ptr = rtype_unboxed[0];
   var rtype_id = rtype_unboxed[1];
-  var orig_stack_ptr = stackSave();
-  var cur_stack_ptr = orig_stack_ptr;
-
-  var args = [];
-  // Does our onwards call return by argument or normally? We return by argument
-  // no matter what.
-  var ret_by_arg = false;
+  // Stack pointer while the arguments of a call are marshalled. Shared by the
+  // steps below; a call never re-enters before its onward call starts.
+  var cur_stack_ptr;
 
   if (rtype_id === FFI_TYPE_COMPLEX) {
     throw new Error('complex ret marshalling nyi');
@@ -192,21 +195,36 @@ ffi_call_js, (ffi_cif *cif, ffi_fp fn, void *rvalue, void **avalue),
   // Conveniently, we've already received a pointer to return value, so we can
   // just use this. We also mark a flag that we don't need to convert the return
   // value of the dynamic call back to C.
-  if (rtype_id === FFI_TYPE_LONGDOUBLE || rtype_id === FFI_TYPE_STRUCT) {
-    args.push(rvalue);
-    ret_by_arg = true;
-  }
+  var ret_by_arg = rtype_id === FFI_TYPE_LONGDOUBLE || rtype_id === FFI_TYPE_STRUCT;
 
-  // Accumulate a Javascript list of arguments for the Javascript wrapper for
-  // the wasm function. The Javascript wrapper does a type conversion from
-  // Javascript to C automatically, here we manually do the inverse conversion
-  // from C to Javascript.
+  // Steps that push a fixed argument onto the Javascript list of arguments for
+  // the Javascript wrapper for the wasm function. The Javascript wrapper does a
+  // type conversion from Javascript to C automatically, here we manually do the
+  // inverse conversion from C to Javascript.
+  var fixed_steps = [];
   for (var i = 0; i < nfixedargs; i++) {
-    var arg_ptr = DEREF_U32(avalue, i);
     var arg_unboxed = unbox_small_structs(DEREF_U32(arg_types_ptr, i));
-    var arg_type_ptr = arg_unboxed[0];
-    var arg_type_id = arg_unboxed[1];
+    fixed_steps.push(fixed_arg_step(arg_unboxed[0], arg_unboxed[1]));
+  }
+
+  // Wasm functions can't directly manipulate the callstack, so varargs
+  // arguments have to go on a separate stack. A varags function takes one extra
+  // argument which is a pointer to where on the separate stack the args are
+  // located. Because stacks are allocated backwards, we have to loop over the
+  // varargs backwards.
+  //
+  // We don't have any way of knowing how many args were actually passed, so we
+  // just always copy extra nonsense past the end. The ownwards call will know
+  // not to look at it.
+  var var_steps = [];
+  for (var i = nargs - 1; i >= nfixedargs; i--) {
+    var arg_unboxed = unbox_small_structs(DEREF_U32(arg_types_ptr, i));
+    var_steps.push(var_arg_step(arg_unboxed[0], arg_unboxed[1]));
+  }
 
+  var store_result = result_step(rtype_id);
+
+  function fixed_arg_step(arg_type_ptr, arg_type_id) {
     // It's okay here to always use unsigned integers as long as the size is 32
     // or 64 bits. Smaller sizes get extended to 32 bits differently according
     // to whether they are signed or unsigned.
@@ -215,45 +233,39 @@ ffi_call_js, (ffi_cif *cif, ffi_fp fn, void *rvalue, void **avalue),
     case FFI_TYPE_SINT32:
     case FFI_TYPE_UINT32:
     case FFI_TYPE_POINTER:
-      args.push(DEREF_U32(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_U32(arg_ptr, 0)); };
     case FFI_TYPE_FLOAT:
-      args.push(DEREF_F32(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_F32(arg_ptr, 0)); };
     case FFI_TYPE_DOUBLE:
-      args.push(DEREF_F64(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_F64(arg_ptr, 0)); };
     case FFI_TYPE_UINT8:
-      args.push(DEREF_U8(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_U8(arg_ptr, 0)); };
     case FFI_TYPE_SINT8:
-      args.push(DEREF_S8(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_S8(arg_ptr, 0)); };
     case FFI_TYPE_UINT16:
-      args.push(DEREF_U16(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_U16(arg_ptr, 0)); };
     case FFI_TYPE_SINT16:
-      args.push(DEREF_S16(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_S16(arg_ptr, 0)); };
     case FFI_TYPE_UINT64:
     case FFI_TYPE_SINT64:
-      args.push(DEREF_U64(arg_ptr, 0));
-      break;
+      return function (args, arg_ptr) { args.push(DEREF_U64(arg_ptr, 0)); };
     case FFI_TYPE_LONGDOUBLE:
       // long double is passed as a pair of BigInts.
-      args.push(DEREF_U64(arg_ptr, 0));
-      args.push(DEREF_U64(arg_ptr, 1));
-      break;
+      return function (args, arg_ptr) {
+        args.push(DEREF_U64(arg_ptr, 0));
+        args.push(DEREF_U64(arg_ptr, 1));
+      };
     case FFI_TYPE_STRUCT:
       // Nontrivial structs are passed by pointer.
       // Have to copy the struct onto the stack though because C ABI says it's
       // call by value.
       var size = FFI_TYPE__SIZE(arg_type_ptr);
       var align = FFI_TYPE__ALIGN(arg_type_ptr);
-      STACK_ALLOC(cur_stack_ptr, size, align);
-      HEAP8.subarray(cur_stack_ptr, cur_stack_ptr+size).set(HEAP8.subarray(arg_ptr, arg_ptr + size));
-      args.push(cur_stack_ptr);
-      break;
+      return function (args, arg_ptr) {
+        STACK_ALLOC(cur_stack_ptr, size, align);
+        HEAP8.subarray(cur_stack_ptr, cur_stack_ptr+size).set(HEAP8.subarray(arg_ptr, arg_ptr + size));
+        args.push(cur_stack_ptr);
+      };
     case FFI_TYPE_COMPLEX:
       throw new Error('complex marshalling nyi');
     default:
@@ -261,147 +273,283 @@ ffi_call_js, (ffi_cif *cif, ffi_fp fn, void *rvalue, void **avalue),
     }
   }
 
-  // Wasm functions can't directly manipulate the callstack, so varargs
-  // arguments have to go on a separate stack. A varags function takes one extra
-  // argument which is a pointer to where on the separate stack the args are
-  // located. Because stacks are allocated backwards, we have to loop over the
-  // varargs backwards.
-  //
-  // We don't have any way of knowing how many args were actually passed, so we
-  // just always copy extra nonsense past the end. The ownwards call will know
-  // not to look at it.
-  if (nfixedargs != nargs) {
-    var struct_arg_info = [];
-    for (var i = nargs - 1;  i >= nfixedargs; i--) {
-      var arg_ptr = DEREF_U32(avalue, i);
-      var arg_unboxed = unbox_small_structs(DEREF_U32(arg_types_ptr, i));
-      var arg_type_ptr = arg_unboxed[0];
-      var arg_type_id = arg_unboxed[1];
-      switch (arg_type_id) {
-      case FFI_TYPE_UINT8:
-      case FFI_TYPE_SINT8:
+  function var_arg_step(arg_type_ptr, arg_type_id) {
+    switch (arg_type_id) {
+    case FFI_TYPE_UINT8:
+    case FFI_TYPE_SINT8:
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 1, 1);
         DEREF_U8(cur_stack_ptr, 0) = DEREF_U8(arg_ptr, 0);
-        break;
-      case FFI_TYPE_UINT16:
-      case FFI_TYPE_SINT16:
+      };
+    case FFI_TYPE_UINT16:
+    case FFI_TYPE_SINT16:
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 2, 2);
         DEREF_U16(cur_stack_ptr, 0) = DEREF_U16(arg_ptr, 0);
-        break;
-      case FFI_TYPE_INT:
-      case FFI_TYPE_UINT32:
-      case FFI_TYPE_SINT32:
-      case FFI_TYPE_POINTER:
-      case FFI_TYPE_FLOAT:
+      };
+    case FFI_TYPE_INT:
+    case FFI_TYPE_UINT32:
+    case FFI_TYPE_SINT32:
+    case FFI_TYPE_POINTER:
+    case FFI_TYPE_FLOAT:
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 4, 4);
         DEREF_U32(cur_stack_ptr, 0) = DEREF_U32(arg_ptr, 0);
-        break;
-      case FFI_TYPE_DOUBLE:
-      case FFI_TYPE_UINT64:
-      case FFI_TYPE_SINT64:
+      };
+    case FFI_TYPE_DOUBLE:
+    case FFI_TYPE_UINT64:
+    case FFI_TYPE_SINT64:
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 8, 8);
         DEREF_U32(cur_stack_ptr, 0) = DEREF_U32(arg_ptr, 0);
         DEREF_U32(cur_stack_ptr, 1) = DEREF_U32(arg_ptr, 1);
-        break;
-      case FFI_TYPE_LONGDOUBLE:
+      };
+    case FFI_TYPE_LONGDOUBLE:
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 16, 8);
         DEREF_U32(cur_stack_ptr, 0) = DEREF_U32(arg_ptr, 0);
         DEREF_U32(cur_stack_ptr, 1) = DEREF_U32(arg_ptr, 1);
         DEREF_U32(cur_stack_ptr, 2) = DEREF_U32(arg_ptr, 2);
         DEREF_U32(cur_stack_ptr, 3) = DEREF_U32(arg_ptr, 3);
-        break;
-      case FFI_TYPE_STRUCT:
-        // Again, struct must be passed by pointer.
-        // But ABI is by value, so have to copy struct onto stack.
-        // Currently arguments are going onto stack so we can't put it there now. Come back for this.
+      };
+    case FFI_TYPE_STRUCT:
+      // Again, struct must be passed by pointer.
+      // But ABI is by value, so have to copy struct onto stack.
+      // Currently arguments are going onto stack so we can't put it there now. Come back for this.
+      var size = FFI_TYPE__SIZE(arg_type_ptr);
+      var align = FFI_TYPE__ALIGN(arg_type_ptr);
+      return function (arg_ptr, struct_arg_info) {
         STACK_ALLOC(cur_stack_ptr, 4, 4);
-        struct_arg_info.push([cur_stack_ptr, arg_ptr, FFI_TYPE__SIZE(arg_type_ptr), FFI_TYPE__ALIGN(arg_type_ptr)]);
-        break;
-      case FFI_TYPE_COMPLEX:
-        throw new Error('complex arg marshalling nyi');
-      default:
-        throw new Error('Unexpected argtype ' + arg_type_id);
+        struct_arg_info.push([cur_stack_ptr, arg_ptr, size, align]);
+      };
+    case FFI_TYPE_COMPLEX:
+      throw new Error('complex arg marshalling nyi');
+    default:
+      throw new Error('Unexpected argtype ' + arg_type_id);
+    }
+  }
+
+  // The result is automatically converted from C into Javascript and we need
+  // to manually convert it back to C, unless the onward call already put the
+  // return value in rvalue.
+  function result_step(rtype_id) {
+    if (ret_by_arg) {
+      return null;
+    }
+    switch (rtype_id) {
+    case FFI_TYPE_VOID:
+      return null;
+    case FFI_TYPE_INT:
+    case FFI_TYPE_UINT32:
+    case FFI_TYPE_SINT32:
+    case FFI_TYPE_POINTER:
+      return function (rvalue, result) { DEREF_U32(rvalue, 0) = result; };
+    case FFI_TYPE_FLOAT:
+      return function (rvalue, result) { DEREF_F32(rvalue, 0) = result; };
+    case FFI_TYPE_DOUBLE:
+      return function (rvalue, result) { DEREF_F64(rvalue, 0) = result; };
+    case FFI_TYPE_UINT8:
+    case FFI_TYPE_SINT8:
+      return function (rvalue, result) { DEREF_U8(rvalue, 0) = result; };
+    case FFI_TYPE_UINT16:
+    case FFI_TYPE_SINT16:
+      return function (rvalue, result) { DEREF_U16(rvalue, 0) = result; };
+    case FFI_TYPE_UINT64:
+    case FFI_TYPE_SINT64:
+      return function (rvalue, result) { DEREF_U64(rvalue, 0) = result; };
+    default:
+      throw new Error('Unexpected rtype ' + rtype_id);
+    }
+  }
+
+  return function (fn, rvalue, avalue) {
+    var orig_stack_ptr = stackSave();
+    cur_stack_ptr = orig_stack_ptr;
+
+    var args = [];
+    if (ret_by_arg) {
+      args.push(rvalue);
+    }
+    for (var i = 0; i < nfixedargs; i++) {
+      fixed_steps[i](args, DEREF_U32(avalue, i));
+    }
+    if (nfixedargs != nargs) {
+      var struct_arg_info = [];
+      for (var i = nargs - 1; i >= nfixedargs; i--) {
+        var_steps[nargs - 1 - i](DEREF_U32(avalue, i), struct_arg_info);
       }
+      // extra normal argument which is the pointer to the varargs.
+      args.push(cur_stack_ptr);
+      // Now allocate variable struct args on stack too.
+      for (var i = 0; i < struct_arg_info.length; i++) {
+        var struct_info = struct_arg_info[i];
+        var arg_target = struct_info[0];
+        var arg_ptr = struct_info[1];
+        var size = struct_info[2];
+        var align = struct_info[3];
+        STACK_ALLOC(cur_stack_ptr, size, align);
+        HEAP8.subarray(cur_stack_ptr, cur_stack_ptr+size).set(HEAP8.subarray(arg_ptr, arg_ptr + size));
+        DEREF_U32(arg_target, 0) = cur_stack_ptr;
+      }
+    }
+    stackRestore(cur_stack_ptr);
+    stackAlloc(0); // stackAlloc enforces alignment invariants on the stack pointer
+    LOG_DEBUG("CALL_FUNC_PTR", "fn:", fn, "args:", args);
+    var result = getWasmTableEntry(fn).apply(null, args);
+    // Put the stack pointer back (we moved it if there were any struct args or we
+    // made a varargs call)
+    stackRestore(orig_stack_ptr);
+
+    if (store_result) {
+      store_result(rvalue, result);
     }
-    // extra normal argument which is the pointer to the varargs.
-    args.push(cur_stack_ptr);
-    // Now allocate variable struct args on stack too.
-    for (var i = 0; i < struct_arg_info.length; i++) {
-      var struct_info = struct_arg_info[i];
-      var arg_target = struct_info[0];
-      var arg_ptr = struct_info[1];
-      var size = struct_info[2];
-      var align = struct_info[3];
-      STACK_ALLOC(cur_stack_ptr, size, align);
-      HEAP8.subarray(cur_stack_ptr, cur_stack_ptr+size).set(HEAP8.subarray(arg_ptr, arg_ptr + size));
-      DEREF_U32(arg_target, 0) = cur_stack_ptr;
+  };
+})
+
+/**
+ * Returns the id of the marshaller for the signature of the given cif. The
+ * key holds everything ffi_call_marshaller_js reads from the cif, so cifs
+ * with the same signature share an id, and a copy of a cif stays valid. The
+ * marshaller itself is built by the first call.
+ */
+EM_JS_MACROS(
+unsigned,
+ffi_call_marshaller_id_js, (ffi_cif *cif),
+{
+  var nargs = CIF__NARGS(cif);
+  var arg_types_ptr = CIF__ARGTYPES(cif);
+  var key = nargs + ':' + CIF__NFIXEDARGS(cif) + ':' +
+    unbox_small_structs(CIF__RTYPE(cif))[1];
+  for (var i = 0; i < nargs; i++) {
+    var arg_unboxed = unbox_small_structs(DEREF_U32(arg_types_ptr, i));
+    key += ',' + arg_unboxed[1];
+    if (arg_unboxed[1] === FFI_TYPE_STRUCT) {
+      key += '/' + FFI_TYPE__SIZE(arg_unboxed[0]) + '/' +
+        FFI_TYPE__ALIGN(arg_unboxed[0]);
     }
   }
-  stackRestore(cur_stack_ptr);
-  stackAlloc(0); // stackAlloc enforces alignment invariants on the stack pointer
-  LOG_DEBUG("CALL_FUNC_PTR", "fn:", fn, "args:", args);
-  var result = getWasmTableEntry(fn).apply(null, args);
-  // Put the stack pointer back (we moved it if there were any struct args or we
-  // made a varargs call)
-  stackRestore(orig_stack_ptr);
-
-  // We need to return by argument. If return value was a nontrivial struct or
-  // long double, the onwards call already put the return value in rvalue
-  if (ret_by_arg) {
-    return;
+
+  var ids = Module['libffi_call_marshaller_ids'];
+  if (!ids) {
+    ids = Module['libffi_call_marshaller_ids'] = new Map();
+    Module['libffi_call_marshallers'] = [];
+  }
+  var id = ids.get(key);
+  if (id === undefined) {
+    id = Module['libffi_call_marshallers'].length;
+    Module['libffi_call_marshallers'].push(null);
+    ids.set(key, id);
   }
+  return id;
+});
 
-  // Otherwise the result was automatically converted from C into Javascript and
-  // we need to manually convert it back to C.
-  switch (rtype_id) {
-  case FFI_TYPE_VOID:
-    break;
-  case FFI_TYPE_INT:
-  case FFI_TYPE_UINT32:
-  case FFI_TYPE_SINT32:
-  case FFI_TYPE_POINTER:
-    DEREF_U32(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_FLOAT:
-    DEREF_F32(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_DOUBLE:
-    DEREF_F64(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_UINT8:
-  case FFI_TYPE_SINT8:
-    DEREF_U8(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_UINT16:
-  case FFI_TYPE_SINT16:
-    DEREF_U16(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_UINT64:
-  case FFI_TYPE_SINT64:
-    DEREF_U64(rvalue, 0) = result;
-    break;
-  case FFI_TYPE_COMPLEX:
-    throw new Error('complex ret marshalling nyi');
-  default:
-    throw new Error('Unexpected rtype ' + rtype_id);
+EM_JS_MACROS(
+void,
+ffi_call_js, (ffi_cif *cif, unsigned id, ffi_fp fn, void *rvalue, void **avalue),
+{
+  var marshallers = Module['libffi_call_marshallers'];
+  var marshaller = marshallers[id];
+  if (!marshaller) {
+    marshaller = marshallers[id] = ffi_call_marshaller_js(cif);
   }
+  marshaller(fn, rvalue, avalue);
 });
 
-EM_JS_MACROS(void *, ffi_closure_alloc_js, (size_t size, void **code), {
-  var closure = _malloc(size);
-  var index = getEmptyTableSlot();
-  DEREF_U32(code, 0) = index;
-  CLOSURE__wrapper(closure) = index;
-  return closure;
+// Reserves count consecutive new function table slots and returns the first.
+EM_JS_MACROS(void *, ffi_closure_reserve_slots_js, (size_t count), {
+  return wasmTable.grow(count);
+})
+
+// Reserves a single function table slot, reusing a freed one if possible.
+EM_JS_MACROS(void *, ffi_closure_slot_js, (void), {
+  return getEmptyTableSlot();
+})
+
+// Drops the wrapper of a freed closure from its table slot, so that it can be
+// garbage collected and a call through a stale pointer traps.
+EM_JS_MACROS(void, ffi_closure_clear_slot_js, (void *index), {
+  setWasmTableEntry(index, null);
 })
 
-EM_JS_MACROS(void, ffi_closure_free_js, (void *closure), {
-  var index = CLOSURE__wrapper(closure);
+// Clears a table slot and returns it to the slots getEmptyTableSlot reuses.
+EM_JS_MACROS(void, ffi_closure_release_slot_js, (void *index), {
+  setWasmTableEntry(index, null);
   freeTableIndexes.push(index);
-  _free(closure);
 })
 
 
+/**
+ * Wraps the Javascript function func into a wasm function of signature sig,
+ * like convertJsFunctionToWasm. The wasm module that does the wrapping only
+ * depends on the signature, so it is compiled once per signature and then
+ * just instantiated with each new func.
+ */
+EM_JS_MACROS(
+void,
+ffi_closure_wrapper_js, (const char *sig, void *func),
+{
+  var modules = Module['libffi_closure_modules'];
+  if (!modules) {
+    modules = Module['libffi_closure_modules'] = new Map();
+  }
+  var module = modules.get(sig);
+  if (!module) {
+    var type_codes = { 'i': 0x7f, 'j': 0x7e, 'f': 0x7d, 'd': 0x7c };
+    var uleb = function (bytes, n) {
+      do {
+        var b = n & 0x7f;
+        n >>>= 7;
+        bytes.push(n ? b | 0x80 : b);
+      } while (n);
+    };
+    var section = function (bytes, id, contents) {
+      bytes.push(id);
+      uleb(bytes, contents.length);
+      bytes.push.apply(bytes, contents);
+    };
+    var nparams = sig.length - 1;
+
+    // (type (func (param ...) (result ...)))
+    var type = [0x01, 0x60];
+    uleb(type, nparams);
+    for (var i = 1; i < sig.length; i++) {
+      var code = type_codes[sig[i]];
+      if (code === undefined) {
+        throw new Error('Unexpected signature ' + sig);
+      }
+      type.push(code);
+    }
+    if (sig[0] === 'v') {
+      type.push(0x00);
+    } else {
+      type.push(0x01, type_codes[sig[0]]);
+    }
+    // local.get of every parameter, then call the imported function
+    var body = [0x00];
+    for (var i = 0; i < nparams; i++) {
+      body.push(0x20);
+      uleb(body, i);
+    }
+    body.push(0x10, 0x00, 0x0b);
+    var code_section = [0x01];
+    uleb(code_section, body.length);
+    code_section.push.apply(code_section, body);
+
+    var bytes = [0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00];
+    section(bytes, 1, type);
+    // (import "e" "f" (func (type 0)))
+    section(bytes, 2, [0x01, 0x01, 0x65, 0x01, 0x66, 0x00, 0x00]);
+    // (func (type 0))
+    section(bytes, 3, [0x01, 0x00]);
+    // (export "f" (func 1))
+    section(bytes, 7, [0x01, 0x01, 0x66, 0x00, 0x01]);
+    section(bytes, 10, code_section);
+    module = new WebAssembly.Module(new Uint8Array(bytes));
+    modules.set(sig, module);
+  }
+  return new WebAssembly.Instance(module, { 'e': { 'f': func } }).exports['f'];
+})
+
 EM_JS_MACROS(
 ffi_status,
 ffi_prep_closure_loc_js,
@@ -500,144 +648,184 @@ ffi_prep_closure_loc_js,
     sig += 'i';
   }
   LOG_DEBUG("CREATE_CLOSURE", "sig:", sig);
-  function trampoline() {
-    var args = Array.prototype.slice.call(arguments);
-    var size = 0;
-    var orig_stack_ptr = stackSave();
-    var cur_ptr = orig_stack_ptr;
-    var ret_ptr;
-    var jsarg_idx = 0;
-    // Should we return by argument or not? The onwards call returns by argument
-    // no matter what. (Warning: ret_by_arg means the opposite in ffi_call)
-    if (ret_by_arg) {
-      ret_ptr = args[jsarg_idx++];
-    } else {
-      // We might return 4 bytes or 8 bytes, allocate 8 just in case.
-      STACK_ALLOC(cur_ptr, 8, 8);
-      ret_ptr = cur_ptr;
-    }
-    cur_ptr -= 4 * nargs;
-    var args_ptr = cur_ptr;
-    var carg_idx = 0;
-    // Here we either have the actual argument, or a pair of BigInts for long
-    // double, or a pointer to struct. We have to store into args_ptr[i] a
-    // pointer to the ith argument. If the argument is a struct, just store the
-    // pointer. Otherwise allocate stack space and copy the js argument onto the
-    // stack.
-    for (; carg_idx < nfixedargs; carg_idx++) {
-      // jsarg_idx might start out as 0 or 1 depending on ret_by_arg
-      // it advances an extra time for long double
-      var cur_arg = args[jsarg_idx++];
-      var arg_type_info = unboxed_arg_type_info_list[carg_idx];
-      var arg_size = arg_type_info[0];
-      var arg_align = arg_type_info[1];
-      var arg_type_id = unboxed_arg_type_id_list[carg_idx];
-      switch (arg_type_id) {
-      case FFI_TYPE_UINT8:
-      case FFI_TYPE_SINT8:
+
+  // Steps that store a fixed argument on the stack and a pointer to it into
+  // args_ptr[carg_idx]. They take the js arguments and the index of the
+  // argument's first js argument, and return the index of the next one.
+  var cur_ptr; // stack pointer while the arguments are stored
+  var args_ptr;
+  var fixed_steps = [];
+  for (var i = 0; i < nfixedargs; i++) {
+    fixed_steps.push(closure_arg_step(i, unboxed_arg_type_id_list[i],
+                                      unboxed_arg_type_info_list[i]));
+  }
+
+  function closure_arg_step(carg_idx, arg_type_id, arg_type_info) {
+    var arg_size = arg_type_info[0];
+    var arg_align = arg_type_info[1];
+    switch (arg_type_id) {
+    case FFI_TYPE_UINT8:
+    case FFI_TYPE_SINT8:
+      return function (args, jsarg_idx) {
         // Bad things happen if we don't align to 4 here
         STACK_ALLOC(cur_ptr, 1, 4);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_U8(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_UINT16:
-      case FFI_TYPE_SINT16:
+        DEREF_U8(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_UINT16:
+    case FFI_TYPE_SINT16:
+      return function (args, jsarg_idx) {
         // Bad things happen if we don't align to 4 here
         STACK_ALLOC(cur_ptr, 2, 4);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_U16(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_INT:
-      case FFI_TYPE_UINT32:
-      case FFI_TYPE_SINT32:
-      case FFI_TYPE_POINTER:
+        DEREF_U16(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_INT:
+    case FFI_TYPE_UINT32:
+    case FFI_TYPE_SINT32:
+    case FFI_TYPE_POINTER:
+      return function (args, jsarg_idx) {
         STACK_ALLOC(cur_ptr, 4, 4);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_U32(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_STRUCT:
-        // cur_arg is already a pointer to struct
-        // copy it onto stack to pass by value
+        DEREF_U32(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_STRUCT:
+      // the js argument is already a pointer to struct
+      // copy it onto stack to pass by value
+      return function (args, jsarg_idx) {
+        var cur_arg = args[jsarg_idx];
         STACK_ALLOC(cur_ptr, arg_size, arg_align);
         HEAP8.subarray(cur_ptr, cur_ptr + arg_size).set(HEAP8.subarray(cur_arg, cur_arg + arg_size));
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        break;
-      case FFI_TYPE_FLOAT:
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_FLOAT:
+      return function (args, jsarg_idx) {
         STACK_ALLOC(cur_ptr, 4, 4);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_F32(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_DOUBLE:
+        DEREF_F32(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_DOUBLE:
+      return function (args, jsarg_idx) {
         STACK_ALLOC(cur_ptr, 8, 8);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_F64(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_UINT64:
-      case FFI_TYPE_SINT64:
+        DEREF_F64(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_UINT64:
+    case FFI_TYPE_SINT64:
+      return function (args, jsarg_idx) {
         STACK_ALLOC(cur_ptr, 8, 8);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_U64(cur_ptr, 0) = cur_arg;
-        break;
-      case FFI_TYPE_LONGDOUBLE:
+        DEREF_U64(cur_ptr, 0) = args[jsarg_idx];
+        return jsarg_idx + 1;
+      };
+    case FFI_TYPE_LONGDOUBLE:
+      // long double arrives as a pair of BigInts
+      return function (args, jsarg_idx) {
         STACK_ALLOC(cur_ptr, 16, 8);
         DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-        DEREF_U64(cur_ptr, 0) = cur_arg;
-        cur_arg = args[jsarg_idx++];
-        DEREF_U64(cur_ptr, 1) = cur_arg;
-        break;
-      }
+        DEREF_U64(cur_ptr, 0) = args[jsarg_idx];
+        DEREF_U64(cur_ptr, 1) = args[jsarg_idx + 1];
+        return jsarg_idx + 2;
+      };
+    default:
+      return function (args, jsarg_idx) {
+        return jsarg_idx + 1;
+      };
     }
-    // If its a varargs call, last js argument is a pointer to the varargs.
-    var varargs = args[args.length - 1];
-    // We have no way of knowing how many varargs were actually provided, this
-    // fills the rest of the stack space allocated with nonsense. The onward
-    // call will know to ignore the nonsense.
-
-    // We either have a pointer to the argument if the argument is not a struct
-    // or a pointer to pointer to struct. We need to store a pointer to the
-    // argument into args_ptr[i]
-    for (; carg_idx < nargs; carg_idx++) {
-      var arg_type_id = unboxed_arg_type_id_list[carg_idx];
-      var arg_type_info = unboxed_arg_type_info_list[carg_idx];
-      var arg_size = arg_type_info[0];
-      var arg_align = arg_type_info[1];
-      if (arg_type_id === FFI_TYPE_STRUCT) {
-        // In this case varargs is a pointer to pointer to struct so we need to
-        // deref once
-        var struct_ptr = DEREF_U32(varargs, 0);
-        STACK_ALLOC(cur_ptr, arg_size, arg_align);
-        HEAP8.subarray(cur_ptr, cur_ptr + arg_size).set(HEAP8.subarray(struct_ptr, struct_ptr + arg_size));
-        DEREF_U32(args_ptr, carg_idx) = cur_ptr;
-      } else {
-        DEREF_U32(args_ptr, carg_idx) = varargs;
+  }
+
+  // The value returned to the caller, unless we return by argument.
+  var load_result = null;
+  if (!ret_by_arg) {
+    switch (sig[0]) {
+    case 'i':
+      load_result = function (ret_ptr) { return DEREF_U32(ret_ptr, 0); };
+      break;
+    case 'j':
+      load_result = function (ret_ptr) { return DEREF_U64(ret_ptr, 0); };
+      break;
+    case 'd':
+      load_result = function (ret_ptr) { return DEREF_F64(ret_ptr, 0); };
+      break;
+    case 'f':
+      load_result = function (ret_ptr) { return DEREF_F32(ret_ptr, 0); };
+      break;
+    }
+  }
+
+  function trampoline() {
+    var orig_stack_ptr = stackSave();
+    var ret_ptr;
+    var jsarg_idx = 0;
+    cur_ptr = orig_stack_ptr;
+    // Should we return by argument or not? The onwards call returns by argument
+    // no matter what. (Warning: ret_by_arg means the opposite in ffi_call)
+    if (ret_by_arg) {
+      ret_ptr = arguments[jsarg_idx++];
+    } else {
+      // We might return 4 bytes or 8 bytes, allocate 8 just in case.
+      STACK_ALLOC(cur_ptr, 8, 8);
+      ret_ptr = cur_ptr;
+    }
+    cur_ptr -= 4 * nargs;
+    args_ptr = cur_ptr;
+    // Here we either have the actual argument, or a pair of BigInts for long
+    // double, or a pointer to struct. We have to store into args_ptr[i] a
+    // pointer to the ith argument.
+    for (var carg_idx = 0; carg_idx < nfixedargs; carg_idx++) {
+      jsarg_idx = fixed_steps[carg_idx](arguments, jsarg_idx);
+    }
+    if (nfixedargs < nargs) {
+      // If its a varargs call, last js argument is a pointer to the varargs.
+      var varargs = arguments[arguments.length - 1];
+      // We have no way of knowing how many varargs were actually provided, this
+      // fills the rest of the stack space allocated with nonsense. The onward
+      // call will know to ignore the nonsense.
+
+      // We either have a pointer to the argument if the argument is not a struct
+      // or a pointer to pointer to struct. We need to store a pointer to the
+      // argument into args_ptr[i]
+      for (var carg_idx = nfixedargs; carg_idx < nargs; carg_idx++) {
+        if (unboxed_arg_type_id_list[carg_idx] === FFI_TYPE_STRUCT) {
+          var arg_type_info = unboxed_arg_type_info_list[carg_idx];
+          var arg_size = arg_type_info[0];
+          var arg_align = arg_type_info[1];
+          // In this case varargs is a pointer to pointer to struct so we need to
+          // deref once
+          var struct_ptr = DEREF_U32(varargs, 0);
+          STACK_ALLOC(cur_ptr, arg_size, arg_align);
+          HEAP8.subarray(cur_ptr, cur_ptr + arg_size).set(HEAP8.subarray(struct_ptr, struct_ptr + arg_size));
+          DEREF_U32(args_ptr, carg_idx) = cur_ptr;
+        } else {
+          DEREF_U32(args_ptr, carg_idx) = varargs;
+        }
+        varargs += 4;
       }
-      varargs += 4;
     }
+    // Snapshot args_ptr: the onward call may re-enter this trampoline.
+    var call_args_ptr = args_ptr;
     stackRestore(cur_ptr);
     stackAlloc(0); // stackAlloc enforces alignment invariants on the stack pointer
     LOG_DEBUG("CALL_CLOSURE", "closure:", closure, "fptr", CLOSURE__fun(closure), "cif", CLOSURE__cif(closure));
     getWasmTableEntry(CLOSURE__fun(closure))(
-        CLOSURE__cif(closure), ret_ptr, args_ptr,
+        CLOSURE__cif(closure), ret_ptr, call_args_ptr,
         CLOSURE__user_data(closure)
     );
     stackRestore(orig_stack_ptr);
 
     // If we aren't supposed to return by argument, figure out what to return.
-    if (!ret_by_arg) {
-      switch (sig[0]) {
-      case 'i':
-        return DEREF_U32(ret_ptr, 0);
-      case 'j':
-        return DEREF_U64(ret_ptr, 0);
-      case 'd':
-        return DEREF_F64(ret_ptr, 0);
-      case 'f':
-        return DEREF_F32(ret_ptr, 0);
-      }
+    if (load_result) {
+      return load_result(ret_ptr);
     }
   }
   try {
-    var wasm_trampoline = convertJsFunctionToWasm(trampoline, sig);
+    var wasm_trampoline = ffi_closure_wrapper_js(sig, trampoline);
   } catch(e) {
     return FFI_BAD_TYPEDEF_MACRO;
   }
@@ -649,7 +837,6 @@ ffi_prep_closure_loc_js,
 })
 
 #else
-#include <stdbool.h>
 
 // Call a function pointer with dynamic parameters.
 //
@@ -783,123 +970,81 @@ static void impl_free_closure(void *code) {
 #endif
 #endif
 
-// Modifies the given ffi_type in place to make it easier to process later on.
-//
-// * Structs with no fields are replaced with void
-// * Structs that recursively contain just a single scalar type are replaced with that scalar's type
-// * Structs that recursively contain just no scalar types (or only void) are replaced with void
-// * Complex types are replaced with a struct containing two floating point numbers (real and imaginary parts)
-// * Struct fields are recursively processed according to the same rules
-// * Only for results: long doubles are replaced with a struct containing two 64-bit integers
+static unsigned short lower_struct(ffi_type *type);
+
+// Determines the type that the given ffi_type is passed as in the wasm C ABI. The ffi_type itself is not modified.
 //
-// ffi_type: points to a pointer to the ffi_type to process. For struct types the ffi_type will be modified in place. For complex and long double types the pointer will be replaced with a new pointer to a different ffi_type.
+// * Structs with no fields are lowered to void
+// * Structs that recursively contain just a single scalar type are lowered to that scalar's type
+// * Structs that recursively contain just no scalar types (or only void) are lowered to void
+// * Complex types are lowered like a struct containing two floating point numbers (real and imaginary parts)
+// * Only for results: long doubles are lowered like a struct containing two 64-bit integers
 //
 // in_results: Set to true if the type a result, false if it is an argument.
 //
-// After this processing, there will be no complex numbers, and all structs will have more than one non-void element and will thus be passed indirectly as a pointer.
-static unsigned short replace_type(ffi_type **type_ptr, bool in_results) {
-  ffi_type *type = *type_ptr;
+// Returns the FFI_TYPE_* of the lowered type. There are no complex numbers after lowering, and FFI_TYPE_STRUCT always means a struct with more than one non-void element, which is passed indirectly as a pointer.
+static unsigned short lower_type(ffi_type *type, bool in_results) {
   if (type == NULL) {
     return FFI_TYPE_VOID; // No type, so no processing needed. Should only happen for return types.
   }
 
-  if (type->type == FFI_TYPE_COMPLEX) {
+  switch (type->type) {
+  case FFI_TYPE_COMPLEX:
     // _Complex types are represented in the ABI as a struct containing two corresponding floating-point fields, real and imaginary.
-    static ffi_type *ffi_type_complex_float_struct_elements[] = {&ffi_type_float, &ffi_type_float, 0};
-    static ffi_type *ffi_type_complex_double_struct_elements[] = {&ffi_type_double, &ffi_type_double, 0};
-    static ffi_type *ffi_type_complex_longdouble_struct_elements[] = {&ffi_type_longdouble, &ffi_type_longdouble, 0};
-    static ffi_type ffi_type_complex_float_struct = {
-      .size = sizeof(float) * 2,
-      .alignment = _Alignof(float),
-      .type = FFI_TYPE_STRUCT,
-      .elements = ffi_type_complex_float_struct_elements,
-    };
-    static ffi_type ffi_type_complex_double_struct = {
-      .size = sizeof(double) * 2,
-      .alignment = _Alignof(double),
-      .type = FFI_TYPE_STRUCT,
-      .elements = ffi_type_complex_double_struct_elements,
-    };
-    static ffi_type ffi_type_complex_longdouble_struct = {
-      .size = sizeof(long double) * 2,
-      .alignment = _Alignof(long double),
-      .type = FFI_TYPE_STRUCT,
-      .elements = ffi_type_complex_longdouble_struct_elements,
-    };
-
-    ffi_type* underlying_type = type->elements[0];
-    switch (underlying_type->type) {
+    switch (type->elements[0]->type) {
       case FFI_TYPE_FLOAT:
-        *type_ptr = &ffi_type_complex_float_struct;
-        break;
       case FFI_TYPE_DOUBLE:
-        *type_ptr = &ffi_type_complex_double_struct;
-        break;
       case FFI_TYPE_LONGDOUBLE:
-        *type_ptr = &ffi_type_complex_longdouble_struct;
         break;
       default:
         ABORT_WITH_MSG("Only float, double and long double complex types are supported");
     }
     // The size of the struct should be exactly the real and imaginary parts combined
-    FFI_ASSERT(type->size == underlying_type->size * 2);
+    FFI_ASSERT(type->size == type->elements[0]->size * 2);
     // The alignment of the struct should be the same as a single of the underlying type
-    FFI_ASSERT(type->alignment == underlying_type->alignment);
+    FFI_ASSERT(type->alignment == type->elements[0]->alignment);
     return FFI_TYPE_STRUCT;
+  case FFI_TYPE_LONGDOUBLE:
+    // When returning long doubles, they are treated as structs.
+    return in_results ? FFI_TYPE_STRUCT : FFI_TYPE_LONGDOUBLE;
+  case FFI_TYPE_STRUCT:
+    return lower_struct(type);
+  default:
+    // Not a complex or a struct, so no processing needed
+    return type->type;
   }
+}
 
-  if (in_results && type->type == FFI_TYPE_LONGDOUBLE) {
-    // When returning long doubles, they are treated as structs.
-    static ffi_type *ffi_type_longdouble_struct_elements[] = {&ffi_type_sint64, &ffi_type_sint64, 0};
-    static ffi_type ffi_type_longdouble_struct = {
-      .size = sizeof(SINT64) * 2,
-      .alignment = 16, // long double is 16 byte aligned
-      .type = FFI_TYPE_STRUCT,
-      .elements = ffi_type_longdouble_struct_elements
-    };
-    *type_ptr = &ffi_type_longdouble_struct;
-    return FFI_TYPE_STRUCT;
+// Lowers a struct type by walking its elements
+static unsigned short lower_struct(ffi_type *type) {
+  // Treat zero size structs as void
+  if (type->size == 0) {
+    return FFI_TYPE_VOID;
   }
 
-  if (type->type == FFI_TYPE_STRUCT) {
-    // Treat zero size structs as void
-    if (type->size == 0) {
-      type->type = FFI_TYPE_VOID;
-      return FFI_TYPE_VOID;
-    }
-  
-    // Analyze if a struct has only one non-void element
-    unsigned short scalar_type = FFI_TYPE_VOID;
-    size_t number_of_nonvoid_elements = 0;
-    for (size_t i = 0; type->elements[i] != 0; i++) {
-      unsigned short element_type = replace_type(&type->elements[i], false);
-      if (element_type != FFI_TYPE_VOID) {
-        scalar_type = element_type;
-        number_of_nonvoid_elements += 1;
-      }
-    }
-  
-    // Don't change the type of structs that have more than one non-void element
-    if (number_of_nonvoid_elements > 1) {
-      return type->type;
+  // Analyze if a struct has only one non-void element
+  unsigned short scalar_type = FFI_TYPE_VOID;
+  size_t number_of_nonvoid_elements = 0;
+  for (size_t i = 0; type->elements[i] != 0; i++) {
+    unsigned short element_type = lower_type(type->elements[i], false);
+    if (element_type != FFI_TYPE_VOID) {
+      scalar_type = element_type;
+      number_of_nonvoid_elements += 1;
     }
+  }
 
-    // Treat structs with only one non-void element like that element
-    type->type = scalar_type;
-    return scalar_type;
+  // Structs that have more than one non-void element stay structs
+  if (number_of_nonvoid_elements > 1) {
+    return FFI_TYPE_STRUCT;
   }
 
-  // Not a complex or a struct, so no processing needed
-  return type->type;
+  // Treat structs with only one non-void element like that element
+  return scalar_type;
 }
 
 // Get the size of the type in the WASM C ABI in bytes.
-static uint8_t type_size(ffi_type *type) {
-  if (type == NULL) { // No return type, so no size
-    return 0;
-  }
-
-  switch (type->type) {
+static uint8_t type_size(unsigned short type) {
+  switch (type) {
   case FFI_TYPE_VOID:
     return 0; // Ignored
   case FFI_TYPE_INT:
@@ -923,97 +1068,23 @@ static uint8_t type_size(ffi_type *type) {
   case FFI_TYPE_LONGDOUBLE:
     return 16; // i64 i64
   case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
   default:
     ABORT_WITH_MSG("Unknown type in get_type_size");
   }
 };
 
-// Places a value into the values buffer
-//
-// type is the type that value is interpreted as.
-//
-// value is a pointer to the value to place into the buffer.
-//
-// values must be a pointer to a buffer as described in impl_call_dynamic.
-// The values pointer will be incremented by the size of the placed value.
-static void place_value(ffi_type *type, void *value, uint8_t **values) {
-  switch (type->type) {
-  case FFI_TYPE_VOID:
-    return;
-  case FFI_TYPE_UINT8:
-    *((UINT32 *)*values) = (UINT32)(*(UINT8 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_SINT8:
-    *((SINT32 *)*values) = (SINT32)(*(SINT8 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_UINT16:
-    *((UINT32 *)*values) = (UINT32)(*(UINT16 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_SINT16:
-    *((SINT32 *)*values) = (SINT32)(*(SINT16 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_UINT32:
-    *((UINT32 *)*values) = (UINT32)(*(UINT32 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_INT:
-  case FFI_TYPE_SINT32:
-    *((SINT32 *)*values) = (SINT32)(*(SINT32 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_FLOAT:
-    *((FLOAT32 *)*values) = (FLOAT32)(*(FLOAT32 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_UINT64:
-    *((UINT64 *)*values) = (UINT64)(*(UINT64 *)value);
-    *values += 8;
-    return;
-  case FFI_TYPE_SINT64:
-    *((SINT64 *)*values) = (SINT64)(*(SINT64 *)value);
-    *values += 8;
-    return;
-  case FFI_TYPE_DOUBLE:
-    *((double *)*values) = (double)(*(double *)value);
-    *values += 8;
-    return;
-  case FFI_TYPE_POINTER:
-    *((UINT32 *)*values) = (UINT32)(*(UINT32 *)value);
-    *values += 4;
-    return;
-  case FFI_TYPE_STRUCT:
-    // Pass indirectly by pointer
-    *((UINT32 *)*values) = (UINT32)(value);
-    *values += 4;
-    return;
-  case FFI_TYPE_LONGDOUBLE:
-    // If the return type is indirect, we need an extra parameter for the return value
-    *((long double *)*values) = (long double)(*(long double *)value);
-    *values += 16;
-    return;
-  case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
-  default:
-    ABORT_WITH_MSG("Unknown type in place_value");
-  }
-}
-
 // Takes a value from the values buffer and returns a pointer to it.
 //
-// type is the type that value is interpreted as.
+// type is the lowered type that value is interpreted as.
 //
 // Increments the values pointer by the size of the value taken.
 //
 // values must be a pointer to a buffer as described in impl_call_dynamic.
 // The values pointer will be incremented by the size of the taken value.
-static void *take_value(ffi_type *type, uint8_t **values) {
+static void *take_value(unsigned short type, uint8_t **values) {
   void *result;
-  switch (type->type) {
+  switch (type) {
   case FFI_TYPE_VOID:
     result = *values;
     return result;
@@ -1048,7 +1119,7 @@ static void *take_value(ffi_type *type, uint8_t **values) {
     (*values) += 16;
     return result;
   case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
   default:
     ABORT_WITH_MSG("Unknown type in take_value");
   }
@@ -1056,12 +1127,12 @@ static void *take_value(ffi_type *type, uint8_t **values) {
 
 // Interprets the given ffi_type and places it in a buffer as a wasm C ABI type.
 //
-// type is the ffi_type to interpret.
+// type is the lowered type to interpret.
 //
 // types is a buffer of wasm basic C ABI types, as described in impl_closure_prepare.
 // The buffer will be modified in place, and the pointer will be incremented by the size of the type placed.
-static void place_type(ffi_type *type, uint8_t **types) {
-  switch (type->type) {
+static void place_type(unsigned short type, uint8_t **types) {
+  switch (type) {
   case FFI_TYPE_VOID:
     return;
   case FFI_TYPE_SINT8:
@@ -1099,7 +1170,7 @@ static void place_type(ffi_type *type, uint8_t **types) {
     *types += 1;
     return;
   case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
   default:
     ABORT_WITH_MSG("Unknown type in place_type");
   }
@@ -1108,12 +1179,8 @@ static void place_type(ffi_type *type, uint8_t **types) {
 // Determines whether the type is returned indirectly
 //
 // Indirect return means that a pointer to the return value is passed as the first argument of the function call.
-static bool return_indirect(ffi_type *rtype) {
-  if (rtype == NULL) {
-    // Nullptr means no return type, which is treated as void
-    return false;
-  }
-  switch (rtype->type) {
+static bool return_indirect(unsigned short rtype) {
+  switch (rtype) {
   case FFI_TYPE_VOID: // Void can be treated as direct return, as it is ignored
   case FFI_TYPE_INT:
   case FFI_TYPE_FLOAT:
@@ -1131,17 +1198,17 @@ static bool return_indirect(ffi_type *rtype) {
   case FFI_TYPE_STRUCT:
     return true;
   case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
   case FFI_TYPE_LONGDOUBLE:
-    ABORT_WITH_MSG("longdouble return type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("longdouble return type should have been lowered to a struct");
   default:
     ABORT_WITH_MSG("Unknown type in return_indirect");
   }
 }
 
 // Determines how many arguments are required to pass this type using the wasm basic C ABI
-static uint8_t arguments_count(ffi_type *type) {
-  switch (type->type) {
+static uint8_t arguments_count(unsigned short type) {
+  switch (type) {
   case FFI_TYPE_VOID: // Void can be treated as direct return, as it is ignored
     return 0;
   case FFI_TYPE_INT:
@@ -1161,12 +1228,150 @@ static uint8_t arguments_count(ffi_type *type) {
   case FFI_TYPE_LONGDOUBLE:
     return 2;
   case FFI_TYPE_COMPLEX:
-    ABORT_WITH_MSG("_Complex type should have been replaced with a struct during ffi_prep_cif");
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
   default:
     ABORT_WITH_MSG("Unknown type in arguments_count");
   }
 }
 
+// Ways of moving a value into the values buffer, see lowering_op
+#define WASIX_OP_NONE 0   // nothing is passed
+#define WASIX_OP_U8 1     // zero-extended to i32
+#define WASIX_OP_S8 2     // sign-extended to i32
+#define WASIX_OP_U16 3    // zero-extended to i32
+#define WASIX_OP_S16 4    // sign-extended to i32
+#define WASIX_OP_COPY4 5  // i32, f32 and pointers
+#define WASIX_OP_COPY8 6  // i64 and f64
+#define WASIX_OP_COPY16 7 // long double as i64 i64
+#define WASIX_OP_ADDR 8   // structs, passed indirectly by pointer
+
+// Determines how a value of the given lowered type is placed into the values buffer.
+static uint8_t lowering_op(unsigned short type) {
+  switch (type) {
+  case FFI_TYPE_VOID:
+    return WASIX_OP_NONE;
+  case FFI_TYPE_UINT8:
+    return WASIX_OP_U8;
+  case FFI_TYPE_SINT8:
+    return WASIX_OP_S8;
+  case FFI_TYPE_UINT16:
+    return WASIX_OP_U16;
+  case FFI_TYPE_SINT16:
+    return WASIX_OP_S16;
+  case FFI_TYPE_UINT32:
+  case FFI_TYPE_INT:
+  case FFI_TYPE_SINT32:
+  case FFI_TYPE_FLOAT:
+  case FFI_TYPE_POINTER:
+    return WASIX_OP_COPY4;
+  case FFI_TYPE_UINT64:
+  case FFI_TYPE_SINT64:
+  case FFI_TYPE_DOUBLE:
+    return WASIX_OP_COPY8;
+  case FFI_TYPE_STRUCT:
+    return WASIX_OP_ADDR;
+  case FFI_TYPE_LONGDOUBLE:
+    return WASIX_OP_COPY16;
+  case FFI_TYPE_COMPLEX:
+    ABORT_WITH_MSG("_Complex type should have been lowered to a struct");
+  default:
+    ABORT_WITH_MSG("Unknown type in lowering_op");
+  }
+}
+
+// Computes where every argument goes in the values buffer of impl_call_dynamic.
+static void lower_args(ffi_cif *cif, ffi_wasix_arg *plan) {
+  // If the return type is indirect, the first parameter is the pointer to the return value
+  unsigned short rtype = lower_type(cif->rtype, true);
+  size_t offset = return_indirect(rtype) ? type_size(rtype) : 0;
+
+  for (int i = 0; i < cif->nargs; i++) {
+    unsigned short type = lower_type(cif->arg_types[i], false);
+    plan[i].offset = offset;
+    plan[i].op = lowering_op(type);
+    offset += type_size(type);
+  }
+}
+
+// Stores the lowered layout of the call in the cif: the sizes of the values and results buffers of impl_call_dynamic, whether the return value is passed indirectly and, if the cif has few enough arguments, the placement of every argument and the wasm signature used by impl_closure_prepare.
+static void lower_cif(ffi_cif *cif) {
+  unsigned short rtype = lower_type(cif->rtype, true);
+  size_t values_size = 0;
+
+  cif->wasix_indirect_return = return_indirect(rtype);
+  if (cif->wasix_indirect_return) {
+    values_size += type_size(rtype);
+    cif->wasix_results_size = 0;
+  } else {
+    cif->wasix_results_size = type_size(rtype);
+  }
+  for (int i = 0; i < cif->nargs; i++) {
+    values_size += type_size(lower_type(cif->arg_types[i], false));
+  }
+  cif->wasix_values_size = values_size;
+
+  if (cif->nargs <= FFI_WASIX_PLAN_ARGS) {
+    lower_args(cif, cif->wasix_plan);
+
+    // At most two wasm values per argument plus the indirect return pointer,
+    // and at most one result as longdouble returns are rewritten as structs
+    uint8_t *arg_types_ptr = cif->wasix_arg_types;
+    uint8_t *result_types_ptr = &cif->wasix_result_type;
+    if (cif->wasix_indirect_return) {
+      place_type(rtype, &arg_types_ptr);
+    } else {
+      place_type(rtype, &result_types_ptr);
+    }
+    for (int i = 0; i < cif->nargs; i++) {
+      place_type(lower_type(cif->arg_types[i], false), &arg_types_ptr);
+    }
+    cif->wasix_narg_types = arg_types_ptr - cif->wasix_arg_types;
+    cif->wasix_nresult_types = result_types_ptr - &cif->wasix_result_type;
+  }
+}
+
+// Returns a pointer to an argument in the values buffer at the position computed by lower_cif. This is take_value without the type switch.
+static void *take_lowered(const ffi_wasix_arg *arg, uint8_t *values) {
+  if (arg->op == WASIX_OP_ADDR) {
+    // Passed indirectly by pointer
+    return *(void **)(values + arg->offset);
+  }
+  return values + arg->offset;
+}
+
+// Places a value into the values buffer at the position computed by lower_cif
+static void place_lowered(const ffi_wasix_arg *arg, void *value, uint8_t *values) {
+  uint8_t *dest = values + arg->offset;
+  switch (arg->op) {
+  case WASIX_OP_NONE:
+    return;
+  case WASIX_OP_U8:
+    *(UINT32 *)dest = *(UINT8 *)value;
+    return;
+  case WASIX_OP_S8:
+    *(SINT32 *)dest = *(SINT8 *)value;
+    return;
+  case WASIX_OP_U16:
+    *(UINT32 *)dest = *(UINT16 *)value;
+    return;
+  case WASIX_OP_S16:
+    *(SINT32 *)dest = *(SINT16 *)value;
+    return;
+  case WASIX_OP_COPY4:
+    memcpy(dest, value, 4);
+    return;
+  case WASIX_OP_COPY8:
+    memcpy(dest, value, 8);
+    return;
+  case WASIX_OP_COPY16:
+    memcpy(dest, value, 16);
+    return;
+  case WASIX_OP_ADDR:
+    *(UINT32 *)dest = (UINT32)value;
+    return;
+  }
+}
+
 // This function will be passed as the backing function to impl_closure_prepare
 //
 // wasm_arguments is a pointer to a buffer containing the arguments in the same format as in impl_call_dynamic
@@ -1185,13 +1390,25 @@ static void closure_backing_function(
   void* libffi_args[cif->nargs];
   void* libffi_result = wasm_results;
 
+  if (cif->nargs <= FFI_WASIX_PLAN_ARGS) {
+    if (cif->wasix_indirect_return) {
+      // If the return type is indirect, the first argument is a pointer to the result
+      libffi_result = *(void **)wasm_arguments;
+    }
+    for (int i = 0; i < cif->nargs; i++) {
+      libffi_args[i] = take_lowered(&cif->wasix_plan[i], wasm_arguments);
+    }
+    fun(cif, libffi_result, libffi_args, user_data);
+    return;
+  }
+
   uint8_t * libffi_args_ptr = (uint8_t *)wasm_arguments;
-  if (return_indirect(cif->rtype)) {
+  if (cif->wasix_indirect_return) {
     // If the return type is indirect, the first argument is a pointer to the result
-    libffi_result = take_value(cif->rtype, (uint8_t**)(&libffi_args_ptr));
+    libffi_result = take_value(lower_type(cif->rtype, true), (uint8_t**)(&libffi_args_ptr));
   }
   for (int i = 0; i < cif->nargs; i++) {
-    libffi_args[i] = take_value(cif->arg_types[i], (uint8_t**)(&libffi_args_ptr));
+    libffi_args[i] = take_value(lower_type(cif->arg_types[i], false), (uint8_t**)(&libffi_args_ptr));
   }
 
   fun(cif, libffi_result, libffi_args, user_data);
@@ -1216,19 +1433,21 @@ ffi_prep_cif_machdep(ffi_cif *cif)
     if (cif->arg_types[i]->type == FFI_TYPE_COMPLEX)
       return FFI_BAD_TYPEDEF;
 #else
-  // Preprocess arguments and return types
-  for (int i = 0; i < cif->nargs; i++) {
-    replace_type(&cif->arg_types[i], false);
-  }
-  replace_type(&cif->rtype, true);
+#endif
+
+  if (cif->nargs > MAX_ARGS)
+    return FFI_BAD_TYPEDEF;
+#ifndef __EMSCRIPTEN__
+  lower_cif(cif);
 #endif
 
   // This is called after ffi_prep_cif_machdep_var so we need to avoid
   // overwriting cif->nfixedargs.
   if (!(cif->flags & VARARGS_FLAG))
     cif->nfixedargs = cif->nargs;
-  if (cif->nargs > MAX_ARGS)
-    return FFI_BAD_TYPEDEF;
+#ifdef __EMSCRIPTEN__
+  cif->marshaller_id = ffi_call_marshaller_id_js(cif);
+#endif
 
   return FFI_OK;
 }
@@ -1250,75 +1469,159 @@ ffi_prep_cif_machdep_var(ffi_cif *cif, unsigned nfixedargs, unsigned ntotalargs)
 
 void ffi_call(ffi_cif *cif, void (*fn)(void), void *rvalue, void **avalue) {
 #ifdef __EMSCRIPTEN__
-  ffi_call_js(cif, fn, rvalue, avalue);
+  ffi_call_js(cif, cif->marshaller_id, fn, rvalue, avalue);
   return;
 #else
-  // Calculate the total size that we need to allocate for the arguments
-  size_t total_size = 0;
-
-  bool indirect_return = return_indirect(cif->rtype);
-  if (indirect_return) {
-    // If the return type is indirect, we need an extra parameter for the return value
-    total_size += type_size(cif->rtype);
-  }
-
-  // Calculate how much space we need for all arguments
-  for (int i = 0; i < cif->nargs; i++) {
-    total_size += type_size(cif->arg_types[i]);
+  // Cifs with many arguments don't keep their layout, so compute it now
+  const ffi_wasix_arg *plan = cif->wasix_plan;
+  ffi_wasix_arg scratch[cif->nargs > FFI_WASIX_PLAN_ARGS ? cif->nargs : 1];
+  if (cif->nargs > FFI_WASIX_PLAN_ARGS) {
+    lower_args(cif, scratch);
+    plan = scratch;
   }
 
   // Buffer for arguments as described in impl_call_dynamic
-  uint8_t values[total_size];
+  uint8_t values[cif->wasix_values_size];
 
-  // Fill the buffers
-  uint8_t * current_value = values;
-  if (indirect_return) {
-    *((void **)current_value) = rvalue;
-    current_value += 4;
+  // Fill the buffer
+  if (cif->wasix_indirect_return) {
+    *((void **)values) = rvalue;
   }
   for (int i = 0; i < cif->nargs; i++) {
-    place_value(cif->arg_types[i], avalue[i], &current_value);
+    place_lowered(&plan[i], avalue[i], values);
   }
 
-  impl_call_dynamic(fn, values, total_size, rvalue, indirect_return ? 0 : type_size(cif->rtype));
+  impl_call_dynamic(fn, values, cif->wasix_values_size, rvalue, cif->wasix_results_size);
+#endif
+}
+
+// Every closure allocation starts with a header holding the function table slot of the closure, so we don't need to keep track of which data allocation is for which closure separately.
+//
+// We need this, because there is no guarantee that the allocation will be used for a ffi_closure struct.
+//
+// Allocations of at most sizeof(ffi_closure) bytes are carved from slabs of CLOSURE_SLAB_COUNT and recycled through closure_free_list.
+// Slabs are never returned to the system. On Emscripten the table slots for a slab are reserved with a single table.grow, and a pooled closure keeps its slot; freeing it clears the slot.
+// WASIX has no call to reserve several slots at once, and its closure API does not promise that a slot can be prepared again, so a pooled closure gets a new slot from the host each time it is handed out and gives it back when it is freed.
+typedef struct closure_header {
+  void *code;
+  union {
+    size_t pooled;
+    // Next free pooled closure while on closure_free_list
+    struct closure_header *next_free;
+  };
+} closure_header;
+
+// Although we are under no obligation to do so, we assure the returned allocation has the correct alignment for a ffi_closure.
+#define CLOSURE_ALIGNMENT (_Alignof(ffi_closure) > _Alignof(closure_header) ? _Alignof(ffi_closure) : _Alignof(closure_header))
+#define CLOSURE_HEADER_SIZE FFI_ALIGN(sizeof(closure_header), CLOSURE_ALIGNMENT)
+#define POOLED_CLOSURE_SIZE (CLOSURE_HEADER_SIZE + FFI_ALIGN(sizeof(ffi_closure), CLOSURE_ALIGNMENT))
+#define CLOSURE_SLAB_COUNT 64
+
+static closure_header *closure_free_list;
+static char closure_pool_lock;
+
+static void lock_closure_pool(void) {
+  while (__atomic_test_and_set(&closure_pool_lock, __ATOMIC_ACQUIRE))
+    ;
+}
+
+static void unlock_closure_pool(void) {
+  __atomic_clear(&closure_pool_lock, __ATOMIC_RELEASE);
+}
+
+// Adds a new slab to closure_free_list. Must be called with the pool locked.
+static bool refill_closure_pool(void) {
+  char *slab = aligned_alloc(CLOSURE_ALIGNMENT, POOLED_CLOSURE_SIZE * CLOSURE_SLAB_COUNT);
+  if (slab == NULL) {
+    return false;
+  }
+#ifdef __EMSCRIPTEN__
+  uintptr_t first_slot = (uintptr_t)ffi_closure_reserve_slots_js(CLOSURE_SLAB_COUNT);
 #endif
+  for (int i = CLOSURE_SLAB_COUNT - 1; i >= 0; i--) {
+    closure_header *header = (closure_header *)(slab + i * POOLED_CLOSURE_SIZE);
+#ifdef __EMSCRIPTEN__
+    header->code = (void *)(first_slot + i);
+#else
+    header->code = NULL;
+#endif
+    header->next_free = closure_free_list;
+    closure_free_list = header;
+  }
+  return true;
 }
 
 void * __attribute__ ((visibility ("default")))
 ffi_closure_alloc(size_t size, void **code) {
+  closure_header *header;
+
+  if (size <= sizeof(ffi_closure)) {
+    lock_closure_pool();
+    if (closure_free_list == NULL && !refill_closure_pool()) {
+      unlock_closure_pool();
+      return NULL;
+    }
+    header = closure_free_list;
+    closure_free_list = header->next_free;
+    unlock_closure_pool();
+
+    header->pooled = 1;
+#ifndef __EMSCRIPTEN__
+    if (header->code == NULL) {
+      impl_closure_alloc(&header->code);
+    }
+#endif
+  } else {
+    header = aligned_alloc(CLOSURE_ALIGNMENT, FFI_ALIGN(CLOSURE_HEADER_SIZE + size, CLOSURE_ALIGNMENT));
+    if (header == NULL) {
+      return NULL;
+    }
+    header->pooled = 0;
 #ifdef __EMSCRIPTEN__
-  return ffi_closure_alloc_js(size, code);
+    header->code = ffi_closure_slot_js();
 #else
-  // We also allocate space for a pointer to the entry in the function table, so we don't need to keep track of which data allocation is for which closure separately.
-  //
-  // We need this, because there is no guarantee that the allocation will be used for a ffi_closure struct.
-  //
-  // Although we are under no obligation to do so, we assure the returned allocation has the correct alignment for a ffi_closure.
-  const size_t alignment = _Alignof(ffi_closure) > _Alignof(void *) ? _Alignof(ffi_closure) : _Alignof(void *);
-  const size_t code_ptr_size = (sizeof(void *) + alignment - 1) & ~(alignment - 1);
+    impl_closure_alloc(&header->code);
+#endif
+  }
 
-  void *allocation = aligned_alloc(alignment, size + code_ptr_size);
-  impl_closure_alloc(code);
-  *(void **)allocation = *code;
-  // Return a pointer to a allocation requested of the requested size
-  return allocation + code_ptr_size;
+  *code = header->code;
+  void *closure = (char *)header + CLOSURE_HEADER_SIZE;
+#ifdef __EMSCRIPTEN__
+  if (size >= sizeof(void *)) {
+    // ffi_prep_closure_loc_js expects the slot in the ftramp field
+    ((ffi_closure *)closure)->ftramp = header->code;
+  }
 #endif
+  // Return a pointer to a allocation requested of the requested size
+  return closure;
 }
 
 void __attribute__ ((visibility ("default")))
 ffi_closure_free(void *closure) {
+  // Retrieve the original allocation pointer
+  closure_header *header = (closure_header *)((char *)closure - CLOSURE_HEADER_SIZE);
+
+  if (header->pooled) {
 #ifdef __EMSCRIPTEN__
-  return ffi_closure_free_js(closure);
+    // Keep the table slot with the closure for its next user
+    ffi_closure_clear_slot_js(header->code);
 #else
-  // See the comment in ffi_closure_alloc for why we store the pointer to the code in the allocation.
-  const size_t alignment = _Alignof(ffi_closure) > _Alignof(void *) ? _Alignof(ffi_closure) : _Alignof(void *);
-  const size_t code_ptr_size = (sizeof(void *) + alignment - 1) & ~(alignment - 1);
+    impl_free_closure(header->code);
+    header->code = NULL;
+#endif
+    lock_closure_pool();
+    header->next_free = closure_free_list;
+    closure_free_list = header;
+    unlock_closure_pool();
+    return;
+  }
 
-  // Retrieve the original allocation pointer
-  void *allocation = closure - code_ptr_size;
-  impl_free_closure(*(void **)allocation);
-  free(allocation);
+#ifdef __EMSCRIPTEN__
+  ffi_closure_release_slot_js(header->code);
+#else
+  impl_free_closure(header->code);
 #endif
+  free(header);
 }
 
 // EM_JS does not correctly handle function pointer arguments, so we need a
@@ -1334,19 +1637,39 @@ ffi_status ffi_prep_closure_loc(ffi_closure *closure, ffi_cif *cif,
 #else
   if (cif->abi == FFI_WASM32_EMSCRIPTEN)
     return FFI_BAD_ABI;
+
+  // Setup the closure struct
+  closure->cif = cif;
+  closure->fun = fun;
+  closure->user_data = user_data;
+  closure->ftramp = codeloc;
+
+  if (cif->nargs <= FFI_WASIX_PLAN_ARGS) {
+    // The signature was lowered once by ffi_prep_cif
+    return impl_closure_prepare(
+      closure_backing_function,
+      codeloc,
+      cif->wasix_arg_types,
+      cif->wasix_narg_types,
+      &cif->wasix_result_type,
+      cif->wasix_nresult_types,
+      closure);
+  }
+
   // Figure out the number of the arguments and results
   int argument_count = 0;
   int result_count = 0;
-  bool indirect_return = return_indirect(cif->rtype);
+  unsigned short rtype = lower_type(cif->rtype, true);
+  bool indirect_return = cif->wasix_indirect_return;
   if (indirect_return) {
     // Always 1 as only structs are returned indirectly
-    argument_count += arguments_count(cif->rtype);
+    argument_count += arguments_count(rtype);
   }else {
-    // Always 0 or 1, as longdouble returns are rewritten as structs during ffi_prep_cif
-    result_count += arguments_count(cif->rtype);
+    // Always 0 or 1, as longdouble returns are lowered to structs
+    result_count += arguments_count(rtype);
   }
   for (int i = 0; i < cif->nargs; i++) {
-    argument_count += arguments_count(cif->arg_types[i]);
+    argument_count += arguments_count(lower_type(cif->arg_types[i], false));
   }
 
   // Buffers for arguments and results as described in impl_closure_prepare
@@ -1358,20 +1681,14 @@ ffi_status ffi_prep_closure_loc(ffi_closure *closure, ffi_cif *cif,
   uint8_t* result_types_ptr = result_types;
   if (indirect_return) {
     // If the return type is indirect, it is passed as the first argument
-    place_type(cif->rtype, &arg_types_ptr);
+    place_type(rtype, &arg_types_ptr);
   } else {
-    place_type(cif->rtype, &result_types_ptr);
+    place_type(rtype, &result_types_ptr);
   }
   for (int i = 0; i < cif->nargs; i++) {
-    place_type(cif->arg_types[i], &arg_types_ptr);
+    place_type(lower_type(cif->arg_types[i], false), &arg_types_ptr);
   }
 
-  // Setup the closure struct
-  closure->cif = cif;
-  closure->fun = fun;
-  closure->user_data = user_data;
-  closure->ftramp = codeloc;
-  
   // Prepare the actual closure
   ffi_status status = impl_closure_prepare(
     closure_backing_function,
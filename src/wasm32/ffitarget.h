@@ -59,6 +59,32 @@ typedef enum ffi_abi {
 #define FFI_TRAMPOLINE_SIZE 4
 // #define FFI_NATIVE_RAW_API 0
 #define FFI_TARGET_SPECIFIC_VARIADIC 1
-#define FFI_EXTRA_CIF_FIELDS  unsigned int nfixedargs
+#ifdef __EMSCRIPTEN__
+// marshaller_id names the Javascript marshaller for the cif's signature,
+// assigned by ffi_prep_cif.
+#define FFI_EXTRA_CIF_FIELDS  unsigned int nfixedargs; \
+  unsigned int marshaller_id
+#else
+// Where an argument goes in the wasm value buffer handed to the runtime and
+// how it is widened on the way; computed by ffi_prep_cif.
+typedef struct {
+  unsigned short offset;
+  unsigned char op;
+} ffi_wasix_arg;
+
+// Cifs with more arguments than this lower them, and the closure signature,
+// on every use instead.
+#define FFI_WASIX_PLAN_ARGS 16
+
+#define FFI_EXTRA_CIF_FIELDS  unsigned int nfixedargs; \
+  unsigned int wasix_values_size; \
+  unsigned char wasix_results_size; \
+  unsigned char wasix_indirect_return; \
+  unsigned char wasix_nresult_types; \
+  unsigned char wasix_result_type; \
+  unsigned char wasix_narg_types; \
+  unsigned char wasix_arg_types[2 * FFI_WASIX_PLAN_ARGS + 1]; \
+  ffi_wasix_arg wasix_plan[FFI_WASIX_PLAN_ARGS]
+#endif
 
 #endif
@@ -32,6 +32,7 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <tramp.h>
 #include "internal64.h"
@@ -390,6 +391,121 @@ examine_argument (ffi_type *type, enum x86_64_reg_class classes[MAX_CLASSES],
   return n;
 }
 
+/* Assign every argument of CIF to registers or to the stack, using
+   the classification above, and record the result in PLAN (which may
+   be NULL when only the totals are wanted).  The stack size is stored
+   in *PBYTES and the number of SSE registers used is returned.
+   CIF->FLAGS must already describe the return value.  */
+
+static int
+unix64_plan_args (ffi_cif *cif, ffi_unix64_arg *plan, size_t *pbytes)
+{
+  enum x86_64_reg_class classes[MAX_CLASSES];
+  int gprcount, ssecount, ngpr, nsse;
+  unsigned i, j, avn;
+  size_t bytes, n;
+
+  gprcount = ssecount = 0;
+  if (cif->flags & UNIX64_FLAG_RET_IN_MEM)
+    gprcount++;
+
+  for (bytes = 0, i = 0, avn = cif->nargs; i < avn; i++)
+    {
+      ffi_type *at = cif->arg_types[i];
+      ffi_unix64_arg e;
+
+      e.size = (unsigned) at->size;
+      e.op[1] = UNIX64_ARG_NONE;
+
+      n = examine_argument (at, classes, 0, &ngpr, &nsse);
+      if (n == 0
+	  || gprcount + ngpr > MAX_GPR_REGS
+	  || ssecount + nsse > MAX_SSE_REGS)
+	{
+	  long align = at->alignment;
+
+	  /* Stack arguments are *always* at least 8 byte aligned.  */
+	  if (align < 8)
+	    align = 8;
+
+	  bytes = FFI_ALIGN (bytes, align);
+	  e.offset = (unsigned) bytes;
+	  e.op[0] = UNIX64_ARG_STACK;
+	  e.reg[0] = e.reg[1] = 0;
+	  bytes += at->size;
+	}
+      else
+	{
+	  /* Unused eightbytes point at the next free GPR, so that a
+	     closure still has somewhere to read them from.  */
+	  e.offset = 0;
+	  e.reg[0] = e.reg[1]
+	    = offsetof (struct register_args, gpr) + gprcount * 8;
+
+	  /* Only SSEUP can produce more than two eightbytes, and
+	     classify_argument never generates it.  */
+	  FFI_ASSERT (n <= 2);
+	  for (j = 0; j < n; j++)
+	    {
+	      unsigned char op;
+
+	      switch (classes[j])
+		{
+		case X86_64_NO_CLASS:
+		case X86_64_SSEUP_CLASS:
+		  op = UNIX64_ARG_NONE;
+		  break;
+		case X86_64_INTEGER_CLASS:
+		case X86_64_INTEGERSI_CLASS:
+		  /* Sign-extend integer arguments passed in general
+		     purpose registers, to cope with the fact that
+		     LLVM incorrectly assumes that this will be done
+		     (the x86-64 PS ABI does not specify this). */
+		  switch (at->type)
+		    {
+		    case FFI_TYPE_SINT8:
+		      op = UNIX64_ARG_SINT8;
+		      break;
+		    case FFI_TYPE_SINT16:
+		      op = UNIX64_ARG_SINT16;
+		      break;
+		    case FFI_TYPE_SINT32:
+		      op = UNIX64_ARG_SINT32;
+		      break;
+		    default:
+		      op = UNIX64_ARG_INT;
+		    }
+		  e.reg[j] = offsetof (struct register_args, gpr)
+		    + gprcount++ * 8;
+		  break;
+		case X86_64_SSE_CLASS:
+		case X86_64_SSEDF_CLASS:
+		  op = UNIX64_ARG_SSE64;
+		  e.reg[j] = offsetof (struct register_args, sse)
+		    + ssecount++ * sizeof (union big_int_union);
+		  break;
+		case X86_64_SSESF_CLASS:
+		  op = UNIX64_ARG_SSE32;
+		  e.reg[j] = offsetof (struct register_args, sse)
+		    + ssecount++ * sizeof (union big_int_union);
+		  break;
+		default:
+		  abort ();
+		}
+	      e.op[j] = op;
+	    }
+	  if (n == 1)
+	    e.op[1] = UNIX64_ARG_NONE;
+	}
+
+      if (plan)
+	plan[i] = e;
+    }
+
+  *pbytes = bytes;
+  return ssecount;
+}
+
 /* Perform machine dependent cif processing.  */
 
 #ifndef __ILP32__
@@ -400,7 +516,7 @@ ffi_prep_cif_machdep_efi64(ffi_cif *cif);
 ffi_status FFI_HIDDEN
 ffi_prep_cif_machdep (ffi_cif *cif)
 {
-  int gprcount, ssecount, i, avn, ngpr, nsse;
+  int ssecount, ngpr, nsse;
   unsigned flags;
   enum x86_64_reg_class classes[MAX_CLASSES];
   size_t bytes, n, rtype_size;
@@ -413,8 +529,6 @@ ffi_prep_cif_machdep (ffi_cif *cif)
   if (cif->abi != FFI_UNIX64)
     return FFI_BAD_ABI;
 
-  gprcount = ssecount = 0;
-
   rtype = cif->rtype;
   rtype_size = rtype->size;
   switch (rtype->type)
@@ -464,9 +578,9 @@ ffi_prep_cif_machdep (ffi_cif *cif)
       if (n == 0)
 	{
 	  /* The return value is passed in memory.  A pointer to that
-	     memory is the first argument.  Allocate a register for it.  */
-	  gprcount++;
-	  /* We don't have to do anything in asm for the return.  */
+	     memory is the first argument; unix64_plan_args allocates a
+	     register for it.  We don't have to do anything in asm for
+	     the return.  */
 	  flags = UNIX64_RET_VOID | UNIX64_FLAG_RET_IN_MEM;
 	}
       else
@@ -526,37 +640,81 @@ ffi_prep_cif_machdep (ffi_cif *cif)
     }
 
   /* Go over all arguments and determine the way they should be passed.
-     If it's in a register and there is space for it, let that be so. If
-     not, add it's size to the stack byte count.  */
-  for (bytes = 0, i = 0, avn = cif->nargs; i < avn; i++)
-    {
-      if (examine_argument (cif->arg_types[i], classes, 0, &ngpr, &nsse) == 0
-	  || gprcount + ngpr > MAX_GPR_REGS
-	  || ssecount + nsse > MAX_SSE_REGS)
-	{
-	  long align = cif->arg_types[i]->alignment;
-
-	  if (align < 8)
-	    align = 8;
-
-	  bytes = FFI_ALIGN (bytes, align);
-	  bytes += cif->arg_types[i]->size;
-	}
-      else
-	{
-	  gprcount += ngpr;
-	  ssecount += nsse;
-	}
-    }
+     The resulting plan is kept in the cif, so that ffi_call and the
+     closure entry need not classify the arguments again.  */
+  cif->flags = flags;
+  ssecount = unix64_plan_args (cif, (cif->nargs <= FFI_UNIX64_PLAN_ARGS
+				     ? cif->unix64_plan : NULL), &bytes);
   if (ssecount)
     flags |= UNIX64_FLAG_XMM_ARGS;
 
   cif->flags = flags;
+  cif->unix64_nsse = ssecount;
   cif->bytes = (unsigned) FFI_ALIGN (bytes, 8);
 
   return FFI_OK;
 }
 
+/* Copy the arguments AVALUE into the register save area REG_ARGS and
+   the stack argument area ARGP, as described by PLAN.  */
+
+static inline void
+unix64_marshal (const ffi_unix64_arg *plan, int avn, void **avalue,
+		struct register_args *reg_args, char *argp)
+{
+  int i;
+
+  for (i = 0; i < avn; ++i)
+    {
+      const ffi_unix64_arg *e = &plan[i];
+      char *a = (char *) avalue[i];
+      unsigned int j;
+
+      if (e->op[0] == UNIX64_ARG_STACK)
+	{
+	  /* Pass this argument in memory.  */
+	  memcpy (argp + e->offset, a, e->size);
+	  continue;
+	}
+
+      /* The argument is passed entirely in registers.  */
+      for (j = 0; j < 2; j++, a += 8)
+	{
+	  char *r = (char *) reg_args + e->reg[j];
+
+	  switch (e->op[j])
+	    {
+	    case UNIX64_ARG_NONE:
+	      break;
+	    case UNIX64_ARG_SINT8:
+	      *(SINT64 *) r = (SINT64) *((SINT8 *) a);
+	      break;
+	    case UNIX64_ARG_SINT16:
+	      *(SINT64 *) r = (SINT64) *((SINT16 *) a);
+	      break;
+	    case UNIX64_ARG_SINT32:
+	      *(SINT64 *) r = (SINT64) *((SINT32 *) a);
+	      break;
+	    case UNIX64_ARG_INT:
+	      {
+		size_t size = e->size - j * 8;
+		*(UINT64 *) r = 0;
+		memcpy (r, a, size <= 8 ? size : 8);
+	      }
+	      break;
+	    case UNIX64_ARG_SSE64:
+	      memcpy (r, a, sizeof (UINT64));
+	      break;
+	    case UNIX64_ARG_SSE32:
+	      memcpy (r, a, sizeof (UINT32));
+	      break;
+	    default:
+	      abort ();
+	    }
+	}
+    }
+}
+
 /* n.b. ffi_call_unix64 will steal the alloca'd `stack` variable here for use
    _as its own stack_ - so we need to compile this function without ASAN */
 FFI_ASAN_NO_SANITIZE
@@ -564,10 +722,9 @@ static void
 ffi_call_int (ffi_cif *cif, void (*fn)(void), void *rvalue,
 	      void **avalue, void *closure)
 {
-  enum x86_64_reg_class classes[MAX_CLASSES];
+  const ffi_unix64_arg *plan;
   char *stack, *argp;
-  ffi_type **arg_types;
-  int gprcount, ssecount, ngpr, nsse, i, avn, flags;
+  int ssecount, avn, flags;
   struct register_args *reg_args;
 
   /* Can't call 32-bit mode from 64-bit mode.  */
@@ -584,9 +741,23 @@ ffi_call_int (ffi_cif *cif, void (*fn)(void), void *rvalue,
 	flags = UNIX64_RET_VOID;
     }
 
-  arg_types = cif->arg_types;
   avn = cif->nargs;
 
+  /* Cifs with too many arguments to keep a plan build it here.  */
+  if (avn <= FFI_UNIX64_PLAN_ARGS)
+    {
+      plan = cif->unix64_plan;
+      ssecount = cif->unix64_nsse;
+    }
+  else
+    {
+      ffi_unix64_arg *p = alloca (avn * sizeof (ffi_unix64_arg));
+      size_t bytes;
+
+      ssecount = unix64_plan_args (cif, p, &bytes);
+      plan = p;
+    }
+
   /* Allocate the space for the arguments, plus 4 words of temp space.  */
   stack = alloca (sizeof (struct register_args) + cif->bytes + 4*8);
   reg_args = (struct register_args *) stack;
@@ -594,83 +765,12 @@ ffi_call_int (ffi_cif *cif, void (*fn)(void), void *rvalue,
 
   reg_args->r10 = (uintptr_t) closure;
 
-  gprcount = ssecount = 0;
-
   /* If the return value is passed in memory, add the pointer as the
      first integer argument.  */
   if (flags & UNIX64_FLAG_RET_IN_MEM)
-    reg_args->gpr[gprcount++] = (unsigned long) rvalue;
-
-  for (i = 0; i < avn; ++i)
-    {
-      size_t n, size = arg_types[i]->size;
+    reg_args->gpr[0] = (unsigned long) rvalue;
 
-      n = examine_argument (arg_types[i], classes, 0, &ngpr, &nsse);
-      if (n == 0
-	  || gprcount + ngpr > MAX_GPR_REGS
-	  || ssecount + nsse > MAX_SSE_REGS)
-	{
-	  long align = arg_types[i]->alignment;
-
-	  /* Stack arguments are *always* at least 8 byte aligned.  */
-	  if (align < 8)
-	    align = 8;
-
-          /* Pass this argument in memory.  */
-          argp = (void *) FFI_ALIGN (argp, align);
-          memcpy (argp, avalue[i], size);
-
-          argp += size;
-        }
-      else
-	{
-	  /* The argument is passed entirely in registers.  */
-	  char *a = (char *) avalue[i];
-	  unsigned int j;
-
-	  for (j = 0; j < n; j++, a += 8, size -= 8)
-	    {
-	      switch (classes[j])
-		{
-		case X86_64_NO_CLASS:
-		case X86_64_SSEUP_CLASS:
-		  break;
-		case X86_64_INTEGER_CLASS:
-		case X86_64_INTEGERSI_CLASS:
-		  /* Sign-extend integer arguments passed in general
-		     purpose registers, to cope with the fact that
-		     LLVM incorrectly assumes that this will be done
-		     (the x86-64 PS ABI does not specify this). */
-		  switch (arg_types[i]->type)
-		    {
-		    case FFI_TYPE_SINT8:
-		      reg_args->gpr[gprcount] = (SINT64) *((SINT8 *) a);
-		      break;
-		    case FFI_TYPE_SINT16:
-		      reg_args->gpr[gprcount] = (SINT64) *((SINT16 *) a);
-		      break;
-		    case FFI_TYPE_SINT32:
-		      reg_args->gpr[gprcount] = (SINT64) *((SINT32 *) a);
-		      break;
-		    default:
-		      reg_args->gpr[gprcount] = 0;
-		      memcpy (&reg_args->gpr[gprcount], a, size <= 8 ? size : 8);
-		    }
-		  gprcount++;
-		  break;
-		case X86_64_SSE_CLASS:
-		case X86_64_SSEDF_CLASS:
-		  memcpy (&reg_args->sse[ssecount++].i64, a, sizeof(UINT64));
-		  break;
-		case X86_64_SSESF_CLASS:
-		  memcpy (&reg_args->sse[ssecount++].i32, a, sizeof(UINT32));
-		  break;
-		default:
-		  abort();
-		}
-	    }
-	}
-    }
+  unix64_marshal (plan, avn, avalue, reg_args, argp);
   reg_args->rax = ssecount;
 
   ffi_call_unix64 (stack, cif->bytes + sizeof (struct register_args),
@@ -713,6 +813,125 @@ ffi_call (ffi_cif *cif, void (*fn)(void), void *rvalue, void **avalue)
   ffi_call_int (cif, fn, rvalue, avalue, NULL);
 }
 
+/* Make one call of unix64_call_n, with the plan PLAN.  ffi_call_unix64
+   returns with the stack pointer at the top of the area it was given,
+   so the area cannot be kept for the next call: its arguments would be
+   stored below the stack pointer, where a signal handler may overwrite
+   them.  This function allocates the area afresh each time, and its
+   return restores the stack pointer.  */
+FFI_ASAN_NO_SANITIZE __attribute__ ((noinline))
+static void
+unix64_call_one (ffi_cif *cif, void (*fn)(void), const ffi_unix64_arg *plan,
+		 int ssecount, int flags, void *rvalue, void **avalue)
+{
+  struct register_args *reg_args;
+  char *stack;
+
+  stack = alloca (sizeof (struct register_args) + cif->bytes + 4*8);
+  reg_args = (struct register_args *) stack;
+
+  if (flags & UNIX64_FLAG_RET_IN_MEM)
+    reg_args->gpr[0] = (unsigned long) rvalue;
+
+  unix64_marshal (plan, cif->nargs, avalue, reg_args,
+		  stack + sizeof (struct register_args));
+  reg_args->rax = ssecount;
+  reg_args->r10 = 0;
+
+  ffi_call_unix64 (stack, cif->bytes + sizeof (struct register_args),
+		   flags, rvalue, fn);
+}
+
+/* As ffi_call_int, for N calls.  The plan and the return value handling
+   are set up once; each call then only marshals its arguments and
+   enters ffi_call_unix64.  Call K takes its arguments from AVALUES[K] if
+   AVALUES is non-null, and otherwise from the columns
+   BASE[i] + K * STRIDE[i].  Its return value goes to RVALUES[K] if
+   RVALUES is non-null, and otherwise to OUT + K * OUT_STRIDE.  */
+
+static void
+unix64_call_n (ffi_cif *cif, void (*fn)(void), size_t n, void **rvalues,
+	       void ***avalues, const void **base, const size_t *stride,
+	       char *out, size_t out_stride)
+{
+  const ffi_unix64_arg *plan;
+  void *scratch = NULL;
+  void **row = NULL;
+  int ssecount, avn, flags, i;
+  size_t k;
+
+  avn = cif->nargs;
+  if (avalues == NULL)
+    row = alloca (avn * sizeof (void *));
+
+  if (cif->abi != FFI_UNIX64)
+    {
+      for (k = 0; k < n; k++)
+	{
+	  void **avalue = avalues ? avalues[k] : row;
+	  void *rvalue = rvalues ? rvalues[k] : out ? out + k * out_stride : NULL;
+
+	  for (i = 0; row && i < avn; i++)
+	    row[i] = (char *) base[i] + k * stride[i];
+	  ffi_call (cif, fn, rvalue, avalue);
+	}
+      return;
+    }
+
+  flags = cif->flags;
+  if (flags & UNIX64_FLAG_RET_IN_MEM)
+    scratch = alloca (cif->rtype->size);
+
+  if (avn <= FFI_UNIX64_PLAN_ARGS)
+    {
+      plan = cif->unix64_plan;
+      ssecount = cif->unix64_nsse;
+    }
+  else
+    {
+      ffi_unix64_arg *p = alloca (avn * sizeof (ffi_unix64_arg));
+      size_t bytes;
+
+      ssecount = unix64_plan_args (cif, p, &bytes);
+      plan = p;
+    }
+
+  for (k = 0; k < n; k++)
+    {
+      void **avalue = avalues ? avalues[k] : row;
+      void *rvalue = rvalues ? rvalues[k] : out ? out + k * out_stride : NULL;
+      int f = flags;
+
+      if (flags & UNIX64_FLAG_RET_IN_MEM)
+	{
+	  if (rvalue == NULL)
+	    rvalue = scratch;
+	}
+      else if (rvalue == NULL)
+	f = UNIX64_RET_VOID;
+
+      for (i = 0; row && i < avn; i++)
+	row[i] = (char *) base[i] + k * stride[i];
+
+      unix64_call_one (cif, fn, plan, ssecount, f, rvalue, avalue);
+    }
+}
+
+void
+ffi_call_batch (ffi_cif *cif, void (*fn)(void), size_t n, void **rvalues,
+		void ***avalues)
+{
+  unix64_call_n (cif, fn, n, rvalues, avalues, NULL, NULL, NULL, 0);
+}
+
+void
+ffi_call_strided (ffi_cif *cif, void (*fn)(void), size_t n,
+		  const void *base[], const size_t stride[],
+		  void *out, size_t out_stride)
+{
+  unix64_call_n (cif, fn, n, NULL, NULL, base, stride, out, out_stride);
+}
+
 #ifdef FFI_GO_CLOSURES
 
 #ifndef __ILP32__
@@ -737,53 +956,688 @@ ffi_call_go (ffi_cif *cif, void (*fn)(void), void *rvalue,
 
 #endif /* FFI_GO_CLOSURES */
 
-extern void ffi_closure_unix64(void) FFI_HIDDEN;
-extern void ffi_closure_unix64_sse(void) FFI_HIDDEN;
-#if defined(FFI_EXEC_STATIC_TRAMP)
-extern void ffi_closure_unix64_alt(void) FFI_HIDDEN;
-extern void ffi_closure_unix64_sse_alt(void) FFI_HIDDEN;
-#endif
+#ifdef FFI_BOUND_CALLS
 
-#ifndef __ILP32__
-extern ffi_status
-ffi_prep_closure_loc_efi64(ffi_closure* closure,
-			   ffi_cif* cif,
-			   void (*fun)(ffi_cif*, void*, void**, void*),
-			   void *user_data,
-			   void *codeloc);
-#endif
+/* A bound call stub is ffi_call_int and ffi_call_unix64 specialised for
+   one cif and one function.  The argument plan becomes straight-line
+   code that loads each argument from AVALUE into its register or
+   outgoing stack slot, then the function is called directly and the
+   return value stored as the flags dictate.  The stub keeps an ordinary
+   frame (push %rbp; mov %rsp,%rbp; push %rbx), with RVALUE in %rbx,
+   AVALUE in %r11 and the current argument in %r10.  A scratch area above
+   the outgoing arguments assembles odd-sized eightbytes and structures
+   returned in registers, and receives a structure returned in memory
+   when RVALUE is NULL.  */
 
-ffi_status
-ffi_prep_closure_loc (ffi_closure* closure,
-		      ffi_cif* cif,
-		      void (*fun)(ffi_cif*, void*, void**, void*),
-		      void *user_data,
-		      void *codeloc)
+enum
 {
-  static const unsigned char trampoline[24] = {
-    /* endbr64 */
-    0xf3, 0x0f, 0x1e, 0xfa,
-    /* leaq  -0xb(%rip),%r10   # 0x0  */
-    0x4c, 0x8d, 0x15, 0xf5, 0xff, 0xff, 0xff,
-    /* jmpq  *0x7(%rip)        # 0x18 */
-    0xff, 0x25, 0x07, 0x00, 0x00, 0x00,
-    /* nopl  0(%rax) */
-    0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00
-  };
-  void (*dest)(void);
-  char *tramp = closure->tramp;
+  R_RAX = 0, R_RCX = 1, R_RDX = 2, R_RBX = 3, R_RSP = 4, R_RBP = 5,
+  R_RSI = 6, R_RDI = 7, R_R8 = 8, R_R9 = 9, R_R10 = 10, R_R11 = 11
+};
 
-#ifndef __ILP32__
-  if (cif->abi == FFI_EFI64 || cif->abi == FFI_GNUW64)
-    return ffi_prep_closure_loc_efi64(closure, cif, fun, user_data, codeloc);
-#endif
-  if (cif->abi != FFI_UNIX64)
-    return FFI_BAD_ABI;
+static const unsigned char bound_gpr[MAX_GPR_REGS] = {
+  R_RDI, R_RSI, R_RDX, R_RCX, R_R8, R_R9
+};
 
-  if (cif->flags & UNIX64_FLAG_XMM_ARGS)
-    dest = ffi_closure_unix64_sse;
+struct bound_emitter
+{
+  unsigned char *p;	/* NULL while sizing the stub.  */
+  size_t n;
+  size_t cfi[4];	/* Ends of the three prologue insns, and the ret.  */
+};
+
+/* What to generate: a bound call of FN, or a direct closure calling FN
+   with the arguments laid out at OFFSETS and USER_DATA.  */
+struct bound_stub
+{
+  ffi_cif *cif;
+  const ffi_unix64_arg *plan;
+  int nsse;
+  void (*fn)(void);
+  void *user_data;
+  const unsigned *offsets;
+  size_t frame, scratch;
+};
+
+static void
+emit_byte (struct bound_emitter *e, unsigned b)
+{
+  if (e->p)
+    e->p[e->n] = (unsigned char) b;
+  e->n++;
+}
+
+static void
+emit_bytes (struct bound_emitter *e, const char *s, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    emit_byte (e, (unsigned char) s[i]);
+}
+
+#define EMIT(e, s) emit_bytes (e, s, sizeof (s) - 1)
+
+static void
+emit_imm (struct bound_emitter *e, UINT64 v, unsigned n)
+{
+  unsigned i;
+
+  for (i = 0; i < n; i++)
+    emit_byte (e, (v >> (i * 8)) & 0xff);
+}
+
+/* Patch the byte at POS, a rel8 branch operand, to jump here.  */
+static void
+patch_rel8 (struct bound_emitter *e, size_t pos)
+{
+  FFI_ASSERT (e->n - pos - 1 < 128);
+  if (e->p)
+    e->p[pos] = (unsigned char) (e->n - pos - 1);
+}
+
+/* Emit OP with register operand REG and memory operand DISP(BASE),
+   always using a 32-bit displacement.  OP values above 0xff are 0x0f
+   opcodes, PFX is a mandatory prefix (or 0) and W selects a 64-bit
+   operand size.  */
+static void
+emit_mem (struct bound_emitter *e, unsigned pfx, int w, unsigned op,
+	  unsigned reg, unsigned base, size_t disp)
+{
+  unsigned rex = (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+
+  if (pfx)
+    emit_byte (e, pfx);
+  if (rex)
+    emit_byte (e, 0x40 | rex);
+  if (op > 0xff)
+    emit_byte (e, op >> 8);
+  emit_byte (e, op & 0xff);
+  emit_byte (e, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == R_RSP)
+    emit_byte (e, 0x24);
+  emit_imm (e, disp, 4);
+}
+
+/* Copy SIZE bytes from SDISP(SBASE) to DDISP(DBASE) through %rax,
+   without touching memory outside either object.  */
+static void
+emit_copy (struct bound_emitter *e, unsigned dbase, size_t ddisp,
+	   unsigned sbase, size_t sdisp, size_t size)
+{
+  while (size > 0)
+    {
+      size_t n = size >= 8 ? 8 : size >= 4 ? 4 : size >= 2 ? 2 : 1;
+      unsigned pfx = n == 2 ? 0x66 : 0;
+
+      emit_mem (e, pfx, n == 8, n == 1 ? 0x8a : 0x8b, R_RAX, sbase, sdisp);
+      emit_mem (e, pfx, n == 8, n == 1 ? 0x88 : 0x89, R_RAX, dbase, ddisp);
+      size -= n;
+      sdisp += n;
+      ddisp += n;
+    }
+}
+
+/* Load eightbyte J of the argument at %r10 as ffi_call_int would store
+   it into the register save area.  */
+static void
+emit_load_eightbyte (struct bound_emitter *e, const ffi_unix64_arg *a,
+		     unsigned j, size_t scratch)
+{
+  size_t disp = j * 8, size;
+  unsigned r;
+
+  if (a->op[j] == UNIX64_ARG_SSE32 || a->op[j] == UNIX64_ARG_SSE64)
+    {
+      r = (a->reg[j] - offsetof (struct register_args, sse))
+	  / sizeof (union big_int_union);
+      if (a->op[j] == UNIX64_ARG_SSE32)
+	emit_mem (e, 0x66, 0, 0x0f6e, r, R_R10, disp);	/* movd */
+      else
+	emit_mem (e, 0xf3, 0, 0x0f7e, r, R_R10, disp);	/* movq */
+      return;
+    }
+
+  r = bound_gpr[(a->reg[j] - offsetof (struct register_args, gpr)) / 8];
+  switch (a->op[j])
+    {
+    case UNIX64_ARG_SINT8:
+      emit_mem (e, 0, 1, 0x0fbe, r, R_R10, disp);	/* movsbq */
+      break;
+    case UNIX64_ARG_SINT16:
+      emit_mem (e, 0, 1, 0x0fbf, r, R_R10, disp);	/* movswq */
+      break;
+    case UNIX64_ARG_SINT32:
+      emit_mem (e, 0, 1, 0x63, r, R_R10, disp);		/* movslq */
+      break;
+    case UNIX64_ARG_INT:
+      size = a->size - disp;
+      switch (size < 8 ? size : 8)
+	{
+	case 8:
+	  emit_mem (e, 0, 1, 0x8b, r, R_R10, disp);	/* movq */
+	  break;
+	case 4:
+	  emit_mem (e, 0, 0, 0x8b, r, R_R10, disp);	/* movl */
+	  break;
+	case 2:
+	  emit_mem (e, 0, 0, 0x0fb7, r, R_R10, disp);	/* movzwl */
+	  break;
+	case 1:
+	  emit_mem (e, 0, 0, 0x0fb6, r, R_R10, disp);	/* movzbl */
+	  break;
+	default:
+	  /* Zero-extend odd sizes through the scratch area.  */
+	  emit_mem (e, 0, 1, 0xc7, 0, R_RSP, scratch);	/* movq $0 */
+	  emit_imm (e, 0, 4);
+	  emit_copy (e, R_RSP, scratch, R_R10, disp, size);
+	  emit_mem (e, 0, 1, 0x8b, r, R_RSP, scratch);
+	  break;
+	}
+      break;
+    default:
+      abort ();
+    }
+}
+
+/* Store the value returned in registers to (%rbx), following the
+   store table of ffi_call_unix64.  */
+static void
+emit_store_return (struct bound_emitter *e, unsigned flags, size_t scratch)
+{
+  switch (flags & UNIX64_RET_LAST)
+    {
+    case UNIX64_RET_UINT8:
+      EMIT (e, "\x0f\xb6\xc0");		/* movzbl %al,%eax */
+      goto int64;
+    case UNIX64_RET_UINT16:
+      EMIT (e, "\x0f\xb7\xc0");		/* movzwl %ax,%eax */
+      goto int64;
+    case UNIX64_RET_UINT32:
+      EMIT (e, "\x89\xc0");		/* movl %eax,%eax */
+      goto int64;
+    case UNIX64_RET_SINT8:
+      EMIT (e, "\x48\x0f\xbe\xc0");	/* movsbq %al,%rax */
+      goto int64;
+    case UNIX64_RET_SINT16:
+      EMIT (e, "\x48\x0f\xbf\xc0");	/* movswq %ax,%rax */
+      goto int64;
+    case UNIX64_RET_SINT32:
+      EMIT (e, "\x48\x98");		/* cltq */
+      /* FALLTHRU */
+    case UNIX64_RET_INT64:
+    int64:
+      emit_mem (e, 0, 1, 0x89, R_RAX, R_RBX, 0);
+      break;
+    case UNIX64_RET_XMM32:
+      emit_mem (e, 0x66, 0, 0x0f7e, 0, R_RBX, 0);	/* movd %xmm0 */
+      break;
+    case UNIX64_RET_XMM64:
+      emit_mem (e, 0x66, 0, 0x0fd6, 0, R_RBX, 0);	/* movq %xmm0 */
+      break;
+    case UNIX64_RET_X87:
+      emit_mem (e, 0, 0, 0xdb, 7, R_RBX, 0);		/* fstpt */
+      break;
+    case UNIX64_RET_X87_2:
+      /* The real part is on top of the x87 stack.  */
+      emit_mem (e, 0, 0, 0xdb, 7, R_RBX, 0);		/* fstpt */
+      emit_mem (e, 0, 0, 0xdb, 7, R_RBX, 16);		/* fstpt */
+      break;
+    case UNIX64_RET_ST_XMM0_RAX:
+      emit_mem (e, 0x66, 0, 0x0fd6, 0, R_RSP, scratch);
+      emit_mem (e, 0, 1, 0x89, R_RAX, R_RSP, scratch + 8);
+      goto struct_copy;
+    case UNIX64_RET_ST_RAX_XMM0:
+      emit_mem (e, 0, 1, 0x89, R_RAX, R_RSP, scratch);
+      emit_mem (e, 0x66, 0, 0x0fd6, 0, R_RSP, scratch + 8);
+      goto struct_copy;
+    case UNIX64_RET_ST_XMM0_XMM1:
+      emit_mem (e, 0x66, 0, 0x0fd6, 0, R_RSP, scratch);
+      emit_mem (e, 0x66, 0, 0x0fd6, 1, R_RSP, scratch + 8);
+      goto struct_copy;
+    case UNIX64_RET_ST_RAX_RDX:
+      emit_mem (e, 0, 1, 0x89, R_RAX, R_RSP, scratch);
+      emit_mem (e, 0, 1, 0x89, R_RDX, R_RSP, scratch + 8);
+    struct_copy:
+      emit_copy (e, R_RBX, 0, R_RSP, scratch, flags >> UNIX64_SIZE_SHIFT);
+      break;
+    default:
+      abort ();
+    }
+}
+
+/* Both kinds of stub share one frame layout, which the unwind info
+   below describes.  */
+static void
+emit_prologue (struct bound_emitter *e, size_t frame)
+{
+#ifdef ENDBR_PRESENT
+  EMIT (e, "\xf3\x0f\x1e\xfa");		/* endbr64 */
+#endif
+  EMIT (e, "\x55");			/* push %rbp */
+  e->cfi[0] = e->n;
+  EMIT (e, "\x48\x89\xe5");		/* mov %rsp,%rbp */
+  e->cfi[1] = e->n;
+  EMIT (e, "\x53");			/* push %rbx */
+  e->cfi[2] = e->n;
+  EMIT (e, "\x48\x81\xec");		/* sub $frame,%rsp */
+  emit_imm (e, frame, 4);
+}
+
+static void
+emit_epilogue (struct bound_emitter *e)
+{
+  EMIT (e, "\x48\x8d\x65\xf8");		/* lea -8(%rbp),%rsp */
+  EMIT (e, "\x5b\x5d");			/* pop %rbx; pop %rbp */
+  e->cfi[3] = e->n;
+  EMIT (e, "\xc3");			/* ret */
+}
+
+static void
+bound_emit_code (struct bound_emitter *e, const struct bound_stub *s)
+{
+  const ffi_unix64_arg *plan = s->plan;
+  size_t scratch = s->scratch;
+  unsigned flags = s->cif->flags, ret = flags & UNIX64_RET_LAST;
+  unsigned i, j;
+
+  emit_prologue (e, s->frame);
+  EMIT (e, "\x48\x89\xfb");		/* mov %rdi,%rbx */
+  EMIT (e, "\x49\x89\xf3");		/* mov %rsi,%r11 */
+
+  for (i = 0; i < s->cif->nargs; i++)
+    {
+      const ffi_unix64_arg *a = &plan[i];
+
+      emit_mem (e, 0, 1, 0x8b, R_R10, R_R11, i * sizeof (void *));
+      if (a->op[0] == UNIX64_ARG_STACK)
+	emit_copy (e, R_RSP, a->offset, R_R10, 0, a->size);
+      else
+	for (j = 0; j < 2; j++)
+	  if (a->op[j] != UNIX64_ARG_NONE)
+	    emit_load_eightbyte (e, a, j, scratch);
+    }
+
+  if (flags & UNIX64_FLAG_RET_IN_MEM)
+    {
+      EMIT (e, "\x48\x89\xdf");		/* mov %rbx,%rdi */
+      EMIT (e, "\x48\x85\xdb\x75\x08");	/* test %rbx,%rbx; jnz 1f */
+      emit_mem (e, 0, 1, 0x8d, R_RDI, R_RSP, scratch);	/* lea */
+    }
+
+  EMIT (e, "\xb8");			/* mov $nsse,%eax */
+  emit_imm (e, s->nsse, 4);
+  EMIT (e, "\x49\xbb");			/* movabs $fn,%r11 */
+  emit_imm (e, (uintptr_t) s->fn, 8);
+  EMIT (e, "\x41\xff\xd3");		/* call *%r11 */
+
+  if (ret != UNIX64_RET_VOID)
+    {
+      size_t skip, done;
+
+      EMIT (e, "\x48\x85\xdb\x74");	/* test %rbx,%rbx; jz 1f */
+      skip = e->n;
+      emit_byte (e, 0);
+      emit_store_return (e, flags, scratch);
+      if (ret == UNIX64_RET_X87 || ret == UNIX64_RET_X87_2)
+	{
+	  /* The x87 stack must be popped even if nothing is stored.  */
+	  EMIT (e, "\xeb");		/* jmp 2f */
+	  done = e->n;
+	  emit_byte (e, 0);
+	  patch_rel8 (e, skip);
+	  EMIT (e, "\xdd\xd8");		/* fstp %st(0) */
+	  if (ret == UNIX64_RET_X87_2)
+	    EMIT (e, "\xdd\xd8");
+	  patch_rel8 (e, done);
+	}
+      else
+	patch_rel8 (e, skip);
+    }
+
+  emit_epilogue (e);
+}
+
+/* Store eightbyte J of the incoming argument A to DISP(%rsp).  */
+static void
+emit_store_eightbyte (struct bound_emitter *e, const ffi_unix64_arg *a,
+		      unsigned j, size_t disp)
+{
+  size_t size = a->size - j * 8;
+  unsigned r;
+
+  if (a->op[j] == UNIX64_ARG_SSE32 || a->op[j] == UNIX64_ARG_SSE64)
+    {
+      r = (a->reg[j] - offsetof (struct register_args, sse))
+	  / sizeof (union big_int_union);
+      if (a->op[j] == UNIX64_ARG_SSE32 || size == 4)
+	emit_mem (e, 0x66, 0, 0x0f7e, r, R_RSP, disp);	/* movd */
+      else
+	emit_mem (e, 0x66, 0, 0x0fd6, r, R_RSP, disp);	/* movq */
+      return;
+    }
+
+  r = bound_gpr[(a->reg[j] - offsetof (struct register_args, gpr)) / 8];
+  switch (size < 8 ? size : 8)
+    {
+    case 8:
+      emit_mem (e, 0, 1, 0x89, r, R_RSP, disp);
+      break;
+    case 4:
+      emit_mem (e, 0, 0, 0x89, r, R_RSP, disp);
+      break;
+    case 2:
+      emit_mem (e, 0x66, 0, 0x89, r, R_RSP, disp);
+      break;
+    default:
+      /* Store the remaining bytes one piece at a time from %rax.  */
+      emit_byte (e, 0x48 | (r & 8 ? 4 : 0));
+      emit_byte (e, 0x89);
+      emit_byte (e, 0xc0 | (r & 7) << 3);	/* mov %r,%rax */
+      while (size > 0)
+	{
+	  size_t n = size >= 4 ? 4 : size >= 2 ? 2 : 1;
+
+	  emit_mem (e, n == 2 ? 0x66 : 0, 0, n == 1 ? 0x88 : 0x89,
+		    R_RAX, R_RSP, disp);
+	  size -= n;
+	  disp += n;
+	  if (size > 0)
+	    {
+	      EMIT (e, "\x48\xc1\xe8");	/* shr $n*8,%rax */
+	      emit_byte (e, n * 8);
+	    }
+	}
+      break;
+    }
+}
+
+static void
+emit_movabs (struct bound_emitter *e, unsigned reg, UINT64 imm)
+{
+  emit_byte (e, 0x48 | (reg & 8 ? 1 : 0));
+  emit_byte (e, 0xb8 | (reg & 7));
+  emit_imm (e, imm, 8);
+}
+
+/* A direct closure stores every incoming argument at its offset in a
+   buffer at the bottom of the frame, then calls
+   FN (buffer, user_data), passing through the hidden return pointer.
+   FN has the closure's return type, so whatever it leaves in the
+   return registers is the closure's return value.  */
+static void
+direct_emit_code (struct bound_emitter *e, const struct bound_stub *s)
+{
+  const ffi_unix64_arg *plan = s->plan;
+  unsigned i, j, arg0 = R_RDI, arg1 = R_RSI;
+
+  emit_prologue (e, s->frame);
+
+  for (i = 0; i < s->cif->nargs; i++)
+    {
+      const ffi_unix64_arg *a = &plan[i];
+
+      if (a->op[0] == UNIX64_ARG_STACK)
+	emit_copy (e, R_RSP, s->offsets[i], R_RBP, 16 + a->offset, a->size);
+      else
+	for (j = 0; j < 2; j++)
+	  if (a->op[j] != UNIX64_ARG_NONE)
+	    emit_store_eightbyte (e, a, j, s->offsets[i] + j * 8);
+    }
+
+  if (s->cif->flags & UNIX64_FLAG_RET_IN_MEM)
+    {
+      /* %rdi still holds the return pointer.  */
+      arg0 = R_RSI;
+      arg1 = R_RDX;
+    }
+  emit_mem (e, 0, 1, 0x8d, arg0, R_RSP, 0);	/* lea (%rsp),arg0 */
+  emit_movabs (e, arg1, (uintptr_t) s->user_data);
+  emit_movabs (e, R_R11, (uintptr_t) s->fn);
+  EMIT (e, "\x41\xff\xd3");		/* call *%r11 */
+
+  emit_epilogue (e);
+}
+
+/* Emit .eh_frame data describing the stub CODE, of which C is the
+   emitter: one CIE and one FDE, followed by the zero terminator that
+   __register_frame expects.  */
+static void
+bound_emit_eh_frame (struct bound_emitter *e, const struct bound_emitter *c,
+		     uintptr_t code)
+{
+  size_t start;
+
+  /* CIE: version 1, no augmentation, code alignment 1, data alignment
+     -8, return address in column 16 and CFA = %rsp + 8 at entry.  */
+  emit_imm (e, 20, 4);
+  emit_imm (e, 0, 4);
+  EMIT (e, "\x01\0\x01\x78\x10");
+  EMIT (e, "\x0c\x07\x08\x90\x01");	/* def_cfa %rsp,8; offset ra,-8 */
+  while (e->n < 24)
+    emit_byte (e, 0);			/* nop */
+
+  /* FDE.  */
+  start = e->n;
+  emit_imm (e, 0, 4);			/* length, patched below */
+  emit_imm (e, e->n, 4);		/* CIE pointer */
+  emit_imm (e, code, 8);
+  emit_imm (e, c->n, 8);
+  emit_byte (e, 0x40 | c->cfi[0]);	/* advance_loc */
+  EMIT (e, "\x0e\x10\x86\x02");		/* def_cfa_offset 16; offset %rbp,-16 */
+  emit_byte (e, 0x40 | (c->cfi[1] - c->cfi[0]));
+  EMIT (e, "\x0d\x06");			/* def_cfa_register %rbp */
+  emit_byte (e, 0x40 | (c->cfi[2] - c->cfi[1]));
+  EMIT (e, "\x83\x03");			/* offset %rbx,-24 */
+  emit_byte (e, 0x04);			/* advance_loc4 */
+  emit_imm (e, c->cfi[3] - c->cfi[2], 4);
+  EMIT (e, "\x0c\x07\x08");		/* def_cfa %rsp,8 */
+  while ((e->n - start) % 8)
+    emit_byte (e, 0);
+  if (e->p)
+    {
+      UINT32 length = (UINT32) (e->n - start - 4);
+      memcpy (e->p + start, &length, 4);
+    }
+
+  emit_imm (e, 0, 4);			/* terminator */
+}
+
+/* Generate the stub S with EMIT, followed by its unwind info, and
+   return it in *CODE.  NAME is the name profilers show for it.  */
+static ffi_status
+bound_finish (void (*emit) (struct bound_emitter *,
+			    const struct bound_stub *),
+	      const struct bound_stub *s, const char *name, void **code)
+{
+  struct bound_emitter c, eh;
+  size_t eh_offset;
+  unsigned char *p, *x;
+
+  if (s->frame > 0x7fff0000)
+    return FFI_BAD_TYPEDEF;
+
+  /* Size the stub and its unwind info, then emit both for real.  */
+  memset (&c, 0, sizeof (c));
+  memset (&eh, 0, sizeof (eh));
+  emit (&c, s);
+  bound_emit_eh_frame (&eh, &c, 0);
+
+  eh_offset = FFI_ALIGN (c.n, 8);
+  p = ffi_code_alloc (eh_offset + eh.n, (void **) &x);
+  if (p == NULL)
+    return FFI_BAD_ABI;
+
+  /* The code is written at P and runs at X.  */
+  c.p = p;
+  c.n = 0;
+  emit (&c, s);
+  eh.p = p + eh_offset;
+  eh.n = 0;
+  bound_emit_eh_frame (&eh, &c, (uintptr_t) x);
+
+  if (ffi_code_seal (x, c.n, x + eh_offset, name) != 0)
+    {
+      ffi_code_free (x);
+      return FFI_BAD_ABI;
+    }
+
+  *code = x;
+  return FFI_OK;
+}
+
+/* Fill in the plan of S, computing it into Q if CIF has too many
+   arguments to keep one.  */
+static void
+bound_plan (struct bound_stub *s, ffi_cif *cif, ffi_unix64_arg *q)
+{
+  s->cif = cif;
+  if (cif->nargs <= FFI_UNIX64_PLAN_ARGS)
+    {
+      s->plan = cif->unix64_plan;
+      s->nsse = cif->unix64_nsse;
+    }
   else
-    dest = ffi_closure_unix64;
+    {
+      size_t bytes;
+
+      s->nsse = unix64_plan_args (cif, q, &bytes);
+      s->plan = q;
+    }
+}
+
+ffi_status
+ffi_prep_bound_call (ffi_cif *cif, void (*fn)(void), ffi_bound_fn *stub)
+{
+  struct bound_stub s;
+  ffi_status status;
+  void *code;
+  size_t size;
+
+  if (cif->abi != FFI_UNIX64)
+    return FFI_BAD_ABI;
+
+  memset (&s, 0, sizeof (s));
+  bound_plan (&s, cif, (cif->nargs > FFI_UNIX64_PLAN_ARGS
+			? alloca (cif->nargs * sizeof (ffi_unix64_arg))
+			: NULL));
+  s.fn = fn;
+
+  /* The scratch area follows the outgoing arguments; the frame keeps
+     %rsp 16-byte aligned at the call, after pushing %rbp and %rbx.  */
+  s.scratch = FFI_ALIGN (cif->bytes, 16);
+  size = 16;
+  if ((cif->flags & UNIX64_FLAG_RET_IN_MEM) && cif->rtype->size > size)
+    size = FFI_ALIGN (cif->rtype->size, 16);
+  s.frame = s.scratch + size + 8;
+
+  status = bound_finish (bound_emit_code, &s, "ffi_bound_call", &code);
+  if (status == FFI_OK)
+    *stub = (ffi_bound_fn) (uintptr_t) code;
+  return status;
+}
+
+void
+ffi_bound_call_free (ffi_bound_fn stub)
+{
+  if (stub)
+    ffi_code_free ((void *) (uintptr_t) stub);
+}
+
+#ifdef FFI_DIRECT_CLOSURES
+
+ffi_status
+ffi_prep_direct_closure (ffi_cif *cif, const unsigned *offsets,
+			 void (*fun)(void), void *user_data, void **code)
+{
+  struct bound_stub s;
+  unsigned *packed = NULL;
+  size_t size = 0;
+  unsigned i;
+
+  if (cif->abi != FFI_UNIX64)
+    return FFI_BAD_ABI;
+
+  memset (&s, 0, sizeof (s));
+  bound_plan (&s, cif, (cif->nargs > FFI_UNIX64_PLAN_ARGS
+			? alloca (cif->nargs * sizeof (ffi_unix64_arg))
+			: NULL));
+  s.fn = fun;
+  s.user_data = user_data;
+
+  /* Without explicit offsets, lay the arguments out as the members of
+     a structure would be.  */
+  if (offsets == NULL)
+    packed = alloca (cif->nargs * sizeof (unsigned));
+  for (i = 0; i < cif->nargs; i++)
+    {
+      ffi_type *at = cif->arg_types[i];
+      size_t offset;
+
+      if (packed)
+	packed[i] = (unsigned) FFI_ALIGN (size, at->alignment);
+      offset = packed ? packed[i] : offsets[i];
+      if (offset > 0x7fff0000 || offset + at->size > 0x7fff0000)
+	return FFI_BAD_TYPEDEF;
+      if (offset + at->size > size)
+	size = offset + at->size;
+    }
+  s.offsets = packed ? packed : offsets;
+
+  /* The buffer is at the bottom of the frame; keep %rsp 16-byte
+     aligned at the call, after pushing %rbp and %rbx.  */
+  s.frame = FFI_ALIGN (size, 16) + 8;
+
+  return bound_finish (direct_emit_code, &s, "ffi_direct_closure", code);
+}
+
+void
+ffi_direct_closure_free (void *code)
+{
+  if (code)
+    ffi_code_free (code);
+}
+
+#endif /* FFI_DIRECT_CLOSURES */
+#endif /* FFI_BOUND_CALLS */
+
+extern void ffi_closure_unix64(void) FFI_HIDDEN;
+extern void ffi_closure_unix64_sse(void) FFI_HIDDEN;
+extern void ffi_closure_bind_unix64(void) FFI_HIDDEN;
+extern void ffi_closure_bind_mem_unix64(void) FFI_HIDDEN;
+#if defined(FFI_EXEC_STATIC_TRAMP)
+extern void ffi_closure_unix64_alt(void) FFI_HIDDEN;
+extern void ffi_closure_unix64_sse_alt(void) FFI_HIDDEN;
+extern void ffi_closure_bind_unix64_alt(void) FFI_HIDDEN;
+extern void ffi_closure_bind_mem_unix64_alt(void) FFI_HIDDEN;
+#endif
+
+#ifndef __ILP32__
+extern ffi_status
+ffi_prep_closure_loc_efi64(ffi_closure* closure,
+			   ffi_cif* cif,
+			   void (*fun)(ffi_cif*, void*, void**, void*),
+			   void *user_data,
+			   void *codeloc);
+#endif
+
+/* Point the trampoline of CLOSURE at DEST, which is one of the entry
+   points above.  */
+
+static void
+unix64_set_trampoline (ffi_closure *closure, void (*dest)(void))
+{
+  static const unsigned char trampoline[24] = {
+    /* endbr64 */
+    0xf3, 0x0f, 0x1e, 0xfa,
+    /* leaq  -0xb(%rip),%r10   # 0x0  */
+    0x4c, 0x8d, 0x15, 0xf5, 0xff, 0xff, 0xff,
+    /* jmpq  *0x7(%rip)        # 0x18 */
+    0xff, 0x25, 0x07, 0x00, 0x00, 0x00,
+    /* nopl  0(%rax) */
+    0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00
+  };
+  char *tramp = closure->tramp;
 
 #if defined(FFI_EXEC_STATIC_TRAMP)
   if (ffi_tramp_is_present(closure))
@@ -791,20 +1645,41 @@ ffi_prep_closure_loc (ffi_closure* closure,
       /* Initialize the static trampoline's parameters. */
       if (dest == ffi_closure_unix64_sse)
         dest = ffi_closure_unix64_sse_alt;
-      else
+      else if (dest == ffi_closure_unix64)
         dest = ffi_closure_unix64_alt;
+      else if (dest == ffi_closure_bind_unix64)
+        dest = ffi_closure_bind_unix64_alt;
+      else
+        dest = ffi_closure_bind_mem_unix64_alt;
       ffi_tramp_set_parms (closure->ftramp, dest, closure);
-      goto out;
+      return;
     }
 #endif
 
   /* Initialize the dynamic trampoline. */
   memcpy (tramp, trampoline, sizeof(trampoline));
   *(UINT64 *)(tramp + sizeof (trampoline)) = (uintptr_t)dest;
+}
 
-#if defined(FFI_EXEC_STATIC_TRAMP)
-out:
+ffi_status
+ffi_prep_closure_loc (ffi_closure* closure,
+		      ffi_cif* cif,
+		      void (*fun)(ffi_cif*, void*, void**, void*),
+		      void *user_data,
+		      void *codeloc)
+{
+#ifndef __ILP32__
+  if (cif->abi == FFI_EFI64 || cif->abi == FFI_GNUW64)
+    return ffi_prep_closure_loc_efi64(closure, cif, fun, user_data, codeloc);
 #endif
+  if (cif->abi != FFI_UNIX64)
+    return FFI_BAD_ABI;
+
+  if (cif->flags & UNIX64_FLAG_XMM_ARGS)
+    unix64_set_trampoline (closure, ffi_closure_unix64_sse);
+  else
+    unix64_set_trampoline (closure, ffi_closure_unix64);
+
   closure->cif = cif;
   closure->fun = fun;
   closure->user_data = user_data;
@@ -812,6 +1687,57 @@ out:
   return FFI_OK;
 }
 
+ffi_status FFI_HIDDEN
+ffi_prep_closure_bind_machdep (ffi_bind_closure *closure, ffi_cif *cif,
+			       void *codeloc __attribute__((unused)))
+{
+  const ffi_unix64_arg *plan = cif->unix64_plan;
+  unsigned i, j;
+  int ngpr;
+
+  /* unix64.S finds the target through these.  */
+  FFI_ASSERT (offsetof (ffi_bind_closure, target) == UNIX64_BIND_OFS_TARGET);
+  FFI_ASSERT (offsetof (ffi_bind_closure, target_data)
+	      == UNIX64_BIND_OFS_DATA);
+
+  if (cif->abi != FFI_UNIX64)
+    return FFI_BAD_ABI;
+
+  if (cif->nargs > FFI_UNIX64_PLAN_ARGS)
+    {
+      ffi_unix64_arg *q = alloca (cif->nargs * sizeof (ffi_unix64_arg));
+      size_t bytes;
+
+      unix64_plan_args (cif, q, &bytes);
+      plan = q;
+    }
+
+  /* target_data takes a general register, so everything must still fit
+     after shifting the others up by one.  */
+  ngpr = (cif->flags & UNIX64_FLAG_RET_IN_MEM) != 0;
+  for (i = 0; i < cif->nargs; i++)
+    {
+      if (plan[i].op[0] == UNIX64_ARG_STACK)
+	return FFI_BAD_TYPEDEF;
+      for (j = 0; j < 2; j++)
+	if (plan[i].op[j] >= UNIX64_ARG_SINT8)
+	  ngpr++;
+    }
+  if (ngpr >= MAX_GPR_REGS)
+    return FFI_BAD_TYPEDEF;
+
+  if (cif->flags & UNIX64_FLAG_RET_IN_MEM)
+    unix64_set_trampoline (&closure->closure, ffi_closure_bind_mem_unix64);
+  else
+    unix64_set_trampoline (&closure->closure, ffi_closure_bind_unix64);
+
+  closure->closure.cif = cif;
+  closure->closure.fun = NULL;
+  closure->closure.user_data = closure->target_data;
+
+  return FFI_OK;
+}
+
 int FFI_HIDDEN
 ffi_closure_unix64_inner(ffi_cif *cif,
 			 void (*fun)(ffi_cif*, void*, void**, void*),
@@ -820,67 +1746,46 @@ ffi_closure_unix64_inner(ffi_cif *cif,
 			 struct register_args *reg_args,
 			 char *argp)
 {
+  const ffi_unix64_arg *plan;
   void **avalue;
-  ffi_type **arg_types;
   long i, avn;
-  int gprcount, ssecount, ngpr, nsse;
   int flags;
 
   avn = cif->nargs;
   flags = cif->flags;
   avalue = alloca(avn * sizeof(void *));
-  gprcount = ssecount = 0;
+
+  if (avn <= FFI_UNIX64_PLAN_ARGS)
+    plan = cif->unix64_plan;
+  else
+    {
+      ffi_unix64_arg *p = alloca (avn * sizeof (ffi_unix64_arg));
+      size_t bytes;
+
+      unix64_plan_args (cif, p, &bytes);
+      plan = p;
+    }
 
   if (flags & UNIX64_FLAG_RET_IN_MEM)
     {
       /* On return, %rax will contain the address that was passed
 	 by the caller in %rdi.  */
-      void *r = (void *)(uintptr_t)reg_args->gpr[gprcount++];
+      void *r = (void *)(uintptr_t)reg_args->gpr[0];
       *(void **)rvalue = r;
       rvalue = r;
       flags = (sizeof(void *) == 4 ? UNIX64_RET_UINT32 : UNIX64_RET_INT64);
     }
 
-  arg_types = cif->arg_types;
   for (i = 0; i < avn; ++i)
     {
-      enum x86_64_reg_class classes[MAX_CLASSES];
-      size_t n;
-
-      n = examine_argument (arg_types[i], classes, 0, &ngpr, &nsse);
-      if (n == 0
-	  || gprcount + ngpr > MAX_GPR_REGS
-	  || ssecount + nsse > MAX_SSE_REGS)
-	{
-	  long align = arg_types[i]->alignment;
-
-	  /* Stack arguments are *always* at least 8 byte aligned.  */
-	  if (align < 8)
-	    align = 8;
+      const ffi_unix64_arg *e = &plan[i];
 
-	  /* Pass this argument in memory.  */
-	  argp = (void *) FFI_ALIGN (argp, align);
-	  avalue[i] = argp;
-	  argp += arg_types[i]->size;
-	}
+      if (e->op[0] == UNIX64_ARG_STACK)
+	avalue[i] = argp + e->offset;
       /* If the argument is in a single register, or two consecutive
 	 integer registers, then we can use that address directly.  */
-      else if (n == 1
-	       || (n == 2 && !(SSE_CLASS_P (classes[0])
-			       || SSE_CLASS_P (classes[1]))))
-	{
-	  /* The argument is in a single register.  */
-	  if (SSE_CLASS_P (classes[0]))
-	    {
-	      avalue[i] = &reg_args->sse[ssecount];
-	      ssecount += n;
-	    }
-	  else
-	    {
-	      avalue[i] = &reg_args->gpr[gprcount];
-	      gprcount += n;
-	    }
-	}
+      else if (e->op[1] == UNIX64_ARG_NONE || e->reg[1] == e->reg[0] + 8)
+	avalue[i] = (char *) reg_args + e->reg[0];
       /* Otherwise, allocate space to make them consecutive.  */
       else
 	{
@@ -888,13 +1793,9 @@ ffi_closure_unix64_inner(ffi_cif *cif,
 	  unsigned int j;
 
 	  avalue[i] = a;
-	  for (j = 0; j < n; j++, a += 8)
-	    {
-	      if (SSE_CLASS_P (classes[j]))
-		memcpy (a, &reg_args->sse[ssecount++], 8);
-	      else
-		memcpy (a, &reg_args->gpr[gprcount++], 8);
-	    }
+	  for (j = 0; j < 2; j++)
+	    if (e->op[j] != UNIX64_ARG_NONE)
+	      memcpy (a + j * 8, (char *) reg_args + e->reg[j], 8);
 	}
     }
 
@@ -948,6 +1849,18 @@ ffi_tramp_arch (size_t *tramp_size, size_t *map_size)
   *tramp_size = UNIX64_TRAMP_SIZE;
   return &trampoline_code_table;
 }
+
+void *
+ffi_tramp_arch_large (size_t *tramp_size, size_t *template_size,
+		      size_t *map_size)
+{
+  extern void *trampoline_code_table_large;
+
+  *map_size = UNIX64_TRAMP_LARGE_MAP_SIZE;
+  *template_size = UNIX64_TRAMP_MAP_SIZE;
+  *tramp_size = UNIX64_TRAMP_SIZE;
+  return &trampoline_code_table_large;
+}
 #endif
 
 #endif /* __x86_64__ */
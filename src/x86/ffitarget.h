@@ -125,6 +125,27 @@ typedef enum ffi_abi {
   FFI_DEFAULT_ABI = FFI_SYSV
 #endif
 } ffi_abi;
+
+#if (defined(X86_64) || (defined (__x86_64__) && defined (X86_DARWIN))) \
+    && !defined(X86_WIN64)
+/* Placement of one argument for FFI_UNIX64, computed once by
+   ffi_prep_cif_machdep.  OP and REG describe each eightbyte of a
+   register argument (REG is a byte offset into the register save
+   area); stack arguments are copied to OFFSET.  See src/x86/ffi64.c.  */
+typedef struct {
+  unsigned offset;
+  unsigned size;
+  unsigned char op[2];
+  unsigned char reg[2];
+} ffi_unix64_arg;
+
+/* Cifs with more arguments than this compute their plan on the fly.  */
+#define FFI_UNIX64_PLAN_ARGS 16
+
+#define FFI_EXTRA_CIF_FIELDS \
+  unsigned unix64_nsse; \
+  ffi_unix64_arg unix64_plan[FFI_UNIX64_PLAN_ARGS]
+#endif
 #endif
 
 /* ---- Definitions for closures ----------------------------------------- */
@@ -132,6 +153,19 @@ typedef enum ffi_abi {
 #define FFI_CLOSURES 1
 #define FFI_GO_CLOSURES 1
 
+#if (defined(X86_64) || (defined (__x86_64__) && defined (X86_DARWIN))) \
+    && !defined(X86_WIN64)
+#define FFI_NATIVE_BIND_CLOSURES 1
+/* ffi64.c provides ffi_call_batch and ffi_call_strided.  */
+#define FFI_NATIVE_CALL_BATCH 1
+#endif
+
+#if defined (X86_64) && !defined (X86_WIN64) && !defined (__ILP32__) \
+    && !defined (_WIN32) && !defined (__CYGWIN__)
+#define FFI_BOUND_CALLS 1
+#define FFI_DIRECT_CLOSURES 1
+#endif
+
 #define FFI_TYPE_SMALL_STRUCT_1B (FFI_TYPE_LAST + 1)
 #define FFI_TYPE_SMALL_STRUCT_2B (FFI_TYPE_LAST + 2)
 #define FFI_TYPE_SMALL_STRUCT_4B (FFI_TYPE_LAST + 3)
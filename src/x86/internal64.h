@@ -21,6 +21,25 @@
 #define UNIX64_FLAG_XMM_ARGS	(1 << 11)
 #define UNIX64_SIZE_SHIFT	12
 
+/* Operations recorded in the per-argument plan, one per eightbyte.  */
+#define UNIX64_ARG_NONE		0
+#define UNIX64_ARG_STACK	1
+#define UNIX64_ARG_SSE32	2
+#define UNIX64_ARG_SSE64	3
+#define UNIX64_ARG_SINT8	4
+#define UNIX64_ARG_SINT16	5
+#define UNIX64_ARG_SINT32	6
+#define UNIX64_ARG_INT		7
+
+/* Offsets of target and target_data in ffi_bind_closure.  */
+#ifdef __ILP32__
+#define UNIX64_BIND_OFS_TARGET	48
+#define UNIX64_BIND_OFS_DATA	52
+#else
+#define UNIX64_BIND_OFS_TARGET	56
+#define UNIX64_BIND_OFS_DATA	64
+#endif
+
 #if defined(FFI_EXEC_STATIC_TRAMP)
 /*
  * For the trampoline code table mapping, a mapping size of 4K (base page size)
@@ -28,6 +47,12 @@
  */
 #define UNIX64_TRAMP_MAP_SHIFT	12
 #define UNIX64_TRAMP_MAP_SIZE	(1 << UNIX64_TRAMP_MAP_SHIFT)
+/*
+ * Large tables repeat one page of trampolines that reach their parameters
+ * 2M away, so that a table is one code and one parameter mapping.
+ */
+#define UNIX64_TRAMP_LARGE_MAP_SHIFT	21
+#define UNIX64_TRAMP_LARGE_MAP_SIZE	(1 << UNIX64_TRAMP_LARGE_MAP_SHIFT)
 #ifdef ENDBR_PRESENT
 #define UNIX64_TRAMP_SIZE	40
 #else
@@ -0,0 +1,274 @@
+/* Area:	ffi_prep_bound_call
+   Purpose:	Check that bound call stubs pass arguments and return
+		values like ffi_call.
+   Limitations:	Only where FFI_BOUND_CALLS is defined.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#ifdef FFI_BOUND_CALLS
+
+#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
+#include <complex.h>
+#endif
+
+typedef struct { unsigned char a, b, c; } odd3;
+typedef struct { double d; int i; } dbl_int;
+typedef struct { float x, y, z; } float3;
+typedef struct { long a, b, c, d; } big;
+
+static signed char ABI_ATTR
+ints (signed char a, unsigned char b, short c, unsigned short d, int e,
+      unsigned int f, long long g, float h, double i)
+{
+  return (signed char) (a + b + c + d + e + (int) f + (int) g
+			+ (int) h + (int) i);
+}
+
+static double ABI_ATTR
+many (double a, double b, double c, double d, double e, double f,
+      double g, double h, double i, double j, long k, long l, long m,
+      long n, long o, long p, long q, float r)
+{
+  return a + b + c + d + e + f + g + h + i + j + k + l + m + n + o + p + q + r;
+}
+
+static dbl_int ABI_ATTR
+mixed (odd3 s, float3 f, dbl_int di)
+{
+  dbl_int r;
+  r.d = f.x + f.y + f.z + di.d;
+  r.i = s.a + s.b + s.c + di.i;
+  return r;
+}
+
+static big ABI_ATTR
+bigs (big a, int k)
+{
+  big r;
+  r.a = a.d * k;
+  r.b = a.c * k;
+  r.c = a.b * k;
+  r.d = a.a * k;
+  return r;
+}
+
+static long double ABI_ATTR
+ld (long double a, int b)
+{
+  return a * b;
+}
+
+#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
+static _Complex long double ABI_ATTR
+cld (long double re, long double im)
+{
+  return re + im * I;
+}
+#endif
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[MAX_ARGS];
+  void *values[MAX_ARGS];
+  ffi_bound_fn stub;
+  int i;
+
+  /* Integer promotions and sign extension.  */
+  {
+    signed char a = -1, rc;
+    unsigned char b = 200;
+    short c = -300;
+    unsigned short d = 400;
+    int e = -5;
+    unsigned int f = 6;
+    long long g = 7;
+    float h = 8;
+    double dd = 9;
+    ffi_arg r, r2;
+
+    args[0] = &ffi_type_schar;   values[0] = &a;
+    args[1] = &ffi_type_uchar;   values[1] = &b;
+    args[2] = &ffi_type_sshort;  values[2] = &c;
+    args[3] = &ffi_type_ushort;  values[3] = &d;
+    args[4] = &ffi_type_sint;    values[4] = &e;
+    args[5] = &ffi_type_uint;    values[5] = &f;
+    args[6] = &ffi_type_sint64;  values[6] = &g;
+    args[7] = &ffi_type_float;   values[7] = &h;
+    args[8] = &ffi_type_double;  values[8] = &dd;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 9, &ffi_type_schar, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (ints), &stub) == FFI_OK);
+    stub (&r, values);
+    ffi_call (&cif, FFI_FN (ints), &r2, values);
+    rc = ints (a, b, c, d, e, f, g, h, dd);
+    CHECK ((signed char) r == rc);
+    CHECK (r == r2);
+    stub (NULL, values);
+    ffi_bound_call_free (stub);
+  }
+
+  /* Registers exhausted: the tail goes on the stack.  */
+  {
+    double dv[10];
+    long lv[7];
+    float fv = 0.5f;
+    double r;
+
+    for (i = 0; i < 10; i++)
+      {
+	dv[i] = i + 0.25;
+	args[i] = &ffi_type_double;
+	values[i] = &dv[i];
+      }
+    for (i = 0; i < 7; i++)
+      {
+	lv[i] = 100 * (i + 1);
+	args[10 + i] = &ffi_type_slong;
+	values[10 + i] = &lv[i];
+      }
+    args[17] = &ffi_type_float;
+    values[17] = &fv;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 18, &ffi_type_double, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (many), &stub) == FFI_OK);
+    stub (&r, values);
+    CHECK (r == many (dv[0], dv[1], dv[2], dv[3], dv[4], dv[5], dv[6], dv[7],
+		      dv[8], dv[9], lv[0], lv[1], lv[2], lv[3], lv[4], lv[5],
+		      lv[6], fv));
+    ffi_bound_call_free (stub);
+  }
+
+  /* Odd-sized and mixed-class structures.  */
+  {
+    ffi_type odd3_type, float3_type, dbl_int_type;
+    ffi_type *odd3_elts[] = { &ffi_type_uchar, &ffi_type_uchar,
+			      &ffi_type_uchar, NULL };
+    ffi_type *float3_elts[] = { &ffi_type_float, &ffi_type_float,
+				&ffi_type_float, NULL };
+    ffi_type *dbl_int_elts[] = { &ffi_type_double, &ffi_type_sint, NULL };
+    odd3 s = { 1, 2, 3 };
+    float3 f = { 1.5f, 2.5f, 3.5f };
+    dbl_int di = { 4.25, 40 }, r, e;
+
+    odd3_type.size = odd3_type.alignment = 0;
+    odd3_type.type = FFI_TYPE_STRUCT;
+    odd3_type.elements = odd3_elts;
+    float3_type = odd3_type;
+    float3_type.elements = float3_elts;
+    dbl_int_type = odd3_type;
+    dbl_int_type.elements = dbl_int_elts;
+
+    args[0] = &odd3_type;    values[0] = &s;
+    args[1] = &float3_type;  values[1] = &f;
+    args[2] = &dbl_int_type; values[2] = &di;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 3, &dbl_int_type, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (mixed), &stub) == FFI_OK);
+    stub (&r, values);
+    e = mixed (s, f, di);
+    CHECK (r.d == e.d && r.i == e.i);
+    ffi_bound_call_free (stub);
+  }
+
+  /* Structures passed and returned in memory.  */
+  {
+    ffi_type big_type;
+    ffi_type *big_elts[] = { &ffi_type_slong, &ffi_type_slong,
+			     &ffi_type_slong, &ffi_type_slong, NULL };
+    big a = { 1, 2, 3, 4 }, r;
+    int k = 3;
+
+    big_type.size = big_type.alignment = 0;
+    big_type.type = FFI_TYPE_STRUCT;
+    big_type.elements = big_elts;
+
+    args[0] = &big_type;     values[0] = &a;
+    args[1] = &ffi_type_sint; values[1] = &k;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &big_type, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (bigs), &stub) == FFI_OK);
+    stub (&r, values);
+    CHECK (r.a == 12 && r.b == 9 && r.c == 6 && r.d == 3);
+    stub (NULL, values);
+    ffi_bound_call_free (stub);
+  }
+
+  /* x87 return values, stored or discarded.  */
+  {
+    long double a = 1.5L, r;
+    int b = 3;
+
+    args[0] = &ffi_type_longdouble; values[0] = &a;
+    args[1] = &ffi_type_sint;       values[1] = &b;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &ffi_type_longdouble,
+			 args) == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (ld), &stub) == FFI_OK);
+    for (i = 0; i < 10; i++)
+      stub (NULL, values);
+    stub (&r, values);
+    CHECK (r == 4.5L);
+    ffi_bound_call_free (stub);
+  }
+
+#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
+  /* A complex long double comes back in two x87 registers.  */
+  {
+    long double re = 1.5L, im = 2.5L;
+    _Complex long double r, r2;
+
+    args[0] = &ffi_type_longdouble; values[0] = &re;
+    args[1] = &ffi_type_longdouble; values[1] = &im;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2,
+			 &ffi_type_complex_longdouble, args) == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (cld), &stub) == FFI_OK);
+    stub (&r, values);
+    ffi_call (&cif, FFI_FN (cld), &r2, values);
+    CHECK (creall (r) == 1.5L && cimagl (r) == 2.5L);
+    CHECK (creall (r2) == creall (r) && cimagl (r2) == cimagl (r));
+    stub (NULL, values);
+    ffi_bound_call_free (stub);
+  }
+#endif
+
+  /* Variadic functions get the SSE register count in %al.  */
+  {
+    char buf[64];
+    char *bp = buf;
+    size_t n = sizeof (buf);
+    const char *fmt = "%d %.2f %s";
+    int iv = 42;
+    double dv = 3.25;
+    const char *sv = "ok";
+    ffi_arg r;
+
+    args[0] = &ffi_type_pointer; values[0] = &bp;
+    args[1] = &ffi_type_ulong;   values[1] = &n;
+    args[2] = &ffi_type_pointer; values[2] = &fmt;
+    args[3] = &ffi_type_sint;    values[3] = &iv;
+    args[4] = &ffi_type_double;  values[4] = &dv;
+    args[5] = &ffi_type_pointer; values[5] = &sv;
+    CHECK (ffi_prep_cif_var (&cif, FFI_DEFAULT_ABI, 3, 6, &ffi_type_sint,
+			     args) == FFI_OK);
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (snprintf), &stub) == FFI_OK);
+    stub (&r, values);
+    CHECK ((int) r == 10);
+    CHECK (strcmp (buf, "42 3.25 ok") == 0);
+    ffi_bound_call_free (stub);
+  }
+
+  exit (0);
+}
+
+#else
+
+int main (void)
+{
+  exit (0);
+}
+
+#endif
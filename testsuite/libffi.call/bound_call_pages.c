@@ -0,0 +1,124 @@
+/* Area:	ffi_prep_bound_call
+   Purpose:	Check that many bound call stubs share pages, keep working
+		while others are freed, and are listed in the perf map.
+   Limitations:	Only where FFI_BOUND_CALLS is defined.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#ifdef FFI_BOUND_CALLS
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define NSTUBS 3000
+
+static int ABI_ATTR
+add (int a, int b)
+{
+  return a + b;
+}
+
+static int ABI_ATTR
+sub (int a, int b)
+{
+  return a - b;
+}
+
+static ffi_bound_fn stubs[NSTUBS];
+
+static int
+call (ffi_bound_fn stub, int a, int b)
+{
+  void *values[2];
+  ffi_arg r;
+
+  values[0] = &a;
+  values[1] = &b;
+  stub (&r, values);
+  return (int) r;
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[2];
+  uintptr_t page = (uintptr_t) sysconf (_SC_PAGESIZE);
+  char path[64], line[256];
+  int i, pages, found;
+  FILE *f;
+
+  setenv ("LIBFFI_PERF_MAP", "1", 1);
+
+  args[0] = &ffi_type_sint;
+  args[1] = &ffi_type_sint;
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &ffi_type_sint, args)
+	 == FFI_OK);
+
+  for (i = 0; i < NSTUBS; i++)
+    CHECK (ffi_prep_bound_call (&cif, i % 2 ? FFI_FN (sub) : FFI_FN (add),
+				&stubs[i]) == FFI_OK);
+
+  /* Stubs are much smaller than a page, so most of them share one.  */
+  pages = 0;
+  for (i = 0; i < NSTUBS; i++)
+    {
+      int j;
+
+      for (j = 0; j < i; j++)
+	if ((uintptr_t) stubs[j] / page == (uintptr_t) stubs[i] / page)
+	  break;
+      if (j == i)
+	pages++;
+    }
+  printf ("%d stubs on %d pages\n", NSTUBS, pages);
+  CHECK (pages < NSTUBS / 4);
+
+  /* Free every other stub and replace it; the rest keep working.  */
+  for (i = 0; i < NSTUBS; i += 2)
+    ffi_bound_call_free (stubs[i]);
+  for (i = 1; i < NSTUBS; i += 2)
+    CHECK (call (stubs[i], i, 1) == i - 1);
+  for (i = 0; i < NSTUBS; i += 2)
+    CHECK (ffi_prep_bound_call (&cif, FFI_FN (add), &stubs[i]) == FFI_OK);
+  for (i = 0; i < NSTUBS; i++)
+    CHECK (call (stubs[i], i, 1) == (i % 2 ? i - 1 : i + 1));
+
+  /* Each stub has a line in the perf map.  */
+  snprintf (path, sizeof (path), "/tmp/perf-%ld.map", (long) getpid ());
+  f = fopen (path, "r");
+  if (f != NULL)
+    {
+      found = 0;
+      while (fgets (line, sizeof (line), f))
+	{
+	  unsigned long start, size;
+	  char name[64];
+
+	  if (sscanf (line, "%lx %lx %63s", &start, &size, name) == 3
+	      && start == (unsigned long) (uintptr_t) stubs[0]
+	      && strcmp (name, "ffi_bound_call") == 0)
+	    found = 1;
+	}
+      fclose (f);
+      unlink (path);
+      CHECK (found);
+    }
+
+  for (i = 0; i < NSTUBS; i++)
+    ffi_bound_call_free (stubs[i]);
+
+  exit (0);
+}
+
+#else
+
+int main (void)
+{
+  exit (0);
+}
+
+#endif
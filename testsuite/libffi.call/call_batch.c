@@ -0,0 +1,122 @@
+/* Area:	ffi_call_batch
+   Purpose:	Check that a batch of calls behaves like the same calls
+		made one at a time.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#define N 8
+
+typedef struct { long a, b, c; } big;
+
+static int calls;
+
+static signed char ABI_ATTR
+scale (signed char a, double b)
+{
+  calls++;
+  return (signed char) (a * b);
+}
+
+static big ABI_ATTR
+make_big (long a, float b, long c, long d, long e, long f, long g, long h)
+{
+  big r;
+
+  calls++;
+  r.a = a + c;
+  r.b = (long) b;
+  r.c = d + e + f + g + h;
+  return r;
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[MAX_ARGS];
+  ffi_type big_type;
+  ffi_type *big_elts[] = { &ffi_type_slong, &ffi_type_slong,
+			   &ffi_type_slong, NULL };
+  void *avalues[N][8];
+  void **argv[N];
+  void *rvalues[N];
+  int i, j;
+
+  {
+    signed char a[N];
+    double b[N];
+    ffi_arg r[N];
+
+    for (i = 0; i < N; i++)
+      {
+	a[i] = (signed char) (i - 4);
+	b[i] = i + 0.5;
+	avalues[i][0] = &a[i];
+	avalues[i][1] = &b[i];
+	argv[i] = avalues[i];
+	rvalues[i] = &r[i];
+      }
+    args[0] = &ffi_type_schar;
+    args[1] = &ffi_type_double;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &ffi_type_schar, args)
+	   == FFI_OK);
+    ffi_call_batch (&cif, FFI_FN (scale), N, rvalues, argv);
+    for (i = 0; i < N; i++)
+      CHECK ((signed char) r[i] == (signed char) (a[i] * b[i]));
+
+    calls = 0;
+    ffi_call_batch (&cif, FFI_FN (scale), N, NULL, argv);
+    CHECK (calls == N);
+    ffi_call_batch (&cif, FFI_FN (scale), 0, NULL, NULL);
+    CHECK (calls == N);
+  }
+
+  {
+    long l[N][7];
+    float f[N];
+    big r[N];
+
+    big_type.size = big_type.alignment = 0;
+    big_type.type = FFI_TYPE_STRUCT;
+    big_type.elements = big_elts;
+
+    for (i = 0; i < 8; i++)
+      args[i] = &ffi_type_slong;
+    args[1] = &ffi_type_float;
+    for (i = 0; i < N; i++)
+      {
+	f[i] = i * 2.0f;
+	avalues[i][1] = &f[i];
+	for (j = 0; j < 7; j++)
+	  {
+	    l[i][j] = i * 10 + j;
+	    avalues[i][j ? j + 1 : 0] = &l[i][j];
+	  }
+	argv[i] = avalues[i];
+	rvalues[i] = (i % 2) ? &r[i] : NULL;
+	memset (&r[i], 0, sizeof (r[i]));
+      }
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 8, &big_type, args)
+	   == FFI_OK);
+    calls = 0;
+    ffi_call_batch (&cif, FFI_FN (make_big), N, rvalues, argv);
+    CHECK (calls == N);
+    for (i = 0; i < N; i++)
+      {
+	if (i % 2)
+	  {
+	    CHECK (r[i].a == l[i][0] + l[i][1]);
+	    CHECK (r[i].b == (long) f[i]);
+	    CHECK (r[i].c == l[i][2] + l[i][3] + l[i][4] + l[i][5] + l[i][6]);
+	  }
+	else
+	  CHECK (r[i].a == 0 && r[i].b == 0 && r[i].c == 0);
+      }
+  }
+
+  exit (0);
+}
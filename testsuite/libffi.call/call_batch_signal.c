@@ -0,0 +1,136 @@
+/* Area:	ffi_call_batch, ffi_call_strided
+   Purpose:	Check that signals taken during a batch do not overwrite
+		the stack-passed arguments of the calls that follow.
+   Limitations:	Only where setitimer is available.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#if defined __unix__ || defined __APPLE__
+
+#include <signal.h>
+#include <sys/time.h>
+
+#define NARGS 40
+#define ROWS 256
+
+static volatile sig_atomic_t signals;
+static int bad;
+
+static void
+on_signal (int sig __UNUSED__)
+{
+  volatile char junk[4096];
+  size_t i;
+
+  /* Use some stack, so that anything left below the stack pointer is
+     overwritten.  */
+  for (i = 0; i < sizeof (junk); i++)
+    junk[i] = (char) 0xa5;
+  signals++;
+}
+
+#define A(i) long a##i
+#define A10(i) A(i##0), A(i##1), A(i##2), A(i##3), A(i##4), \
+	       A(i##5), A(i##6), A(i##7), A(i##8), A(i##9)
+
+static long ABI_ATTR
+sum40 (A10 (), A10 (1), A10 (2), A10 (3))
+{
+  long v[NARGS] = { a0, a1, a2, a3, a4, a5, a6, a7, a8, a9,
+		    a10, a11, a12, a13, a14, a15, a16, a17, a18, a19,
+		    a20, a21, a22, a23, a24, a25, a26, a27, a28, a29,
+		    a30, a31, a32, a33, a34, a35, a36, a37, a38, a39 };
+  long s = 0;
+  int i;
+
+  /* Spend a little time in the callee, so that signals land here as
+     well as between calls.  */
+  for (i = 0; i < NARGS; i++)
+    s = s * 3 + v[i];
+  return s;
+}
+
+static long args[ROWS][NARGS];
+static void *values[ROWS][NARGS];
+static void **avalues[ROWS];
+static ffi_arg results[ROWS];
+static void *rvalues[ROWS];
+
+static long
+expect (int row)
+{
+  long s = 0;
+  int i;
+
+  for (i = 0; i < NARGS; i++)
+    s = s * 3 + args[row][i];
+  return s;
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *types[NARGS];
+  const void *base[NARGS];
+  size_t stride[NARGS];
+  struct itimerval timer;
+  int i, j, round;
+
+  for (i = 0; i < NARGS; i++)
+    {
+      types[i] = &ffi_type_slong;
+      base[i] = &args[0][i];
+      stride[i] = sizeof (args[0]);
+    }
+  for (j = 0; j < ROWS; j++)
+    {
+      for (i = 0; i < NARGS; i++)
+	{
+	  args[j][i] = j * 1000 + i;
+	  values[j][i] = &args[j][i];
+	}
+      avalues[j] = values[j];
+      rvalues[j] = &results[j];
+    }
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, NARGS, &ffi_type_slong, types)
+	 == FFI_OK);
+
+  signal (SIGPROF, on_signal);
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 100;
+  timer.it_value = timer.it_interval;
+  setitimer (ITIMER_PROF, &timer, NULL);
+
+  for (round = 0; round < 20000 && signals < 200; round++)
+    {
+      if (round % 2)
+	ffi_call_batch (&cif, FFI_FN (sum40), ROWS, rvalues, avalues);
+      else
+	ffi_call_strided (&cif, FFI_FN (sum40), ROWS, base, stride,
+			  results, sizeof (results[0]));
+      for (j = 0; j < ROWS; j++)
+	if ((long) results[j] != expect (j))
+	  bad++;
+    }
+
+  timer.it_value.tv_usec = 0;
+  timer.it_interval.tv_usec = 0;
+  setitimer (ITIMER_PROF, &timer, NULL);
+
+  printf ("%d rounds, %d signals, %d bad calls\n", round, (int) signals, bad);
+  CHECK (bad == 0);
+  exit (0);
+}
+
+#else
+
+int main (void)
+{
+  exit (0);
+}
+
+#endif
@@ -0,0 +1,129 @@
+/* Area:	ffi_call_strided
+   Purpose:	Check that strided calls read each argument from its
+		column and store the return values at OUT_STRIDE.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#define N 8
+
+typedef struct { long a, b, c; } big;
+typedef struct { short s; double d; int pad; } rec;
+
+static int calls;
+
+static int ABI_ATTR
+add3 (short a, double b, int c)
+{
+  calls++;
+  return a + (int) b + c;
+}
+
+static big ABI_ATTR
+make_big (long a, float b, long c, long d, long e, long f, long g, long h)
+{
+  big r;
+
+  calls++;
+  r.a = a + c;
+  r.b = (long) b;
+  r.c = d + e + f + g + h;
+  return r;
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[MAX_ARGS];
+  ffi_type big_type;
+  ffi_type *big_elts[] = { &ffi_type_slong, &ffi_type_slong,
+			   &ffi_type_slong, NULL };
+  const void *base[8];
+  size_t stride[8];
+  int i, j;
+
+  {
+    /* Two fields of an array of records, and a constant.  */
+    rec recs[N];
+    int k = 1000;
+    struct { ffi_arg r; int tag; } out[N];
+
+    for (i = 0; i < N; i++)
+      {
+	recs[i].s = (short) (i - 4);
+	recs[i].d = i * 3.0;
+	out[i].tag = 42;
+      }
+    base[0] = &recs[0].s;
+    stride[0] = sizeof (rec);
+    base[1] = &recs[0].d;
+    stride[1] = sizeof (rec);
+    base[2] = &k;
+    stride[2] = 0;
+    args[0] = &ffi_type_sshort;
+    args[1] = &ffi_type_double;
+    args[2] = &ffi_type_sint;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 3, &ffi_type_sint, args)
+	   == FFI_OK);
+    ffi_call_strided (&cif, FFI_FN (add3), N, base, stride,
+		      &out[0].r, sizeof (out[0]));
+    for (i = 0; i < N; i++)
+      {
+	CHECK ((int) out[i].r == (i - 4) + i * 3 + 1000);
+	CHECK (out[i].tag == 42);
+      }
+
+    calls = 0;
+    ffi_call_strided (&cif, FFI_FN (add3), N, base, stride, NULL, 0);
+    CHECK (calls == N);
+    ffi_call_strided (&cif, FFI_FN (add3), 0, base, stride, NULL, 0);
+    CHECK (calls == N);
+  }
+
+  {
+    /* Eight columns, a float among them, with the later ones on the
+       stack, returning a structure in memory.  */
+    long l[7][N];
+    float f[N];
+    big r[N];
+
+    big_type.size = big_type.alignment = 0;
+    big_type.type = FFI_TYPE_STRUCT;
+    big_type.elements = big_elts;
+
+    for (i = 0; i < 8; i++)
+      args[i] = &ffi_type_slong;
+    args[1] = &ffi_type_float;
+    for (i = 0; i < N; i++)
+      {
+	f[i] = i * 2.0f;
+	for (j = 0; j < 7; j++)
+	  l[j][i] = i * 10 + j;
+      }
+    base[1] = f;
+    stride[1] = sizeof (float);
+    for (j = 0; j < 7; j++)
+      {
+	base[j ? j + 1 : 0] = l[j];
+	stride[j ? j + 1 : 0] = sizeof (long);
+      }
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 8, &big_type, args)
+	   == FFI_OK);
+    calls = 0;
+    ffi_call_strided (&cif, FFI_FN (make_big), N, base, stride,
+		      r, sizeof (big));
+    CHECK (calls == N);
+    for (i = 0; i < N; i++)
+      {
+	CHECK (r[i].a == l[0][i] + l[1][i]);
+	CHECK (r[i].b == (long) f[i]);
+	CHECK (r[i].c == l[2][i] + l[3][i] + l[4][i] + l[5][i] + l[6][i]);
+      }
+  }
+
+  exit (0);
+}
@@ -0,0 +1,83 @@
+/* Area:		ffi_cif_lookup
+   Purpose:		Check that cifs looked up by signature are shared,
+			prepared, and usable in calls.
+   Limitations:		none.
+   PR:			none.
+   Originator:		libffi  */
+
+/* { dg-do run } */
+#include "ffitest.h"
+#include <stdarg.h>
+
+static int ABI_ATTR
+add3 (int a, int b, int c)
+{
+  return a + b + c;
+}
+
+static int
+sum (int n, ...)
+{
+  va_list ap;
+  int i, total = 0;
+
+  va_start (ap, n);
+  for (i = 0; i < n; i++)
+    total += va_arg (ap, int);
+  va_end (ap);
+  return total;
+}
+
+int
+main (void)
+{
+  ffi_type *args[3] = { &ffi_type_sint, &ffi_type_sint, &ffi_type_sint };
+  ffi_type *same[3] = { &ffi_type_sint, &ffi_type_sint, &ffi_type_sint };
+  ffi_type *other[3] = { &ffi_type_sint, &ffi_type_sint, &ffi_type_slong };
+  ffi_cif *cif, *vcif;
+  int a = 1, b = 2, c = 3, n = 2;
+  void *values[3];
+  ffi_arg r;
+
+  cif = ffi_cif_lookup (ABI_NUM, &ffi_type_sint, 3, args, 0);
+  CHECK (cif != NULL);
+  CHECK (cif->nargs == 3);
+  CHECK (cif->rtype == &ffi_type_sint);
+
+  /* The cif has its own copy of the argument types.  */
+  CHECK (cif->arg_types != args);
+  args[2] = &ffi_type_double;
+  CHECK (cif->arg_types[2] == &ffi_type_sint);
+  args[2] = &ffi_type_sint;
+
+  /* The same signature, from a different array, gives the same cif;
+     a different one does not.  */
+  CHECK (ffi_cif_lookup (ABI_NUM, &ffi_type_sint, 3, same, 0) == cif);
+  CHECK (ffi_cif_lookup (ABI_NUM, &ffi_type_sint, 3, other, 0) != cif);
+  CHECK (ffi_cif_lookup (ABI_NUM, &ffi_type_sint, 2, args, 0) != cif);
+  CHECK (ffi_cif_lookup (ABI_NUM, &ffi_type_uint, 3, args, 0) != cif);
+
+  values[0] = &a;
+  values[1] = &b;
+  values[2] = &c;
+  ffi_call (cif, FFI_FN (add3), &r, values);
+  CHECK ((int) r == 6);
+
+  /* A variadic signature is kept apart from the plain one.  */
+  vcif = ffi_cif_lookup (FFI_DEFAULT_ABI, &ffi_type_sint, 3, args, 1);
+  CHECK (vcif != NULL);
+  CHECK (vcif != cif);
+  CHECK (ffi_cif_lookup (FFI_DEFAULT_ABI, &ffi_type_sint, 3, same, 1)
+	 == vcif);
+  values[0] = &n;
+  values[1] = &b;
+  values[2] = &c;
+  ffi_call (vcif, FFI_FN (sum), &r, values);
+  CHECK ((int) r == 5);
+
+  /* More fixed arguments than arguments is an error.  */
+  CHECK (ffi_cif_lookup (FFI_DEFAULT_ABI, &ffi_type_sint, 1, args, 2)
+	 == NULL);
+
+  exit (0);
+}
@@ -0,0 +1,104 @@
+/* Area:		ffi_prep_cif_sig
+   Purpose:		Check that cifs prepared from signature strings are
+			correct, shared and usable in calls.
+   Limitations:		none.
+   PR:			none.
+   Originator:		libffi  */
+
+/* { dg-do run } */
+#include "ffitest.h"
+#include <stdarg.h>
+
+struct pair
+{
+  int i;
+  float f;
+};
+
+static double
+mix (int a, void *p, unsigned short s, struct pair q)
+{
+  return a + (p != NULL) + s + q.i + q.f;
+}
+
+static int
+sum (int n, ...)
+{
+  va_list ap;
+  int i, total = 0;
+
+  va_start (ap, n);
+  for (i = 0; i < n; i++)
+    total += va_arg (ap, int);
+  va_end (ap);
+  return total;
+}
+
+int
+main (void)
+{
+  ffi_cif cif, again;
+  int a = 1, n = 2, b = 20, c = 300;
+  unsigned short s = 4;
+  struct pair q = { 50, 0.5f };
+  void *p = &a;
+  void *values[4];
+  double d;
+  ffi_arg r;
+
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "d(ipS{if})") == FFI_OK);
+  CHECK (cif.nargs == 4);
+  CHECK (cif.rtype == &ffi_type_double);
+  CHECK (cif.arg_types[0] == &ffi_type_sint);
+  CHECK (cif.arg_types[1] == &ffi_type_pointer);
+  CHECK (cif.arg_types[2] == &ffi_type_ushort);
+  CHECK (cif.arg_types[3]->type == FFI_TYPE_STRUCT);
+  CHECK (cif.arg_types[3]->size == sizeof (struct pair));
+
+  /* The second time the signature is remembered, and the types are
+     shared with the other interfaces.  */
+  CHECK (ffi_prep_cif_sig (&again, FFI_DEFAULT_ABI, "d(ipS{if})") == FFI_OK);
+  CHECK (again.arg_types == cif.arg_types);
+  {
+    ffi_type *elements[2] = { &ffi_type_sint, &ffi_type_float };
+    CHECK (ffi_type_struct_intern (elements, 2) == cif.arg_types[3]);
+  }
+
+  values[0] = &a;
+  values[1] = &p;
+  values[2] = &s;
+  values[3] = &q;
+  ffi_call (&cif, FFI_FN (mix), &d, values);
+  CHECK (d == 56.5);
+
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(i;ii)") == FFI_OK);
+  CHECK (cif.nargs == 3);
+  values[0] = &n;
+  values[1] = &b;
+  values[2] = &c;
+  ffi_call (&cif, FFI_FN (sum), &r, values);
+  CHECK ((int) r == 320);
+
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "v()") == FFI_OK);
+  CHECK (cif.nargs == 0 && cif.rtype == &ffi_type_void);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "{{cd}i}(p;)") == FFI_OK);
+  CHECK (cif.nargs == 1 && cif.rtype->type == FFI_TYPE_STRUCT);
+
+  /* Malformed signatures.  */
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(i") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(i)x") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(v)") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i({})") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(;i)") == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(i;i;i)")
+	 == FFI_BAD_TYPEDEF);
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i({i)") == FFI_BAD_TYPEDEF);
+
+  /* Variadic floats must be promoted.  */
+  CHECK (ffi_prep_cif_sig (&cif, FFI_DEFAULT_ABI, "i(p;f)")
+	 == FFI_BAD_ARGTYPE);
+
+  exit (0);
+}
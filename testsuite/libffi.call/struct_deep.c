@@ -0,0 +1,54 @@
+/* Area:		ffi_get_struct_offsets
+   Purpose:		Check that very deeply nested structure types can be
+			laid out, and that a type containing itself is
+			rejected.
+   Limitations:		none.
+   PR:			none.
+   Originator:		libffi  */
+
+/* { dg-do run } */
+#include "ffitest.h"
+
+#define DEPTH 200000
+
+int
+main (void)
+{
+  ffi_type *types, **elements, self, *self_elements[2];
+  size_t offsets[2];
+  int i;
+
+  /* Level I is struct { level I-1; char; }, and level 0 is
+     struct { char; char; }.  */
+  types = calloc (DEPTH, sizeof (ffi_type));
+  elements = calloc (DEPTH, 3 * sizeof (ffi_type *));
+  CHECK (types != NULL && elements != NULL);
+  for (i = 0; i < DEPTH; i++)
+    {
+      elements[3 * i] = i ? &types[i - 1] : &ffi_type_schar;
+      elements[3 * i + 1] = &ffi_type_schar;
+      elements[3 * i + 2] = NULL;
+      types[i].type = FFI_TYPE_STRUCT;
+      types[i].elements = &elements[3 * i];
+    }
+
+  CHECK (ffi_get_struct_offsets (FFI_DEFAULT_ABI, &types[DEPTH - 1], offsets)
+	 == FFI_OK);
+  CHECK (types[DEPTH - 1].size == DEPTH + 1);
+  CHECK (types[0].size == 2);
+  CHECK (offsets[0] == 0);
+  CHECK (offsets[1] == DEPTH);
+
+  self.size = 0;
+  self.alignment = 0;
+  self.type = FFI_TYPE_STRUCT;
+  self.elements = self_elements;
+  self_elements[0] = &self;
+  self_elements[1] = NULL;
+  CHECK (ffi_get_struct_offsets (FFI_DEFAULT_ABI, &self, NULL)
+	 == FFI_BAD_TYPEDEF);
+
+  free (types);
+  free (elements);
+  exit (0);
+}
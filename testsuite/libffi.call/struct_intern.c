@@ -0,0 +1,85 @@
+/* Area:		ffi_type_struct_intern
+   Purpose:		Check that interned structure types are shared, laid
+			out, and usable in calls.
+   Limitations:		none.
+   PR:			none.
+   Originator:		libffi  */
+
+/* { dg-do run } */
+#include "ffitest.h"
+#include <stddef.h>
+
+struct inner
+{
+  char c;
+  double d;
+};
+
+struct outer
+{
+  int i;
+  struct inner in;
+  char c;
+};
+
+static struct outer ABI_ATTR
+bump (struct outer o)
+{
+  o.i += 1;
+  o.in.c += 2;
+  o.in.d += 3.0;
+  o.c += 4;
+  return o;
+}
+
+int
+main (void)
+{
+  ffi_type *inner_elements[2] = { &ffi_type_schar, &ffi_type_double };
+  ffi_type *same_elements[2] = { &ffi_type_schar, &ffi_type_double };
+  ffi_type *other_elements[2] = { &ffi_type_double, &ffi_type_schar };
+  ffi_type *outer_elements[3];
+  ffi_type *inner, *outer, *args[1];
+  size_t offsets[3];
+  struct outer o, r;
+  void *values[1];
+  ffi_cif cif;
+
+  inner = ffi_type_struct_intern (inner_elements, 2);
+  CHECK (inner != NULL);
+  CHECK (inner->type == FFI_TYPE_STRUCT);
+  CHECK (inner->size == sizeof (struct inner));
+  CHECK (inner->alignment == offsetof (struct inner, d));
+
+  /* The same elements, from a different array, give the same type;
+     different elements do not.  */
+  CHECK (ffi_type_struct_intern (same_elements, 2) == inner);
+  CHECK (ffi_type_struct_intern (other_elements, 2) != inner);
+  CHECK (ffi_type_struct_intern (inner_elements, 1) != inner);
+
+  outer_elements[0] = &ffi_type_sint;
+  outer_elements[1] = inner;
+  outer_elements[2] = &ffi_type_schar;
+  outer = ffi_type_struct_intern (outer_elements, 3);
+  CHECK (outer != NULL);
+  CHECK (outer->size == sizeof (struct outer));
+
+  CHECK (ffi_get_struct_offsets (FFI_DEFAULT_ABI, outer, offsets) == FFI_OK);
+  CHECK (offsets[0] == offsetof (struct outer, i));
+  CHECK (offsets[1] == offsetof (struct outer, in));
+  CHECK (offsets[2] == offsetof (struct outer, c));
+
+  CHECK (ffi_type_struct_intern (outer_elements, 0) == NULL);
+
+  args[0] = outer;
+  CHECK (ffi_prep_cif (&cif, ABI_NUM, 1, outer, args) == FFI_OK);
+  o.i = 10;
+  o.in.c = 20;
+  o.in.d = 30.0;
+  o.c = 40;
+  values[0] = &o;
+  ffi_call (&cif, FFI_FN (bump), &r, values);
+  CHECK (r.i == 11 && r.in.c == 22 && r.in.d == 33.0 && r.c == 44);
+
+  exit (0);
+}
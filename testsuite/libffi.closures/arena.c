@@ -0,0 +1,109 @@
+/* Area:	ffi_arena_create, ffi_arena_prep_cif, ffi_arena_struct,
+		ffi_arena_closure_alloc, ffi_arena_destroy
+   Purpose:	Check that cifs, types and closures allocated from an
+		arena work, and that destroying the arena frees the
+		closures.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#define N 500
+
+struct pair
+{
+  int i;
+  double d;
+};
+
+static double
+sum_pair (struct pair p, int k)
+{
+  return p.i + p.d + k;
+}
+
+static void
+add_fn (ffi_cif *cif __UNUSED__, void *resp, void **args, void *userdata)
+{
+  *(ffi_arg *) resp = *(int *) args[0] + *(int *) userdata;
+}
+
+typedef int (*add_t) (int);
+
+int main (void)
+{
+  ffi_type *elements[2] = { &ffi_type_sint, &ffi_type_double };
+  ffi_type *args[2], *pair_type;
+  ffi_closure_stats before, during, after;
+  struct pair p = { 1, 2.5 };
+  int k = 10, i, *data;
+  void *values[2], *code, *big;
+  ffi_closure *pcl;
+  ffi_arena *arena;
+  ffi_cif *cif;
+  double d;
+
+  ffi_closure_get_stats (&before);
+
+  arena = ffi_arena_create (0);
+  CHECK (arena != NULL);
+
+  pair_type = ffi_arena_struct (arena, elements, 2);
+  CHECK (pair_type != NULL);
+  CHECK (pair_type->size == sizeof (struct pair));
+  CHECK (ffi_arena_struct (arena, elements, 0) == NULL);
+
+  args[0] = pair_type;
+  args[1] = &ffi_type_sint;
+  cif = ffi_arena_prep_cif (arena, FFI_DEFAULT_ABI, &ffi_type_double, 2,
+			    args, 0);
+  CHECK (cif != NULL);
+  CHECK (cif->arg_types != args);
+  CHECK (cif->arg_types[0] == pair_type);
+  values[0] = &p;
+  values[1] = &k;
+  ffi_call (cif, FFI_FN (sum_pair), &d, values);
+  CHECK (d == 13.5);
+
+  /* A failed preparation returns NULL.  */
+  args[1] = &ffi_type_float;
+  CHECK (ffi_arena_prep_cif (arena, FFI_DEFAULT_ABI, &ffi_type_sint, 2,
+			     args, 1) == NULL);
+
+  /* Allocations larger than a block still work, and are aligned.  */
+  big = ffi_arena_alloc (arena, 1 << 20);
+  CHECK (big != NULL);
+  CHECK (((uintptr_t) big & 15) == 0);
+  memset (big, 0, 1 << 20);
+
+  args[0] = &ffi_type_sint;
+  cif = ffi_arena_prep_cif (arena, FFI_DEFAULT_ABI, &ffi_type_sint, 1,
+			    args, 0);
+  CHECK (cif != NULL);
+  for (i = 0; i < N; i++)
+    {
+      data = ffi_arena_alloc (arena, sizeof (int));
+      CHECK (data != NULL);
+      *data = i;
+      pcl = ffi_arena_closure_alloc (arena, sizeof (ffi_closure), &code);
+      CHECK (pcl != NULL);
+      CHECK (ffi_prep_closure_loc (pcl, cif, add_fn, data, code) == FFI_OK);
+      CHECK (((add_t) code) (1) == i + 1);
+    }
+
+  ffi_closure_get_stats (&during);
+  ffi_arena_destroy (arena);
+  ffi_closure_get_stats (&after);
+
+  if (during.allocs != before.allocs)
+    {
+      /* This platform keeps statistics.  */
+      CHECK (during.live - before.live == N);
+      CHECK (after.live == before.live);
+    }
+
+  exit (0);
+}
@@ -0,0 +1,169 @@
+/* Area:	ffi_prep_closure_bind
+   Purpose:	Check that bind closures prepend their data to the
+		arguments, both when the arguments can be shifted in
+		registers and when they cannot, and for variadic cifs.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+#include <stdarg.h>
+
+typedef struct { long a, b, c; } big;
+typedef struct { double d; long l; } dbl_long;
+
+static int *counter;
+
+static int
+add3 (int *data, int a, short b, double c)
+{
+  CHECK (data == counter);
+  return *data + a + b + (int) c;
+}
+
+static dbl_long
+pair (int *data, dbl_long p, float f)
+{
+  dbl_long r;
+
+  CHECK (data == counter);
+  r.d = p.d + f;
+  r.l = p.l + *data;
+  return r;
+}
+
+static big
+make_big (int *data, long a, long b)
+{
+  big r;
+
+  CHECK (data == counter);
+  r.a = a;
+  r.b = b;
+  r.c = *data;
+  return r;
+}
+
+/* Six integer arguments leave no register for the data.  */
+static long
+sum6 (int *data, long a, long b, long c, long d, long e, long f)
+{
+  CHECK (data == counter);
+  return *data + a + b + c + d + e + f;
+}
+
+static long
+sum_big (int *data, big x, long y)
+{
+  CHECK (data == counter);
+  return *data + x.a + x.b + x.c + y;
+}
+
+static double
+va_sum (int *data, int n, ...)
+{
+  double r = *data;
+  va_list ap;
+
+  CHECK (data == counter);
+  va_start (ap, n);
+  while (n--)
+    r += va_arg (ap, double);
+  va_end (ap);
+  return r;
+}
+
+static void *
+bind (ffi_cif *cif, void (*target)(void))
+{
+  ffi_bind_closure *closure;
+  void *code;
+
+  closure = ffi_closure_alloc (sizeof (ffi_bind_closure), &code);
+  CHECK (closure != NULL);
+  CHECK (ffi_prep_closure_bind (closure, cif, target, counter, code)
+	 == FFI_OK);
+  return code;
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[MAX_ARGS];
+  ffi_type big_type, dbl_long_type;
+  ffi_type *big_elts[] = { &ffi_type_slong, &ffi_type_slong,
+			   &ffi_type_slong, NULL };
+  ffi_type *dbl_long_elts[] = { &ffi_type_double, &ffi_type_slong, NULL };
+  int data = 1000;
+  int i;
+
+  counter = &data;
+
+  big_type.size = big_type.alignment = 0;
+  big_type.type = FFI_TYPE_STRUCT;
+  big_type.elements = big_elts;
+  dbl_long_type = big_type;
+  dbl_long_type.elements = dbl_long_elts;
+
+  args[0] = &ffi_type_sint;
+  args[1] = &ffi_type_sshort;
+  args[2] = &ffi_type_double;
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 3, &ffi_type_sint, args)
+	 == FFI_OK);
+  CHECK (((int (*)(int, short, double)) bind (&cif, FFI_FN (add3)))
+	 (1, -2, 3.5) == 1002);
+
+  {
+    dbl_long p = { 1.5, 20 }, r;
+
+    args[0] = &dbl_long_type;
+    args[1] = &ffi_type_float;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &dbl_long_type, args)
+	   == FFI_OK);
+    r = ((dbl_long (*)(dbl_long, float)) bind (&cif, FFI_FN (pair)))
+	(p, 0.25f);
+    CHECK (r.d == 1.75 && r.l == 1020);
+  }
+
+  {
+    big r;
+
+    args[0] = &ffi_type_slong;
+    args[1] = &ffi_type_slong;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &big_type, args)
+	   == FFI_OK);
+    r = ((big (*)(long, long)) bind (&cif, FFI_FN (make_big))) (5, 6);
+    CHECK (r.a == 5 && r.b == 6 && r.c == 1000);
+  }
+
+  for (i = 0; i < 6; i++)
+    args[i] = &ffi_type_slong;
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 6, &ffi_type_slong, args)
+	 == FFI_OK);
+  CHECK (((long (*)(long, long, long, long, long, long))
+	  bind (&cif, FFI_FN (sum6))) (1, 2, 3, 4, 5, 6) == 1021);
+
+  {
+    big x = { 1, 2, 3 };
+
+    args[0] = &big_type;
+    args[1] = &ffi_type_slong;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &ffi_type_slong, args)
+	   == FFI_OK);
+    CHECK (((long (*)(big, long)) bind (&cif, FFI_FN (sum_big))) (x, 4)
+	   == 1010);
+  }
+
+  /* The target of a variadic closure has one more fixed argument.  */
+  args[0] = &ffi_type_sint;
+  args[1] = &ffi_type_double;
+  args[2] = &ffi_type_double;
+  CHECK (ffi_prep_cif_var (&cif, FFI_DEFAULT_ABI, 1, 3, &ffi_type_double,
+			   args) == FFI_OK);
+  CHECK (((double (*)(int, ...)) bind (&cif, FFI_FN (va_sum)))
+	 (2, 0.5, 0.25) == 1000.75);
+
+  exit (0);
+}
@@ -0,0 +1,126 @@
+/* Area:	ffi_closure_alloc, ffi_closure_free
+   Purpose:	Check closures mapped twice from a temporary file, freed
+		through their executable address.
+   Limitations:	64-bit Linux only, where the test can stand in for mmap.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#if defined __linux__ && !defined __ANDROID__ && defined __LP64__
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int refused;
+
+/* Stand in for the C library's mmap, as a hardened kernel would:
+   private executable mappings, anonymous or not, are refused.  That
+   rules out writable and executable pages and static trampolines, and
+   leaves libffi the shared mappings of a temporary file.  */
+void *
+mmap (void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+  if ((prot & PROT_EXEC) && (flags & MAP_PRIVATE))
+    {
+      refused++;
+      errno = EACCES;
+      return MAP_FAILED;
+    }
+  return (void *) syscall (SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+#define N 2000
+
+static void
+add_fn (ffi_cif *cif __UNUSED__, void *resp, void **args, void *userdata)
+{
+  *(ffi_arg *) resp = *(int *) args[0] + (int) (intptr_t) userdata;
+}
+
+typedef int (*add_t) (int);
+
+static ffi_closure *pcl[N];
+static void *code[N];
+
+static void
+alloc_all (ffi_cif *cif, int from, int step)
+{
+  int i;
+
+  for (i = from; i < N; i += step)
+    {
+      /* Some closures are too large for the per-thread cache.  */
+      pcl[i] = ffi_closure_alloc (sizeof (ffi_closure) + (i % 10 ? 0 : 4096),
+				  &code[i]);
+      CHECK (pcl[i] != NULL);
+      CHECK (ffi_prep_closure_loc (pcl[i], cif, add_fn,
+				   (void *) (intptr_t) i, code[i]) == FFI_OK);
+    }
+}
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[1] = { &ffi_type_sint };
+  int i;
+
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 1, &ffi_type_sint, args)
+	 == FFI_OK);
+
+  alloc_all (&cif, 0, 1);
+  if (refused == 0 || (void *) pcl[0] == code[0])
+    {
+      /* libffi did not call this mmap, or mapped no temporary file;
+	 nothing to check.  */
+      for (i = 0; i < N; i++)
+	ffi_closure_free (pcl[i]);
+      exit (0);
+    }
+
+  for (i = 0; i < N; i++)
+    {
+      CHECK ((void *) pcl[i] != code[i]);
+      CHECK (((add_t) code[i]) (7) == i + 7);
+    }
+
+  /* Free every other closure through its executable address, and the
+     rest through the writable one, then allocate the first lot again
+     from the memory just freed.  */
+  for (i = 0; i < N; i += 2)
+    ffi_closure_free (code[i]);
+  for (i = 1; i < N; i += 2)
+    CHECK (((add_t) code[i]) (7) == i + 7);
+  alloc_all (&cif, 0, 2);
+  for (i = 0; i < N; i++)
+    CHECK (((add_t) code[i]) (1) == i + 1);
+
+  /* Trimming unmaps both views of memory that is no longer used; the
+     index must forget them so that later allocations are found.  */
+  for (i = 0; i < N; i++)
+    ffi_closure_free (i % 2 ? (void *) pcl[i] : code[i]);
+  ffi_closure_trim (0);
+
+  alloc_all (&cif, 0, 1);
+  for (i = 0; i < N; i++)
+    {
+      CHECK ((void *) pcl[i] != code[i]);
+      CHECK (((add_t) code[i]) (3) == i + 3);
+      ffi_closure_free (code[i]);
+    }
+
+  exit (0);
+}
+
+#else
+
+int main (void)
+{
+  exit (0);
+}
+
+#endif
@@ -0,0 +1,61 @@
+/* Area:	ffi_closure_pool_create, ffi_closure_pool_get,
+		ffi_closure_pool_put
+   Purpose:	Check that pooled closures can be prepared, called,
+		returned and handed out again.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#define N 5
+
+static void
+add_fn (ffi_cif *cif __UNUSED__, void *resp, void **args, void *userdata)
+{
+  *(ffi_arg *) resp = *(int *) args[0] + (int) (intptr_t) userdata;
+}
+
+typedef int (*add_t) (int);
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[1] = { &ffi_type_sint };
+  ffi_closure_pool *pool;
+  ffi_closure *pcl[N];
+  void *code[N], *extra;
+  int i, j;
+
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 1, &ffi_type_sint, args)
+	 == FFI_OK);
+
+  pool = ffi_closure_pool_create (N, sizeof (ffi_closure));
+  CHECK (pool != NULL);
+
+  for (j = 0; j < 3; j++)
+    {
+      for (i = 0; i < N; i++)
+	{
+	  pcl[i] = ffi_closure_pool_get (pool, &code[i]);
+	  CHECK (pcl[i] != NULL);
+	  CHECK (ffi_prep_closure_loc (pcl[i], &cif, add_fn,
+				       (void *) (intptr_t) (i * 100 + j),
+				       code[i]) == FFI_OK);
+	}
+      CHECK (ffi_closure_pool_get (pool, &extra) == NULL);
+
+      for (i = 0; i < N; i++)
+	CHECK (((add_t) code[i]) (7) == i * 100 + j + 7);
+
+      /* Put them back in a different order from the one they came
+	 out in.  */
+      for (i = 0; i < N; i++)
+	ffi_closure_pool_put (pool, pcl[(i * 2) % N]);
+    }
+
+  ffi_closure_pool_destroy (pool);
+  exit (0);
+}
@@ -0,0 +1,81 @@
+/* Area:	ffi_closure_get_stats, ffi_closure_trim
+   Purpose:	Check that the closure counters follow allocations and
+		frees, and that trimming keeps the remaining closures
+		usable.
+   Limitations:	none.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#define N 1000
+
+static void
+add_fn (ffi_cif *cif __UNUSED__, void *resp, void **args, void *userdata)
+{
+  *(ffi_arg *) resp = *(int *) args[0] + (int) (intptr_t) userdata;
+}
+
+typedef int (*add_t) (int);
+
+static ffi_closure *pcl[N];
+static void *code[N];
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[1] = { &ffi_type_sint };
+  ffi_closure_stats before, during, after;
+  int i;
+
+  CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 1, &ffi_type_sint, args)
+	 == FFI_OK);
+
+  ffi_closure_get_stats (&before);
+
+  for (i = 0; i < N; i++)
+    {
+      /* Every tenth closure is too large for the per-thread cache.  */
+      pcl[i] = ffi_closure_alloc (sizeof (ffi_closure) + (i % 10 ? 0 : 4096),
+				  &code[i]);
+      CHECK (pcl[i] != NULL);
+      CHECK (ffi_prep_closure_loc (pcl[i], &cif, add_fn,
+				   (void *) (intptr_t) i, code[i]) == FFI_OK);
+    }
+
+  ffi_closure_get_stats (&during);
+  if (during.allocs == before.allocs)
+    /* This platform keeps no statistics.  */
+    exit (0);
+
+  CHECK (during.allocs - before.allocs == N);
+  CHECK (during.live - before.live == N);
+  CHECK (during.frees == before.frees);
+  CHECK (during.segments > 0);
+  CHECK (during.segment_bytes >= N * sizeof (ffi_closure));
+  CHECK (during.footprint > 0 && during.footprint <= during.max_footprint);
+  CHECK (during.exec_mappings > 0);
+  CHECK (during.tramp_used >= during.tramp_tables);
+
+  /* Free all but every hundredth closure, then trim.  */
+  for (i = 0; i < N; i++)
+    if (i % 100 != 0)
+      ffi_closure_free (pcl[i]);
+  ffi_closure_trim (0);
+
+  ffi_closure_get_stats (&after);
+  CHECK (after.frees - before.frees == N - N / 100);
+  CHECK (after.live - before.live == N / 100);
+  CHECK (after.footprint <= during.footprint);
+  CHECK (after.tramp_tables <= during.tramp_tables);
+
+  for (i = 0; i < N; i += 100)
+    {
+      CHECK (((add_t) code[i]) (7) == i + 7);
+      ffi_closure_free (pcl[i]);
+    }
+
+  exit (0);
+}
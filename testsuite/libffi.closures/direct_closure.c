@@ -0,0 +1,196 @@
+/* Area:	ffi_prep_direct_closure
+   Purpose:	Check that direct closures lay out their arguments as
+		requested and return their handler's value.
+   Limitations:	Only where FFI_DIRECT_CLOSURES is defined.
+   PR:		none.
+   Originator:	libffi  */
+
+/* { dg-do run } */
+
+#include "ffitest.h"
+
+#ifdef FFI_DIRECT_CLOSURES
+
+typedef struct { unsigned char a, b, c; } odd3;
+typedef struct { float x, y, z; } float3;
+typedef struct { double d; int i; } dbl_int;
+typedef struct { long a, b, c, d; } big;
+
+/* The packed layout of (char, odd3, float3, short, dbl_int).  */
+struct mixed_args
+{
+  signed char c;
+  odd3 s;
+  float3 f;
+  short h;
+  dbl_int di;
+};
+
+static dbl_int
+mixed_handler (struct mixed_args *a, void *user_data)
+{
+  dbl_int r;
+
+  r.d = a->f.x + a->f.y + a->f.z + a->di.d;
+  r.i = a->c + a->s.a + a->s.b + a->s.c + a->h + a->di.i
+	+ *(int *) user_data;
+  return r;
+}
+
+typedef dbl_int (*mixed_fn) (signed char, odd3, float3, short, dbl_int);
+
+/* A register image: the doubles first, then the integers.  */
+struct many_args
+{
+  double d[10];
+  long l[8];
+};
+
+static double
+many_handler (struct many_args *a, void *user_data __UNUSED__)
+{
+  double r = 0;
+  int i;
+
+  for (i = 0; i < 10; i++)
+    r += a->d[i] * (i + 1);
+  for (i = 0; i < 8; i++)
+    r += a->l[i] * (i + 1);
+  return r;
+}
+
+typedef double (*many_fn) (double, long, double, long, double, long,
+			   double, long, double, long, double, long,
+			   double, long, double, long, double, double);
+
+struct big_args
+{
+  big b;
+  int k;
+};
+
+static big
+big_handler (struct big_args *a, void *user_data __UNUSED__)
+{
+  big r;
+
+  r.a = a->b.d * a->k;
+  r.b = a->b.c * a->k;
+  r.c = a->b.b * a->k;
+  r.d = a->b.a * a->k;
+  return r;
+}
+
+typedef big (*big_fn) (big, int);
+
+int main (void)
+{
+  ffi_cif cif;
+  ffi_type *args[MAX_ARGS];
+  void *code;
+  int i;
+
+  /* Mixed classes, packed layout and a structure returned in
+     registers.  */
+  {
+    ffi_type odd3_type, float3_type, dbl_int_type;
+    ffi_type *odd3_elts[] = { &ffi_type_uchar, &ffi_type_uchar,
+			      &ffi_type_uchar, NULL };
+    ffi_type *float3_elts[] = { &ffi_type_float, &ffi_type_float,
+				&ffi_type_float, NULL };
+    ffi_type *dbl_int_elts[] = { &ffi_type_double, &ffi_type_sint, NULL };
+    odd3 s = { 1, 2, 3 };
+    float3 f = { 1.5f, 2.5f, 3.5f };
+    dbl_int di = { 4.25, 40 }, r;
+    int extra = 1000;
+
+    odd3_type.size = odd3_type.alignment = 0;
+    odd3_type.type = FFI_TYPE_STRUCT;
+    odd3_type.elements = odd3_elts;
+    float3_type = odd3_type;
+    float3_type.elements = float3_elts;
+    dbl_int_type = odd3_type;
+    dbl_int_type.elements = dbl_int_elts;
+
+    args[0] = &ffi_type_schar;
+    args[1] = &odd3_type;
+    args[2] = &float3_type;
+    args[3] = &ffi_type_sshort;
+    args[4] = &dbl_int_type;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 5, &dbl_int_type, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_direct_closure (&cif, NULL, FFI_FN (mixed_handler),
+				    &extra, &code) == FFI_OK);
+    r = ((mixed_fn) code) (-7, s, f, -300, di);
+    CHECK (r.d == 1.5 + 2.5 + 3.5 + 4.25);
+    CHECK (r.i == -7 + 1 + 2 + 3 - 300 + 40 + 1000);
+    ffi_direct_closure_free (code);
+  }
+
+  /* Explicit offsets, and arguments spilled to the stack.  */
+  {
+    unsigned offsets[18];
+    double r, e = 0;
+
+    for (i = 0; i < 18; i++)
+      {
+	int k = i / 2;
+
+	if (i % 2 == 0 || i == 17)
+	  {
+	    args[i] = &ffi_type_double;
+	    offsets[i] = offsetof (struct many_args, d) + (i == 17 ? 9 : k)
+			 * sizeof (double);
+	  }
+	else
+	  {
+	    args[i] = &ffi_type_slong;
+	    offsets[i] = offsetof (struct many_args, l) + k * sizeof (long);
+	  }
+      }
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 18, &ffi_type_double, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_direct_closure (&cif, offsets, FFI_FN (many_handler),
+				    NULL, &code) == FFI_OK);
+    r = ((many_fn) code) (0.5, 1, 1.5, 2, 2.5, 3, 3.5, 4, 4.5, 5, 5.5, 6,
+			  6.5, 7, 7.5, 8, 8.5, 9.5);
+    for (i = 0; i < 9; i++)
+      e += (i + 0.5) * (i + 1) + (i < 8 ? (i + 1) * (i + 1) : 0);
+    e += 9.5 * 10;
+    CHECK (r == e);
+    ffi_direct_closure_free (code);
+  }
+
+  /* A structure passed on the stack and returned in memory.  */
+  {
+    ffi_type big_type;
+    ffi_type *big_elts[] = { &ffi_type_slong, &ffi_type_slong,
+			     &ffi_type_slong, &ffi_type_slong, NULL };
+    big a = { 1, 2, 3, 4 }, r;
+
+    big_type.size = big_type.alignment = 0;
+    big_type.type = FFI_TYPE_STRUCT;
+    big_type.elements = big_elts;
+
+    args[0] = &big_type;
+    args[1] = &ffi_type_sint;
+    CHECK (ffi_prep_cif (&cif, FFI_DEFAULT_ABI, 2, &big_type, args)
+	   == FFI_OK);
+    CHECK (ffi_prep_direct_closure (&cif, NULL, FFI_FN (big_handler),
+				    NULL, &code) == FFI_OK);
+    r = ((big_fn) code) (a, 3);
+    CHECK (r.a == 12 && r.b == 9 && r.c == 6 && r.d == 3);
+    ffi_direct_closure_free (code);
+  }
+
+  exit (0);
+}
+
+#else
+
+int main (void)
+{
+  exit (0);
+}
+
+#endif
@@ -53,5 +53,22 @@ int main (void)
     printf("part one OK\n");
     /* { dg-output "part one OK" } */
   }
+
+#ifdef FFI_BOUND_CALLS
+  {
+    ffi_bound_fn stub;
+
+    CHECK(ffi_prep_bound_call(&cif, FFI_FN(checking), &stub) == FFI_OK);
+    try
+      {
+	stub(&rint, values);
+	CHECK(0);
+      } catch (int exception_code)
+      {
+	CHECK(exception_code == 9);
+      }
+    ffi_bound_call_free(stub);
+  }
+#endif
   exit(0);
 }
@@ -5,9 +5,19 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #define NUM_THREADS 20
 
+/* Then allocate, call and free closures from 1 to MAX_THREADS threads,
+   each keeping WINDOW closures live at a time, and check that every
+   call sees its own closure's data and that the time per closure does
+   not grow by more than MAX_SLOWDOWN as threads are added.  */
+#define MAX_THREADS 64
+#define ITERATIONS 20000
+#define WINDOW 8
+#define MAX_SLOWDOWN 8
+
 #ifdef _POSIX_BARRIERS
 pthread_barrier_t barrier;
 #endif
@@ -47,6 +57,106 @@ void *thread_func(void *arg) {
     return NULL;
 }
 
+static ffi_cif scaling_cif;
+
+struct scaling_thread {
+    pthread_t thread;
+    int id;
+    int calls;
+    int bad;
+};
+
+void scaling_callback(ffi_cif *cif __UNUSED__, void *ret, void **args, void *userdata) {
+    *(int *)ret = *(int *)args[0] + *(int *)userdata;
+}
+
+void *scaling_func(void *arg) {
+    struct scaling_thread *t = arg;
+    ffi_closure *closures[WINDOW];
+    void *codes[WINDOW];
+    int data[WINDOW];
+    int i, j;
+
+    for (i = 0; i < ITERATIONS + WINDOW; i++) {
+        j = i % WINDOW;
+        if (i >= WINDOW) {
+            /* Call the oldest closure, then replace it.  */
+            if (((int (*)(int))codes[j])(1) == data[j] + 1)
+                t->calls++;
+            else
+                t->bad++;
+            ffi_closure_free(closures[j]);
+        }
+        if (i >= ITERATIONS)
+            continue;
+
+        /* Alternate two sizes so that more than one size class is used.  */
+        closures[j] = ffi_closure_alloc(sizeof(ffi_closure) + (i & 1) * 32, &codes[j]);
+        if (closures[j] == NULL) {
+            fprintf(stderr, "ffi_closure_alloc failed\n");
+            abort();
+        }
+        data[j] = t->id * ITERATIONS + i;
+        if (ffi_prep_closure_loc(closures[j], &scaling_cif, scaling_callback,
+                                 &data[j], codes[j]) != FFI_OK) {
+            fprintf(stderr, "ffi_prep_closure_loc failed\n");
+            abort();
+        }
+    }
+    return NULL;
+}
+
+/* Run N threads and return the wall time per closure in ns.  */
+static double scaling_run(int n) {
+    struct scaling_thread threads[MAX_THREADS];
+    struct timespec start, end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; ++i) {
+        threads[i].id = i;
+        threads[i].calls = 0;
+        threads[i].bad = 0;
+        if (pthread_create(&threads[i].thread, NULL, scaling_func, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < n; ++i)
+        pthread_join(threads[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < n; ++i) {
+        CHECK(threads[i].bad == 0);
+        CHECK(threads[i].calls == ITERATIONS);
+    }
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+           / ((double)n * ITERATIONS);
+}
+
+static void scaling(void) {
+    ffi_type *args[1] = { &ffi_type_sint };
+    double base = 0, t, best;
+    int n, k;
+
+    CHECK(ffi_prep_cif(&scaling_cif, FFI_DEFAULT_ABI, 1, &ffi_type_sint, args) == FFI_OK);
+
+    for (n = 1; n <= MAX_THREADS; n *= 2) {
+        /* Take the best of three runs, to be less at the mercy of other
+           load on the machine.  */
+        best = 0;
+        for (k = 0; k < 3; k++) {
+            t = scaling_run(n);
+            if (k == 0 || t < best)
+                best = t;
+        }
+        if (n == 1)
+            base = best;
+        printf("%2d threads: %8.1f ns per closure\n", n, best);
+        CHECK(best <= base * MAX_SLOWDOWN);
+    }
+}
+
 int main() {
     pthread_t threads[NUM_THREADS];
 
@@ -69,6 +179,8 @@ int main() {
     pthread_barrier_destroy(&barrier);
 #endif
 
+    scaling();
+
     printf("Completed\n");
     return 0;
 }